@@ -0,0 +1,736 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/magic.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/vfs.h>
+#include "queue.h"
+#endif /* __linux__ */
+
+#include "cgroup.h"
+#include "logger.h"
+#include "memory.h"
+
+static const char *supported_limits[] = {
+    "cpu.max",
+    "io.weight",
+    "memory.high",
+    "memory.max",
+    "pids.max",
+    NULL
+};
+
+bool
+cgroup_limit_is_supported(const char *name)
+{
+    const char **p;
+
+    for (p = &supported_limits[0]; *p; p++) {
+        if (!strcmp(*p, name))
+            return true;
+    }
+    return false;
+}
+
+#ifdef __linux__
+
+/* How often the leaves that could not be watched are polled */
+#define CGROUP_POLL_INTERVAL_SEC 1
+
+struct cgroup_job {
+    int64_t job_id;
+    char *label;
+    int dirfd;
+    int wd;             /* -1 if cgroup.events is polled instead */
+    bool active;        /* Prepared, and not yet released */
+    uint64_t oom_kill_base;
+    uint64_t user_usec_base;
+    uint64_t system_usec_base;
+    LIST_ENTRY(cgroup_job) entries;
+};
+
+static struct {
+    bool enabled;
+    char *jobs_path;     /* Absolute path to the parent of all job leaves */
+    char *jobs_relpath;  /* The same, relative to the root of the hierarchy */
+    int jobs_dirfd;
+    int inotify_fd;
+    int poll_fd;        /* A timerfd, armed once a leaf cannot be watched */
+    bool polling;
+} cg = {
+        .jobs_dirfd = -1,
+        .inotify_fd = -1,
+        .poll_fd = -1,
+};
+
+static LIST_HEAD(, cgroup_job) cgroup_jobs;
+
+/* Write a short string to a cgroup control file. Does not log, so errno is preserved. */
+static int
+write_file_at(int dirfd, const char *name, const char *buf)
+{
+    int fd, saved_errno;
+    ssize_t len = (ssize_t) strlen(buf);
+
+    fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return (-1);
+    if (write(fd, buf, len) != len) {
+        saved_errno = errno;
+        (void) close(fd);
+        errno = saved_errno;
+        return (-1);
+    }
+    return close(fd);
+}
+
+static int
+read_file_at(int dirfd, const char *name, char *buf, size_t bufsz)
+{
+    int fd;
+    ssize_t len;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return printlog(LOG_ERR, "open(2) of %s: %s", name, strerror(errno));
+    len = read(fd, buf, bufsz - 1);
+    (void) close(fd);
+    if (len < 0)
+        return printlog(LOG_ERR, "read(2) of %s: %s", name, strerror(errno));
+    buf[len] = '\0';
+    return 0;
+}
+
+/* Returns zero if the memory controller is not enabled in the leaf */
+static uint64_t
+read_oom_kill_count(int dirfd)
+{
+    char buf[512];
+    const char *p;
+    ssize_t len;
+    int fd;
+
+    fd = openat(dirfd, "memory.events", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    (void) close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    p = strstr(buf, "oom_kill ");
+    return (p ? strtoull(p + strlen("oom_kill "), NULL, 10) : 0);
+}
+
+/* cpu.stat is always present, even when the cpu controller is not enabled */
+static int
+read_cpu_usage(uint64_t *user_usec, uint64_t *system_usec, int dirfd)
+{
+    char buf[1024];
+    const char *p;
+
+    *user_usec = 0;
+    *system_usec = 0;
+    if (read_file_at(dirfd, "cpu.stat", buf, sizeof(buf)) < 0)
+        return (-1);
+    if ((p = strstr(buf, "user_usec ")))
+        *user_usec = strtoull(p + strlen("user_usec "), NULL, 10);
+    if ((p = strstr(buf, "system_usec ")))
+        *system_usec = strtoull(p + strlen("system_usec "), NULL, 10);
+    return 0;
+}
+
+/* Allow job leaves to use the controllers that resource limits depend on */
+static void
+enable_controllers(int dirfd, const char *path)
+{
+    static const char *controllers[] = { "+cpu", "+io", "+memory", "+pids", NULL };
+    const char **p;
+
+    for (p = &controllers[0]; *p; p++) {
+        if (write_file_at(dirfd, "cgroup.subtree_control", *p) < 0)
+            printlog(LOG_DEBUG, "unable to enable the %s controller below %s: %s",
+                    *p + 1, path, strerror(errno));
+    }
+}
+
+static const char *
+find_cgroup2_mount(void)
+{
+    static const char *candidates[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified", NULL };
+    const char **p;
+    struct statfs sfs;
+
+    for (p = &candidates[0]; *p; p++) {
+        if (statfs(*p, &sfs) == 0 && sfs.f_type == CGROUP2_SUPER_MAGIC)
+            return *p;
+    }
+    return NULL;
+}
+
+/* Find the cgroup v2 path of a process, relative to the root of the hierarchy */
+static int
+get_process_cgroup(char **result, pid_t pid)
+{
+    FILE CLEANUP_FILE *fh = NULL;
+    char path[64];
+    char *line = NULL;
+    size_t linecap = 0;
+
+    *result = NULL;
+    if (pid)
+        snprintf(path, sizeof(path), "/proc/%d/cgroup", (int) pid);
+    else
+        snprintf(path, sizeof(path), "/proc/self/cgroup");
+    fh = fopen(path, "re");
+    if (!fh)
+        return (-1);
+
+    while (getline(&line, &linecap, fh) > 0) {
+        if (strncmp(line, "0::", 3))
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        *result = strdup(line + 3);
+        break;
+    }
+    free(line);
+    return (*result ? 0 : -1);
+}
+
+static struct cgroup_job *
+cgroup_job_lookup(int64_t job_id)
+{
+    struct cgroup_job *cj;
+
+    LIST_FOREACH(cj, &cgroup_jobs, entries) {
+        if (cj->job_id == job_id)
+            return cj;
+    }
+    return NULL;
+}
+
+static struct cgroup_job *
+cgroup_job_lookup_by_wd(int wd)
+{
+    struct cgroup_job *cj;
+
+    LIST_FOREACH(cj, &cgroup_jobs, entries) {
+        if (cj->wd == wd)
+            return cj;
+    }
+    return NULL;
+}
+
+int
+cgroup_init(void)
+{
+    const char *mountpoint;
+    char CLEANUP_STR *self = NULL;
+    char CLEANUP_STR *base = NULL;
+    char pidbuf[32];
+    int basefd;
+
+    LIST_INIT(&cgroup_jobs);
+
+    mountpoint = find_cgroup2_mount();
+    if (!mountpoint) {
+        printlog(LOG_DEBUG, "cgroup v2 is not mounted; jobs will not be placed in cgroups");
+        return 0;
+    }
+    if (get_process_cgroup(&self, 0) < 0) {
+        printlog(LOG_DEBUG, "unable to determine the cgroup of jobd");
+        return 0;
+    }
+
+    /* Never take over the root of somebody else's hierarchy */
+    if (!strcmp(self, "/") && getpid() != 1) {
+        printlog(LOG_DEBUG, "cgroup hierarchy has not been delegated to jobd");
+        return 0;
+    }
+
+    if (asprintf(&base, "%s%s", mountpoint, strcmp(self, "/") ? self : "") < 0) {
+        base = NULL;
+        return printlog(LOG_ERR, "asprintf(3): %s", strerror(errno));
+    }
+    if (access(base, W_OK) < 0) {
+        printlog(LOG_DEBUG, "cgroup %s is not writable; not delegated to jobd", base);
+        return 0;
+    }
+
+    basefd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (basefd < 0)
+        return printlog(LOG_ERR, "open(2) of %s: %s", base, strerror(errno));
+
+    /* Processes may only live in leaves, so jobd moves itself out of the way */
+    snprintf(pidbuf, sizeof(pidbuf), "%d", (int) getpid());
+    if ((mkdirat(basefd, "supervisor", 0755) < 0 && errno != EEXIST) ||
+        write_file_at(basefd, "supervisor/cgroup.procs", pidbuf) < 0) {
+        printlog(LOG_WARNING, "unable to move jobd into %s/supervisor: %s", base, strerror(errno));
+        (void) close(basefd);
+        return 0;
+    }
+    if (mkdirat(basefd, "jobs", 0755) < 0 && errno != EEXIST) {
+        printlog(LOG_WARNING, "mkdir(2) of %s/jobs: %s", base, strerror(errno));
+        (void) close(basefd);
+        return 0;
+    }
+    cg.jobs_dirfd = openat(basefd, "jobs", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg.jobs_dirfd < 0) {
+        (void) close(basefd);
+        return printlog(LOG_ERR, "open(2) of %s/jobs: %s", base, strerror(errno));
+    }
+    enable_controllers(basefd, base);
+    enable_controllers(cg.jobs_dirfd, "jobs");
+    (void) close(basefd);
+
+    cg.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cg.inotify_fd < 0)
+        return printlog(LOG_ERR, "inotify_init1(2): %s", strerror(errno));
+    cg.poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (cg.poll_fd < 0)
+        return printlog(LOG_ERR, "timerfd_create(2): %s", strerror(errno));
+
+    if (asprintf(&cg.jobs_path, "%s/jobs", base) < 0 ||
+        asprintf(&cg.jobs_relpath, "%s/jobs", strcmp(self, "/") ? self : "") < 0)
+        return printlog(LOG_ERR, "asprintf(3): %s", strerror(errno));
+
+    cg.enabled = true;
+    printlog(LOG_INFO, "jobs will be placed in cgroups below %s", cg.jobs_path);
+    return 0;
+}
+
+void
+cgroup_shutdown(void)
+{
+    struct cgroup_job *cj;
+
+    while ((cj = LIST_FIRST(&cgroup_jobs))) {
+        LIST_REMOVE(cj, entries);
+        (void) close(cj->dirfd);
+        /* Fails harmlessly if anything is still running in the leaf */
+        (void) unlinkat(cg.jobs_dirfd, cj->label, AT_REMOVEDIR);
+        free(cj->label);
+        free(cj);
+    }
+    if (cg.inotify_fd >= 0)
+        (void) close(cg.inotify_fd);
+    if (cg.poll_fd >= 0)
+        (void) close(cg.poll_fd);
+    if (cg.jobs_dirfd >= 0)
+        (void) close(cg.jobs_dirfd);
+    free(cg.jobs_path);
+    free(cg.jobs_relpath);
+    memset(&cg, 0, sizeof(cg));
+    cg.jobs_dirfd = -1;
+    cg.inotify_fd = -1;
+    cg.poll_fd = -1;
+}
+
+/* Without a watch, the exit of descendants is only noticed by polling */
+static int
+start_polling(void)
+{
+    struct itimerspec its = {
+        .it_interval = { .tv_sec = CGROUP_POLL_INTERVAL_SEC },
+        .it_value = { .tv_sec = CGROUP_POLL_INTERVAL_SEC },
+    };
+
+    if (cg.polling)
+        return 0;
+    if (timerfd_settime(cg.poll_fd, 0, &its, NULL) < 0)
+        return printlog(LOG_ERR, "timerfd_settime(2): %s", strerror(errno));
+    cg.polling = true;
+    return 0;
+}
+
+/* Once no leaf without a watch has a job in it, there is nothing to poll */
+static int
+stop_polling(void)
+{
+    struct itimerspec its;
+    struct cgroup_job *cj;
+
+    if (!cg.polling)
+        return 0;
+    LIST_FOREACH(cj, &cgroup_jobs, entries) {
+        if (cj->wd < 0 && cj->active)
+            return 0;
+    }
+    memset(&its, 0, sizeof(its));
+    if (timerfd_settime(cg.poll_fd, 0, &its, NULL) < 0)
+        return printlog(LOG_ERR, "timerfd_settime(2): %s", strerror(errno));
+    cg.polling = false;
+    return 0;
+}
+
+bool
+cgroup_enabled(void)
+{
+    return cg.enabled;
+}
+
+int
+cgroup_job_prepare(int64_t job_id, const char *label)
+{
+    struct cgroup_job *cj;
+    char CLEANUP_STR *events_path = NULL;
+    int fd;
+
+    if (!cg.enabled)
+        return printlog(LOG_ERR, "cgroups are not enabled");
+
+    cj = cgroup_job_lookup(job_id);
+    if (!cj) {
+        if (label[0] == '\0' || label[0] == '.' || strchr(label, '/'))
+            return printlog(LOG_ERR, "`%s' cannot be used as a cgroup name", label);
+        if (mkdirat(cg.jobs_dirfd, label, 0755) < 0 && errno != EEXIST)
+            return printlog(LOG_ERR, "mkdir(2) of %s/%s: %s", cg.jobs_path, label, strerror(errno));
+
+        cj = calloc(1, sizeof(*cj));
+        if (!cj)
+            return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        cj->job_id = job_id;
+        cj->label = strdup(label);
+        cj->dirfd = openat(cg.jobs_dirfd, label, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!cj->label || cj->dirfd < 0) {
+            printlog(LOG_ERR, "unable to open cgroup %s: %s", label, strerror(errno));
+            if (cj->dirfd >= 0)
+                (void) close(cj->dirfd);
+            free(cj->label);
+            free(cj);
+            return (-1);
+        }
+        if (asprintf(&events_path, "%s/%s/cgroup.events", cg.jobs_path, label) < 0)
+            events_path = NULL;
+        cj->wd = events_path ? inotify_add_watch(cg.inotify_fd, events_path, IN_MODIFY) : -1;
+        if (cj->wd < 0) {
+            printlog(LOG_WARNING, "unable to watch %s: %s; polling it instead",
+                    events_path ? events_path : label, strerror(errno));
+            if (start_polling() < 0) {
+                (void) close(cj->dirfd);
+                free(cj->label);
+                free(cj);
+                return (-1);
+            }
+        }
+        LIST_INSERT_HEAD(&cgroup_jobs, cj, entries);
+    } else if (cj->wd < 0 && start_polling() < 0) {
+        return (-1);
+    }
+    cj->active = true;
+    cj->oom_kill_base = read_oom_kill_count(cj->dirfd);
+    (void) read_cpu_usage(&cj->user_usec_base, &cj->system_usec_base, cj->dirfd);
+
+    fd = openat(cj->dirfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return printlog(LOG_ERR, "open(2) of %s/%s/cgroup.procs: %s", cg.jobs_path, label, strerror(errno));
+    return fd;
+}
+
+int
+cgroup_job_attach(int procs_fd)
+{
+    if (write(procs_fd, "0", 1) != 1)
+        return (-1);
+    (void) close(procs_fd);
+    return 0;
+}
+
+int
+cgroup_job_attach_pid(int procs_fd, pid_t pid)
+{
+    char buf[32];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%d", (int) pid);
+    if (write(procs_fd, buf, (size_t) len) != len) {
+        printlog(LOG_ERR, "unable to move pid %d into its cgroup: %s", pid, strerror(errno));
+        (void) close(procs_fd);
+        return (-1);
+    }
+    (void) close(procs_fd);
+    return 0;
+}
+
+int
+cgroup_job_kill(int64_t job_id)
+{
+    struct cgroup_job *cj;
+    FILE *fh;
+    int fd, pid;
+
+    cj = cgroup_job_lookup(job_id);
+    if (!cj)
+        return 0;
+
+    printlog(LOG_DEBUG, "killing every process in cgroup %s", cj->label);
+    if (write_file_at(cj->dirfd, "cgroup.kill", "1") == 0)
+        return 0;
+    if (errno != ENOENT)
+        return printlog(LOG_ERR, "unable to write to %s/cgroup.kill: %s", cj->label, strerror(errno));
+
+    /* Kernels before 5.14 lack cgroup.kill, so freeze the leaf while signaling every member */
+    (void) write_file_at(cj->dirfd, "cgroup.freeze", "1");
+    fd = openat(cj->dirfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || !(fh = fdopen(fd, "r"))) {
+        if (fd >= 0)
+            (void) close(fd);
+        (void) write_file_at(cj->dirfd, "cgroup.freeze", "0");
+        return printlog(LOG_ERR, "unable to read %s/cgroup.procs: %s", cj->label, strerror(errno));
+    }
+    while (fscanf(fh, "%d", &pid) == 1) {
+        if (kill(pid, SIGKILL) < 0 && errno != ESRCH)
+            printlog(LOG_ERR, "kill(2) of pid %d: %s", pid, strerror(errno));
+    }
+    (void) fclose(fh);
+    (void) write_file_at(cj->dirfd, "cgroup.freeze", "0");
+    return 0;
+}
+
+int
+cgroup_job_is_populated(bool *result, int64_t job_id)
+{
+    struct cgroup_job *cj;
+    char buf[256];
+    const char *p;
+
+    *result = false;
+    cj = cgroup_job_lookup(job_id);
+    if (!cj)
+        return 0;
+    if (read_file_at(cj->dirfd, "cgroup.events", buf, sizeof(buf)) < 0)
+        return (-1);
+    p = strstr(buf, "populated ");
+    if (!p)
+        return printlog(LOG_ERR, "unexpected contents in %s/cgroup.events", cj->label);
+    *result = (p[strlen("populated ")] == '1');
+    return 0;
+}
+
+int
+cgroup_job_set_limit(int64_t job_id, const char *name, const char *value)
+{
+    struct cgroup_job *cj;
+
+    if (!cgroup_limit_is_supported(name))
+        return printlog(LOG_ERR, "unsupported cgroup limit: %s", name);
+    cj = cgroup_job_lookup(job_id);
+    if (!cj)
+        return printlog(LOG_ERR, "job has no cgroup; unable to set %s", name);
+    if (write_file_at(cj->dirfd, name, value) < 0) {
+        if (errno == ENOENT)
+            return printlog(LOG_ERR, "unable to set %s in cgroup %s: controller is not enabled",
+                    name, cj->label);
+        return printlog(LOG_ERR, "unable to set %s=%s in cgroup %s: %s",
+                name, value, cj->label, strerror(errno));
+    }
+    printlog(LOG_DEBUG, "cgroup %s: %s=%s", cj->label, name, value);
+    return 0;
+}
+
+int
+cgroup_job_get_oom_kills(uint64_t *result, int64_t job_id)
+{
+    struct cgroup_job *cj;
+    uint64_t count;
+
+    *result = 0;
+    cj = cgroup_job_lookup(job_id);
+    if (!cj)
+        return 0;
+    count = read_oom_kill_count(cj->dirfd);
+    if (count > cj->oom_kill_base)
+        *result = count - cj->oom_kill_base;
+    return 0;
+}
+
+int
+cgroup_job_get_cpu_usage(uint64_t *user_usec, uint64_t *system_usec, int64_t job_id)
+{
+    struct cgroup_job *cj;
+
+    *user_usec = 0;
+    *system_usec = 0;
+    cj = cgroup_job_lookup(job_id);
+    if (!cj)
+        return 1;
+    if (read_cpu_usage(user_usec, system_usec, cj->dirfd) < 0)
+        return (-1);
+    *user_usec = (*user_usec > cj->user_usec_base) ? *user_usec - cj->user_usec_base : 0;
+    *system_usec = (*system_usec > cj->system_usec_base) ? *system_usec - cj->system_usec_base : 0;
+    return 0;
+}
+
+int
+cgroup_get_notify_fd(void)
+{
+    return cg.inotify_fd;
+}
+
+int
+cgroup_dispatch_events(void (*on_empty)(int64_t job_id))
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    struct cgroup_job *cj;
+    bool populated;
+    ssize_t len;
+    char *p;
+
+    for (;;) {
+        len = read(cg.inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN)
+                return 0;
+            return printlog(LOG_ERR, "read(2): %s", strerror(errno));
+        }
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            cj = cgroup_job_lookup_by_wd(ev->wd);
+            if (!cj)
+                continue;
+            if (cgroup_job_is_populated(&populated, cj->job_id) < 0)
+                continue;
+            if (!populated) {
+                printlog(LOG_DEBUG, "cgroup %s is empty", cj->label);
+                on_empty(cj->job_id);
+            }
+        }
+    }
+}
+
+int
+cgroup_job_release(int64_t job_id)
+{
+    struct cgroup_job *cj;
+
+    cj = cgroup_job_lookup(job_id);
+    if (!cj)
+        return 0;
+    cj->active = false;
+    return (cj->wd < 0 ? stop_polling() : 0);
+}
+
+int
+cgroup_get_poll_fd(void)
+{
+    return cg.poll_fd;
+}
+
+int
+cgroup_poll_unwatched(void (*on_empty)(int64_t job_id))
+{
+    struct cgroup_job *cj, *cj_tmp;
+    uint64_t expirations;
+    bool populated;
+
+    if (read(cg.poll_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        return printlog(LOG_ERR, "read(2): %s", strerror(errno));
+    /* on_empty() may not remove the leaf, but be careful anyway */
+    LIST_FOREACH_SAFE(cj, &cgroup_jobs, entries, cj_tmp) {
+        if (cj->wd >= 0 || !cj->active)
+            continue;
+        if (cgroup_job_is_populated(&populated, cj->job_id) == 0 && !populated)
+            on_empty(cj->job_id);
+    }
+    return 0;
+}
+
+int
+cgroup_get_label_by_pid(char *label, size_t len, pid_t pid)
+{
+    char CLEANUP_STR *path = NULL;
+    size_t prefixlen;
+    const char *leaf;
+
+    label[0] = '\0';
+    if (!cg.enabled)
+        return 0;
+    if (get_process_cgroup(&path, pid) < 0)
+        return (-1);
+
+    prefixlen = strlen(cg.jobs_relpath);
+    if (strncmp(path, cg.jobs_relpath, prefixlen) || path[prefixlen] != '/')
+        return 0;
+    leaf = path + prefixlen + 1;
+
+    /* Jobs are free to create nested cgroups below their own leaf */
+    prefixlen = strcspn(leaf, "/");
+    if (prefixlen >= len)
+        return printlog(LOG_ERR, "buffer too small");
+    memcpy(label, leaf, prefixlen);
+    label[prefixlen] = '\0';
+    return 0;
+}
+
+#else
+
+int cgroup_init(void) { return 0; }
+void cgroup_shutdown(void) { }
+bool cgroup_enabled(void) { return false; }
+int cgroup_job_prepare(int64_t job_id __attribute__((unused)),
+        const char *label __attribute__((unused))) { return (-1); }
+int cgroup_job_attach(int procs_fd __attribute__((unused))) { return (-1); }
+int cgroup_job_attach_pid(int procs_fd __attribute__((unused)),
+        pid_t pid __attribute__((unused))) { return (-1); }
+int cgroup_job_kill(int64_t job_id __attribute__((unused))) { return 0; }
+int cgroup_job_is_populated(bool *result, int64_t job_id __attribute__((unused)))
+{
+    *result = false;
+    return 0;
+}
+int cgroup_job_set_limit(int64_t job_id __attribute__((unused)),
+        const char *name, const char *value __attribute__((unused)))
+{
+    return printlog(LOG_ERR, "cgroup limits are not supported on this platform: %s", name);
+}
+int cgroup_job_get_oom_kills(uint64_t *result, int64_t job_id __attribute__((unused)))
+{
+    *result = 0;
+    return 0;
+}
+int cgroup_job_get_cpu_usage(uint64_t *user_usec, uint64_t *system_usec,
+        int64_t job_id __attribute__((unused)))
+{
+    *user_usec = 0;
+    *system_usec = 0;
+    return 1;
+}
+int cgroup_get_notify_fd(void) { return (-1); }
+int cgroup_dispatch_events(void (*on_empty)(int64_t) __attribute__((unused))) { return 0; }
+int cgroup_job_release(int64_t job_id __attribute__((unused))) { return 0; }
+int cgroup_get_poll_fd(void) { return (-1); }
+int cgroup_poll_unwatched(void (*on_empty)(int64_t) __attribute__((unused))) { return 0; }
+int cgroup_get_label_by_pid(char *label, size_t len __attribute__((unused)),
+        pid_t pid __attribute__((unused)))
+{
+    label[0] = '\0';
+    return 0;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CGROUP_H
+#define _CGROUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Per-job process tracking using cgroup v2.
+ *
+ * When the cgroup v2 hierarchy has been delegated to jobd, every job is
+ * placed into its own leaf cgroup:
+ *
+ *      <jobd cgroup>/supervisor    -- jobd itself
+ *      <jobd cgroup>/jobs/<label>  -- all processes belonging to <label>
+ *
+ * On other systems, or when the hierarchy is not writable, all of these
+ * functions are harmless no-ops and cgroup_enabled() returns false.
+ */
+
+int cgroup_init(void);
+void cgroup_shutdown(void);
+bool cgroup_enabled(void);
+
+/* Create the leaf for a job, and return an open fd for its cgroup.procs file */
+int cgroup_job_prepare(int64_t job_id, const char *label);
+/* Called in the child after fork(2) to move itself into the leaf; sets errno, and does not log */
+int cgroup_job_attach(int procs_fd);
+/* Move a process that is already running into the leaf, e.g. a task of the shared runner */
+int cgroup_job_attach_pid(int procs_fd, pid_t pid);
+int cgroup_job_kill(int64_t job_id);
+int cgroup_job_is_populated(bool *result, int64_t job_id);
+/* Called once the job is gone; the leaf is kept for its next run, but is no longer polled */
+int cgroup_job_release(int64_t job_id);
+
+/* Resource limits enforced by cgroup controllers, e.g. memory.max */
+bool cgroup_limit_is_supported(const char *name);
+int cgroup_job_set_limit(int64_t job_id, const char *name, const char *value);
+/* The number of OOM kills in the leaf since it was last prepared */
+int cgroup_job_get_oom_kills(uint64_t *result, int64_t job_id);
+/* CPU time used in the leaf since it was last prepared; returns 1 if the job has no leaf */
+int cgroup_job_get_cpu_usage(uint64_t *user_usec, uint64_t *system_usec, int64_t job_id);
+
+int cgroup_get_notify_fd(void);
+int cgroup_dispatch_events(void (*on_empty)(int64_t job_id));
+/* A timer for the leaves whose cgroup.events could not be watched; on_empty() is called for each empty one */
+int cgroup_get_poll_fd(void);
+int cgroup_poll_unwatched(void (*on_empty)(int64_t job_id));
+int cgroup_get_label_by_pid(char *label, size_t len, pid_t pid);
+
+#endif /* _CGROUP_H */
@@ -18,6 +18,9 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -38,10 +41,35 @@ static struct {
 static char *dbpath;
 sqlite3 *dbh = NULL;
 
+/* The WAL is checkpointed in the background once it has grown to this many pages */
+#define DB_CHECKPOINT_PAGES 1000
+
+/* See db_checkpoint_in_background() */
+static struct {
+    int (*submit)(void (*work)(void *), void (*done)(void *), void *ctx);
+    int (*defer)(void (*func)(void *), void *ctx);
+    char *path;
+    sqlite3 *conn;      /* Only used by the worker that is checkpointing */
+    bool needed;        /* start_checkpoint() has been deferred */
+    bool pending;
+} checkpointer;
+
+struct checkpoint {
+    int rv;
+    int log_pages;
+    int checkpointed_pages;
+    char errmsg[128];
+};
+
+/* Set in the worker that is checkpointing, which must not log */
+static _Thread_local bool in_checkpointer;
+
 static void
 _db_log_callback(void *unused, int error_code, const char *msg)
 {
 	(void) unused;
+	if (in_checkpointer)
+		return;
 	printlog(LOG_ERR, "sqlite3 error %d: %s", error_code, msg);
 }
 
@@ -78,10 +106,187 @@ void db_shutdown(void)
 {
 	if (dbh)
 		db_close(dbh);
+	/* The worker pool has been shut down by now */
+	if (checkpointer.conn)
+		(void) sqlite3_close(checkpointer.conn);
+	free(checkpointer.path);
+	memset(&checkpointer, 0, sizeof(checkpointer));
 	free(db_default.dbpath);
 	free(db_default.schemapath);
 }
 
+static void
+checkpoint_work(void *arg)
+{
+    struct checkpoint *cp = arg;
+
+    in_checkpointer = true;
+    if (!checkpointer.conn) {
+        cp->rv = sqlite3_open_v2(checkpointer.path, &checkpointer.conn, SQLITE_OPEN_READWRITE, NULL);
+        /* Nothing is checkpointed until the connection has seen the WAL */
+        if (cp->rv == SQLITE_OK)
+            cp->rv = sqlite3_exec(checkpointer.conn, "PRAGMA journal_mode", NULL, NULL, NULL);
+        if (cp->rv != SQLITE_OK) {
+            snprintf(cp->errmsg, sizeof(cp->errmsg), "%s", sqlite3_errstr(cp->rv));
+            (void) sqlite3_close(checkpointer.conn);
+            checkpointer.conn = NULL;
+            in_checkpointer = false;
+            return;
+        }
+    }
+    /* A passive checkpoint never waits for the event loop, which may be writing meanwhile */
+    cp->rv = sqlite3_wal_checkpoint_v2(checkpointer.conn, NULL, SQLITE_CHECKPOINT_PASSIVE,
+            &cp->log_pages, &cp->checkpointed_pages);
+    if (cp->rv != SQLITE_OK)
+        snprintf(cp->errmsg, sizeof(cp->errmsg), "%s", sqlite3_errmsg(checkpointer.conn));
+    in_checkpointer = false;
+}
+
+static void
+checkpoint_done(void *arg)
+{
+    struct checkpoint *cp = arg;
+
+    checkpointer.pending = false;
+    if (cp->rv != SQLITE_OK)
+        printlog(LOG_ERR, "unable to checkpoint the database: %s", cp->errmsg);
+    else
+        printlog(LOG_DEBUG, "checkpointed %d of %d pages of the WAL", cp->checkpointed_pages, cp->log_pages);
+    free(cp);
+}
+
+static void
+start_checkpoint(void *arg __attribute__((unused)))
+{
+    struct checkpoint *cp;
+
+    checkpointer.needed = false;
+    if (checkpointer.pending)
+        return;
+    if (!(cp = calloc(1, sizeof(*cp)))) {
+        printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        return;
+    }
+    checkpointer.pending = true;
+    if (checkpointer.submit(checkpoint_work, checkpoint_done, cp) < 0) {
+        checkpointer.pending = false;
+        free(cp);
+    }
+}
+
+/*
+ * Called after each commit, instead of the automatic checkpoint of SQLite.
+ * The checkpoint starts once the event loop has handled the events that are
+ * ready, so that a burst of commits only starts one.
+ */
+static int
+wal_hook(void *arg __attribute__((unused)), sqlite3 *conn __attribute__((unused)),
+        const char *name __attribute__((unused)), int pages)
+{
+    if (pages < DB_CHECKPOINT_PAGES || checkpointer.pending || checkpointer.needed)
+        return (SQLITE_OK);
+    checkpointer.needed = true;
+    if (checkpointer.defer(start_checkpoint, NULL) < 0)
+        start_checkpoint(NULL);
+    return (SQLITE_OK);
+}
+
+static int
+enable_background_checkpoints(void)
+{
+    if (db_exec(dbh, "PRAGMA synchronous = NORMAL") < 0)
+        return (-1);
+    (void) sqlite3_wal_hook(dbh, wal_hook, NULL);
+    return (0);
+}
+
+int
+db_checkpoint_in_background(int (*submit)(void (*work)(void *), void (*done)(void *), void *ctx),
+        int (*defer)(void (*func)(void *), void *ctx))
+{
+    const char *path;
+
+    if (!dbh)
+        return printlog(LOG_ERR, "database is not open");
+    if (!sqlite3_threadsafe())
+        return printlog(LOG_WARNING, "SQLite was built without threads; the WAL will be checkpointed inline");
+    if (!(path = sqlite3_db_filename(dbh, "main")) || !(checkpointer.path = strdup(path)))
+        return printlog(LOG_ERR, "unable to get the path of the database");
+    checkpointer.submit = submit;
+    checkpointer.defer = defer;
+    return (enable_background_checkpoints());
+}
+
+/* What nearest_rank() has been given so far */
+struct nearest_rank {
+    int64_t *values;
+    size_t count;
+    size_t capacity;
+    double percentile;
+};
+
+static void
+nearest_rank_step(sqlite3_context *ctx, int argc __attribute__((unused)), sqlite3_value **argv)
+{
+    struct nearest_rank *nr;
+    int64_t *values;
+
+    nr = sqlite3_aggregate_context(ctx, sizeof(*nr));
+    if (!nr) {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    if (nr->count == nr->capacity) {
+        values = realloc(nr->values, (nr->capacity ? nr->capacity * 2 : 16) * sizeof(*values));
+        if (!values) {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+        nr->values = values;
+        nr->capacity = nr->capacity ? nr->capacity * 2 : 16;
+    }
+    nr->values[nr->count++] = sqlite3_value_int64(argv[0]);
+    nr->percentile = sqlite3_value_double(argv[1]);
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return ((x > y) - (x < y));
+}
+
+static void
+nearest_rank_final(sqlite3_context *ctx)
+{
+    struct nearest_rank *nr;
+    double exact;
+    size_t rank;
+
+    nr = sqlite3_aggregate_context(ctx, 0);
+    if (!nr || nr->count == 0) {
+        if (nr)
+            free(nr->values);
+        sqlite3_result_null(ctx);
+        return;
+    }
+    qsort(nr->values, nr->count, sizeof(*nr->values), compare_int64);
+    /* The smallest value that at least this share of the values are not greater than */
+    exact = nr->percentile * (double) nr->count / 100.0;
+    rank = (size_t) exact;
+    if ((double) rank < exact)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > nr->count)
+        rank = nr->count;
+    sqlite3_result_int64(ctx, nr->values[rank - 1]);
+    free(nr->values);
+}
+
 int
 db_open(const char *path, int flags __attribute__((unused)))
 {
@@ -97,6 +302,12 @@ db_open(const char *path, int flags __attribute__((unused)))
         return printlog(LOG_ERR, "Error opening %s: %s", path, sqlite3_errmsg(dbh));
 
     dbh = conn;
+    /* nearest_rank(X, P) is the P-th percentile of X, for job_run_stats_view */
+    if (sqlite3_create_function(dbh, "nearest_rank", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, NULL,
+            nearest_rank_step, nearest_rank_final) != SQLITE_OK)
+        printlog(LOG_WARNING, "unable to define nearest_rank(): %s", sqlite3_errmsg(dbh));
+    if (checkpointer.submit && enable_background_checkpoints() < 0)
+        printlog(LOG_WARNING, "the WAL will be checkpointed inline");
 
     return printlog(LOG_DEBUG, "opened %s with flags=%d", path, sqlite_flags);
 }
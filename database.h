@@ -36,6 +36,18 @@ extern sqlite3 *dbh;
 int db_init(void);
 void db_shutdown(void);
 int db_checkpoint(sqlite3 *conn);
+
+/*
+ * Keep fsync(2) off the calling thread. Commits only append to the WAL
+ * (synchronous = NORMAL), and once it has grown, a second connection copies
+ * it back into the database, using submit() to run on another thread. The
+ * checkpoint is started through defer(), once per loop iteration at most.
+ * SQLite has to be built with SQLITE_THREADSAFE=2 (or 1) for this. The
+ * statements themselves still run on the calling thread, which reads what it
+ * writes.
+ */
+int db_checkpoint_in_background(int (*submit)(void (*work)(void *), void (*done)(void *), void *ctx),
+        int (*defer)(void (*func)(void *), void *ctx));
 int db_close(sqlite3 *conn);
 int db_create(const char *, const char *);
 int db_open(const char *, int);
@@ -16,6 +16,11 @@
 
 #include <err.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
@@ -24,6 +29,11 @@
 #include <sys/signalfd.h>
 #include <memory.h>
 #include <signal.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif /* HAVE_IO_URING */
 
 #else
 #include <sys/event.h>
@@ -32,6 +42,52 @@
 
 #include "event_loop.h"
 #include "logger.h"
+#include "queue.h"
+
+#ifdef __linux__
+typedef struct epoll_event event_t;
+#else
+typedef struct kevent event_t;
+#endif
+
+/* Upper bounds of the buckets of the latency histogram; the last one is unbounded */
+static const struct {
+    const char *label;
+    uint64_t usec;
+} histogram_buckets[] = {
+    { "<10us", 10 },
+    { "<100us", 100 },
+    { "<1ms", 1000 },
+    { "<10ms", 10000 },
+    { "<100ms", 100000 },
+    { "<1s", 1000000 },
+    { ">=1s", UINT64_MAX },
+};
+
+#define HISTOGRAM_LEN (sizeof(histogram_buckets) / sizeof(histogram_buckets[0]))
+
+struct event_profile {
+    const char *name;
+    uint64_t calls;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint64_t histogram[HISTOGRAM_LEN];
+};
+
+static struct event_profile profiles[EVENT_LOOP_PROFILES_MAX];
+static size_t profiles_len = 0;
+static uint64_t iterations = 0;
+
+struct event_registration {
+    int fd;
+    int interest;
+    event_callback_t callback;
+    void *ctx;
+    struct event_profile *profile;
+    bool removed;
+    bool armed;         /* io_uring only: a poll request is in flight */
+    LIST_ENTRY(event_registration) entries;
+};
 
 #ifdef __linux__
 static struct {
@@ -43,46 +99,413 @@ static struct {
 static int kqfd = -1;
 #endif
 
-static int dequeue_signal(event_t *);
+#ifdef HAVE_IO_URING
+/* The number of submission queue entries; completions are sized by the kernel */
+#define URING_ENTRIES 256
+
+/* user_data of requests whose completions are not interesting, e.g. POLL_REMOVE */
+#define URING_INTERNAL 0
+
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+} uring = {
+        .fd = -1,
+};
+
+static bool use_uring = false;
+#endif /* HAVE_IO_URING */
+
+static struct {
+    void (*func)(void *);
+    void *ctx;
+} deferred[EVENT_LOOP_DEFERRED_MAX];
+static size_t deferred_len = 0;
+
+/* Registrations that were removed while a batch was being dispatched */
+static LIST_HEAD(, event_registration) removed_registrations;
+static bool dispatching = false;
+
+static int dequeue_signal(int, int, void *);
 
 static struct event_loop_options elopt;
 
+/* Names are not copied, so they must be string literals */
+static struct event_profile *
+profile_lookup(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < profiles_len; i++) {
+        if (!strcmp(profiles[i].name, name))
+            return (&profiles[i]);
+    }
+    if (profiles_len >= EVENT_LOOP_PROFILES_MAX - 1) {
+        /* The last slot lumps together the names that do not fit, rather than failing */
+        profiles[EVENT_LOOP_PROFILES_MAX - 1].name = "other";
+        profiles_len = EVENT_LOOP_PROFILES_MAX;
+        return (&profiles[EVENT_LOOP_PROFILES_MAX - 1]);
+    }
+    profiles[profiles_len].name = name;
+    return (&profiles[profiles_len++]);
+}
+
+/* Each signal is profiled on its own, since their handlers have little in common */
+static const char *
+signal_profile_name(int signum)
+{
+    switch (signum) {
+        case SIGALRM:
+            return ("SIGALRM");
+        case SIGCHLD:
+            return ("SIGCHLD");
+        case SIGHUP:
+            return ("SIGHUP");
+        case SIGINT:
+            return ("SIGINT");
+        case SIGTERM:
+            return ("SIGTERM");
+        case SIGUSR1:
+            return ("SIGUSR1");
+        case SIGUSR2:
+            return ("SIGUSR2");
+        default:
+            return ("signal");
+    }
+}
+
+static uint64_t
+profile_clock(void)
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000);
+}
+
+static void
+profile_update(struct event_profile *prof, uint64_t started)
+{
+    uint64_t elapsed = profile_clock() - started;
+    size_t i;
+
+    prof->calls++;
+    prof->total_usec += elapsed;
+    if (elapsed > prof->max_usec)
+        prof->max_usec = elapsed;
+    for (i = 0; elapsed >= histogram_buckets[i].usec; i++)
+        ;
+    prof->histogram[i]++;
+
+    if (elapsed > EVENT_LOOP_STALL_USEC)
+        printlog(LOG_WARNING, "event loop stalled: the `%s' handler ran for %llu ms",
+                prof->name, (unsigned long long) elapsed / 1000);
+}
+
 static int
-dequeue_signal(event_t *ev)
+dequeue_signal(int fd, int events __attribute__((unused)), void *ctx __attribute__((unused)))
 {
     const struct signal_handler *sh;
+    uint64_t started;
     int signum;
 
 #ifdef __linux__
     struct signalfd_siginfo fdsi;
     ssize_t sz;
 
-    (void) ev;
-    sz = read(eventfds.signalfd, &fdsi, sizeof(fdsi));
+    sz = read(fd, &fdsi, sizeof(fdsi));
     if (sz != sizeof(fdsi))
         err(1, "invalid read");
 
     signum = fdsi.ssi_signo;
 #else
-    signum = ev->ident;
+    /* kqueue(2) reports the signal number as the ident */
+    signum = fd;
 #endif
 
     for (sh = &elopt.signal_handlers[0]; sh->signum; sh++) {
         if (sh->signum == signum) {
             printlog(LOG_DEBUG, "caught signal %d", signum);
+            started = profile_clock();
             sh->handler(signum);
+            profile_update(profile_lookup(signal_profile_name(signum)), started);
             return (0);
         }
     }
     return printlog(LOG_ERR, "caught unhandled signal: %d", signum);
 }
 
+static void
+run_callback(struct event_registration *reg, int ready)
+{
+    uint64_t started = profile_clock();
+
+    (void) reg->callback(reg->fd, ready, reg->ctx);
+    if (reg->profile)
+        profile_update(reg->profile, started);
+}
+
+static struct event_registration *
+registration_new(int fd, int interest, event_callback_t callback, void *ctx, const char *name)
+{
+    struct event_registration *reg;
+
+    reg = calloc(1, sizeof(*reg));
+    if (!reg) {
+        printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        return (NULL);
+    }
+    reg->fd = fd;
+    reg->interest = interest;
+    reg->callback = callback;
+    reg->ctx = ctx;
+    reg->profile = name ? profile_lookup(name) : NULL;
+    return (reg);
+}
+
+#ifdef __linux__
+static uint32_t
+interest_to_epoll(int interest)
+{
+    return (((interest & EVENT_READ) ? EPOLLIN : 0) | ((interest & EVENT_WRITE) ? EPOLLOUT : 0));
+}
+
+static int
+epoll_to_events(uint32_t events)
+{
+    return (((events & EPOLLIN) ? EVENT_READ : 0) |
+            ((events & EPOLLOUT) ? EVENT_WRITE : 0) |
+            ((events & (EPOLLHUP | EPOLLERR)) ? EVENT_ERROR : 0));
+}
+#else
+/* Add or delete the filters for the flags in changed */
+static int
+kqueue_update(struct event_registration *reg, int changed, int interest)
+{
+    struct kevent kev[2];
+    int n = 0;
+
+    if (changed & EVENT_READ) {
+        EV_SET(&kev[n], reg->fd, EVFILT_READ, (interest & EVENT_READ) ? EV_ADD : EV_DELETE, 0, 0, reg);
+        n++;
+    }
+    if (changed & EVENT_WRITE) {
+        EV_SET(&kev[n], reg->fd, EVFILT_WRITE, (interest & EVENT_WRITE) ? EV_ADD : EV_DELETE, 0, 0, reg);
+        n++;
+    }
+    if (n > 0 && kevent(kqfd, kev, n, NULL, 0, NULL) < 0)
+        return printlog(LOG_ERR, "kevent(2): %s", strerror(errno));
+    return 0;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+static int
+uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_init(void)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    void *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+    uring.fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd < 0)
+        return (-1);
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        /* Completions could be lost if the queue overflows, and a lost poll is a hung fd */
+        errno = ENOTSUP;
+        goto err_out;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto err_out;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            goto err_out;
+    }
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED)
+        goto err_out;
+
+    uring.sq_head = (unsigned *) ((char *) sq_ptr + p.sq_off.head);
+    uring.sq_tail = (unsigned *) ((char *) sq_ptr + p.sq_off.tail);
+    uring.sq_mask = (unsigned *) ((char *) sq_ptr + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) ((char *) sq_ptr + p.sq_off.array);
+    uring.cq_head = (unsigned *) ((char *) cq_ptr + p.cq_off.head);
+    uring.cq_tail = (unsigned *) ((char *) cq_ptr + p.cq_off.tail);
+    uring.cq_mask = (unsigned *) ((char *) cq_ptr + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) ((char *) cq_ptr + p.cq_off.cqes);
+    return 0;
+
+err_out:
+    /* The mappings go away with the process, and jobd never retries */
+    (void) close(uring.fd);
+    uring.fd = -1;
+    return (-1);
+}
+
+/* Returns a zeroed SQE, submitting the queue first if it is full */
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *uring.sq_tail;
+
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) > *uring.sq_mask) {
+        if (uring_enter(uring.to_submit, 0, 0) < 0) {
+            printlog(LOG_ERR, "io_uring_enter(2): %s", strerror(errno));
+            return (NULL);
+        }
+        uring.to_submit = 0;
+    }
+    sqe = &uring.sqes[tail & *uring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.to_submit++;
+    return (sqe);
+}
+
+/*
+ * Polls are one-shot, and are armed again after the callback has run, so
+ * that an fd which is still readable is reported again, as with epoll.
+ * The new request is submitted along with the next wait, so it costs no
+ * extra system call.
+ */
+static int
+uring_arm(struct event_registration *reg)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = uring_get_sqe()))
+        return (-1);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reg->fd;
+    sqe->poll32_events = interest_to_epoll(reg->interest);
+    sqe->user_data = (uint64_t) (uintptr_t) reg;
+    reg->armed = true;
+    return 0;
+}
+
+static int
+uring_cancel(struct event_registration *reg, int interest)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = uring_get_sqe()))
+        return (-1);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = (uint64_t) (uintptr_t) reg;
+    sqe->user_data = URING_INTERNAL;
+    if (interest >= 0) {
+        /* Change the events of the request, instead of removing it */
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+        sqe->poll32_events = interest_to_epoll(interest);
+    }
+    return 0;
+}
+
+static void
+uring_dispatch(void)
+{
+    struct event_registration *reg, *tmp;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int handled = 0;
+
+    if (uring_enter(uring.to_submit, 1, IORING_ENTER_GETEVENTS) < 0) {
+        if (errno == EINTR)
+            printlog(LOG_ERR, "unexpected wakeup from unhandled signal");
+        else
+            printlog(LOG_ERR, "io_uring_enter(2): %s", strerror(errno));
+        return;
+    }
+    uring.to_submit = 0;
+
+    dispatching = true;
+    head = *uring.cq_head;
+    tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && handled < EVENT_LOOP_BATCH_MAX; head++) {
+        cqe = &uring.cqes[head & *uring.cq_mask];
+        reg = (struct event_registration *) (uintptr_t) cqe->user_data;
+        if (!reg) {
+            if (cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EALREADY)
+                printlog(LOG_ERR, "io_uring poll update failed: %s", strerror(-cqe->res));
+            continue;
+        }
+
+        reg->armed = false;
+        if (reg->removed) {
+            /* This was the last reference to it */
+            LIST_REMOVE(reg, entries);
+            free(reg);
+            continue;
+        }
+        handled++;
+        if (cqe->res < 0) {
+            printlog(LOG_ERR, "io_uring poll of fd %d: %s", reg->fd, strerror(-cqe->res));
+            run_callback(reg, EVENT_ERROR);
+        } else {
+            run_callback(reg, epoll_to_events((uint32_t) cqe->res));
+        }
+        if (!reg->removed)
+            (void) uring_arm(reg);
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    dispatching = false;
+
+    /* Only the registrations that were removed from within their own callback */
+    LIST_FOREACH_SAFE(reg, &removed_registrations, entries, tmp) {
+        if (!reg->armed) {
+            LIST_REMOVE(reg, entries);
+            free(reg);
+        }
+    }
+}
+#endif /* HAVE_IO_URING */
+
 static int
 create_event_queue(void)
 {
 #ifdef __linux__
     sigset_t mask;
-    struct epoll_event ev;
+
+    if (elopt.backend && strcmp(elopt.backend, "epoll") && strcmp(elopt.backend, "io_uring"))
+        return printlog(LOG_ERR, "unsupported event loop: %s", elopt.backend);
+#ifdef HAVE_IO_URING
+    /* Only on request: re-arming one-shot polls costs more than epoll, until polls are multishot */
+    if (elopt.backend && !strcmp(elopt.backend, "io_uring")) {
+        if (uring_init() == 0) {
+            use_uring = true;
+            printlog(LOG_DEBUG, "using the io_uring event loop");
+        } else {
+            printlog(LOG_WARNING, "io_uring is not available (%s); using epoll instead", strerror(errno));
+        }
+    }
+#else
+    if (elopt.backend && !strcmp(elopt.backend, "io_uring"))
+        printlog(LOG_WARNING, "jobd was built without io_uring; using epoll instead");
+#endif /* HAVE_IO_URING */
 
     if ((eventfds.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
         return printlog(LOG_ERR, "epoll_create(2): %s", strerror(errno));
@@ -93,14 +516,11 @@ create_event_queue(void)
     if (eventfds.signalfd < 0)
         return printlog(LOG_ERR, "signalfd(2): %s", strerror(errno));
 
-    ev.events = EPOLLIN;
-    ev.data.ptr = &dequeue_signal;
-    if (epoll_ctl(eventfds.epfd, EPOLL_CTL_ADD, eventfds.signalfd, &ev) < 0)
-        return printlog(LOG_ERR, "epoll_ctl(2): %s", strerror(errno));
+    /* dequeue_signal() profiles each signal under its own name */
+    if (!event_loop_add(eventfds.signalfd, EVENT_READ, &dequeue_signal, NULL, NULL))
+        return printlog(LOG_ERR, "unable to watch the signalfd");
 
 #else
-    struct kevent kev;
-
     if ((kqfd = kqueue()) < 0)
         return printlog(LOG_ERR, "kqueue(2): %s", strerror(errno));
 
@@ -145,14 +565,17 @@ register_signal_handlers(void)
         return printlog(LOG_ERR, "signalfd(2): %s", strerror(errno));
 
 #else
+    struct event_registration *reg;
     struct kevent kev;
 
-    for (sh = &signal_handlers[0]; sh->signum; sh++) {
+    for (sh = &elopt.signal_handlers[0]; sh->signum; sh++) {
         if (signal(sh->signum, (sh->signum == SIGCHLD ? SIG_DFL : SIG_IGN)) == SIG_ERR)
             return printlog(LOG_ERR, "signal(2): %d: %s", sh->signum, strerror(errno));
 
-        EV_SET(&kev, sh->signum, EVFILT_SIGNAL, EV_ADD, 0, 0,
-                (void *)&dequeue_signal);
+        reg = registration_new(sh->signum, EVENT_READ, &dequeue_signal, NULL, NULL);
+        if (!reg)
+            return (-1);
+        EV_SET(&kev, sh->signum, EVFILT_SIGNAL, EV_ADD, 0, 0, reg);
         if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
                     return printlog(LOG_ERR, "kevent(2): %s", strerror(errno));
 
@@ -165,6 +588,7 @@ register_signal_handlers(void)
 int event_loop_init(struct event_loop_options opts)
 {
     memcpy(&elopt, &opts, sizeof(elopt));
+    LIST_INIT(&removed_registrations);
 
     if (create_event_queue() < 0)
         return printlog(LOG_ERR, "unable to create the event queue");
@@ -175,39 +599,163 @@ int event_loop_init(struct event_loop_options opts)
     return 0;
 }
 
-int event_loop_register_callback(int fd, int (*func_ptr)(event_t *))
+struct event_registration *
+event_loop_add(int fd, int interest, event_callback_t callback, void *ctx, const char *name)
+{
+    struct event_registration *reg;
+
+    reg = registration_new(fd, interest, callback, ctx, name);
+    if (!reg)
+        return (NULL);
+
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        if (uring_arm(reg) < 0) {
+            free(reg);
+            return (NULL);
+        }
+        return (reg);
+    }
+#endif
+#ifdef __linux__
+    struct epoll_event ev;
+
+    ev.events = interest_to_epoll(interest);
+    ev.data.ptr = reg;
+    if (epoll_ctl(eventfds.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        printlog(LOG_ERR, "epoll_ctl(2): %s", strerror(errno));
+        free(reg);
+        return (NULL);
+    }
+#else
+    if (kqueue_update(reg, interest, interest) < 0) {
+        free(reg);
+        return (NULL);
+    }
+#endif
+    return (reg);
+}
+
+int
+event_loop_modify(struct event_registration *reg, int interest)
 {
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        if (reg->armed && uring_cancel(reg, interest) < 0)
+            return (-1);
+        reg->interest = interest;
+        return 0;
+    }
+#endif
 #ifdef __linux__
     struct epoll_event ev;
 
-    ev.events = EPOLLIN;
-    ev.data.ptr = func_ptr;
-    if (epoll_ctl(eventfds.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    ev.events = interest_to_epoll(interest);
+    ev.data.ptr = reg;
+    if (epoll_ctl(eventfds.epfd, EPOLL_CTL_MOD, reg->fd, &ev) < 0)
         return printlog(LOG_ERR, "epoll_ctl(2): %s", strerror(errno));
 #else
-    struct kevent kev;
+    if (kqueue_update(reg, reg->interest ^ interest, interest) < 0)
+        return (-1);
+#endif
+    reg->interest = interest;
+    return 0;
+}
 
-    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0,
-            (void *)func_ptr);
-    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
-        return printlog(LOG_ERR, "kqueue(2): %s", strerror(errno));
+/* The caller still owns the fd, and must close it after calling this */
+void
+event_loop_remove(struct event_registration *reg)
+{
+    if (!reg || reg->removed)
+        return;
+
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        /* Freed once the cancelled poll completes, or after the current callback */
+        if (reg->armed)
+            (void) uring_cancel(reg, -1);
+        reg->removed = true;
+        LIST_INSERT_HEAD(&removed_registrations, reg, entries);
+        return;
+    }
+#endif
+
+#ifdef __linux__
+    if (epoll_ctl(eventfds.epfd, EPOLL_CTL_DEL, reg->fd, NULL) < 0)
+        printlog(LOG_ERR, "epoll_ctl(2): %s", strerror(errno));
+#else
+    (void) kqueue_update(reg, reg->interest, 0);
 #endif
+
+    /* Pending events in the current batch may still point to it */
+    if (dispatching) {
+        reg->removed = true;
+        LIST_INSERT_HEAD(&removed_registrations, reg, entries);
+    } else {
+        free(reg);
+    }
+}
+
+int
+event_loop_defer(void (*func)(void *), void *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < deferred_len; i++) {
+        if (deferred[i].func == func && deferred[i].ctx == ctx)
+            return 0;
+    }
+    if (deferred_len == EVENT_LOOP_DEFERRED_MAX)
+        return printlog(LOG_ERR, "too many deferred callbacks");
+    deferred[deferred_len].func = func;
+    deferred[deferred_len].ctx = ctx;
+    deferred_len++;
     return 0;
 }
 
+/* Callbacks are removed before they run, so they may defer themselves again */
+static void
+run_deferred(void)
+{
+    static struct event_profile *prof;
+    void (*func)(void *);
+    uint64_t started;
+    void *ctx;
+
+    if (!prof)
+        prof = profile_lookup("deferred");
+    while (deferred_len > 0) {
+        func = deferred[0].func;
+        ctx = deferred[0].ctx;
+        deferred_len--;
+        memmove(&deferred[0], &deferred[1], deferred_len * sizeof(deferred[0]));
+        started = profile_clock();
+        func(ctx);
+        profile_update(prof, started);
+    }
+}
+
 void
 dispatch_event(void)
 {
-    void (*cb)(event_t *);
-    event_t ev;
-    int rv;
+    struct event_registration *reg;
+    event_t events[EVENT_LOOP_BATCH_MAX];
+    int i, rv, ready;
 
     for (;;) {
         printlog(LOG_DEBUG, "waiting for the next event");
+        iterations++;
+#ifdef HAVE_IO_URING
+        if (use_uring) {
+            uring_dispatch();
+            run_deferred();
+            continue;
+        }
+#endif
 #ifdef __linux__
-        rv = epoll_wait(eventfds.epfd, &ev, 1, -1);
+        rv = epoll_wait(eventfds.epfd, events, EVENT_LOOP_BATCH_MAX, -1);
 #else
-        rv = kevent(kqfd, NULL, 0, &ev, 1, NULL);
+        rv = kevent(kqfd, NULL, 0, events, EVENT_LOOP_BATCH_MAX, NULL);
 #endif
         if (rv < 0) {
             if (errno == EINTR) {
@@ -221,12 +769,64 @@ dispatch_event(void)
             printlog(LOG_DEBUG, "spurious wakeup");
             continue;
         } else {
+            dispatching = true;
+            for (i = 0; i < rv; i++) {
 #ifdef __linux__
-            cb = (void (*)(event_t *)) ev.data.ptr;
+                reg = events[i].data.ptr;
+                ready = epoll_to_events(events[i].events);
 #else
-            cb = (void (*)(event_t *)) ev.udata;
+                reg = events[i].udata;
+                ready = (events[i].filter == EVFILT_WRITE) ? EVENT_WRITE : EVENT_READ;
+                if (events[i].flags & (EV_EOF | EV_ERROR))
+                    ready |= EVENT_ERROR;
 #endif
-            (*cb)(&ev);
+                if (reg->removed)
+                    continue;
+                run_callback(reg, ready);
+            }
+            dispatching = false;
+            while (!LIST_EMPTY(&removed_registrations)) {
+                reg = LIST_FIRST(&removed_registrations);
+                LIST_REMOVE(reg, entries);
+                free(reg);
+            }
+            run_deferred();
+        }
+    }
+}
+
+int
+event_loop_get_stats(char **json)
+{
+    const struct event_profile *prof;
+    size_t i, j, len;
+    FILE *fp;
+
+    *json = NULL;
+    fp = open_memstream(json, &len);
+    if (!fp)
+        return printlog(LOG_ERR, "open_memstream(3): %s", strerror(errno));
+
+    fprintf(fp, "{\"iterations\": %llu, \"stall_threshold_usec\": %d, \"handlers\": [",
+            (unsigned long long) iterations, EVENT_LOOP_STALL_USEC);
+    for (i = 0; i < profiles_len; i++) {
+        prof = &profiles[i];
+        fprintf(fp, "%s{\"name\": \"%s\", \"calls\": %llu, \"total_usec\": %llu, \"max_usec\": %llu, "
+                "\"histogram\": {", (i > 0 ? ", " : ""), prof->name,
+                (unsigned long long) prof->calls, (unsigned long long) prof->total_usec,
+                (unsigned long long) prof->max_usec);
+        for (j = 0; j < HISTOGRAM_LEN; j++) {
+            fprintf(fp, "%s\"%s\": %llu", (j > 0 ? ", " : ""), histogram_buckets[j].label,
+                    (unsigned long long) prof->histogram[j]);
         }
+        fprintf(fp, "}}");
+    }
+    fprintf(fp, "]}");
+
+    if (fclose(fp) != 0) {
+        free(*json);
+        *json = NULL;
+        return printlog(LOG_ERR, "unable to format the event loop statistics");
     }
-}
\ No newline at end of file
+    return 0;
+}
@@ -17,11 +17,41 @@
 #ifndef _EVENT_LOOP_H
 #define _EVENT_LOOP_H
 
-#ifdef __linux__
-typedef struct epoll_event event_t;
-#else
-typedef struct kevent event_t;
-#endif
+#include <stdint.h>
+
+/* The maximum number of events returned by each call to epoll_wait(2) or kevent(2) */
+#define EVENT_LOOP_BATCH_MAX 64
+
+/* The maximum number of distinct deferred callbacks that can be pending */
+#define EVENT_LOOP_DEFERRED_MAX 32
+
+/* A warning is logged when a single callback runs for longer than this */
+#define EVENT_LOOP_STALL_USEC 100000
+
+/* The maximum number of distinct handler names that are profiled */
+#define EVENT_LOOP_PROFILES_MAX 16
+
+/* Interest and readiness flags */
+#define EVENT_READ  0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4     /* Hangup, error or EOF; always reported */
+
+/*
+ * An fd that is being watched by the event loop.
+ *
+ * The callback is given the flags that are ready, and the context that was
+ * passed to event_loop_add(). A registration may be removed at any time,
+ * including from within a callback; events for it that are still pending
+ * in the current batch are then discarded.
+ *
+ * The time spent in callbacks is accounted to the name of the registration,
+ * which should identify the kind of handler (e.g. "ipc"), since
+ * registrations that share a name share their profile. A NULL name leaves
+ * the registration out of the profile.
+ */
+struct event_registration;
+
+typedef int (*event_callback_t)(int fd, int events, void *ctx);
 
 struct signal_handler {
     int signum;
@@ -31,10 +61,27 @@ struct signal_handler {
 struct event_loop_options {
     int daemon;
     const struct signal_handler *signal_handlers;
+    const char *backend;    /* "epoll" or "io_uring"; NULL means epoll */
 };
 
 void dispatch_event(void);
 int event_loop_init(struct event_loop_options elopt);
-int event_loop_register_callback(int fd, int (*func_ptr)(event_t *));
+
+/* These return NULL on failure */
+struct event_registration *event_loop_add(int fd, int interest, event_callback_t callback, void *ctx,
+        const char *name);
+int event_loop_modify(struct event_registration *reg, int interest);
+void event_loop_remove(struct event_registration *reg);
+
+/*
+ * Run func(ctx) once, after all of the events in the current batch have
+ * been handled. Deferring the same func and ctx again before then has no
+ * effect, so a burst of events that each need e.g. a scheduling pass only
+ * causes one.
+ */
+int event_loop_defer(void (*func)(void *), void *ctx);
+
+/* A JSON object with the number of loop iterations, and the timing of each kind of handler */
+int event_loop_get_stats(char **json);
 
 #endif /* _EVENT_LOOP_H */
@@ -21,17 +21,56 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "logger.h"
 #include "memory.h"
 #include "ipc.h"
+#include "ipc_frame.h"
+#include "queue.h"
 
 static int initialized;
 static char *socketpath;
 static struct sockaddr_un ipc_server_addr;
 static int ipc_sockfd = -1;
+static int ipc_listen_fd = -1;
+
+/* A response that could not be sent yet */
+struct queued_response {
+    char *msg;
+    size_t len;
+    STAILQ_ENTRY(queued_response) entries;
+};
+
+/* See ipc.h */
+struct ipc_outbox {
+    int connfd;
+    void (*backlog_changed)(void *);
+    void *ctx;
+    bool writing;           /* Waiting for the connection to become writable */
+    bool failed;
+    STAILQ_HEAD(, queued_response) queue;
+};
+
+/* See ipc.h */
+struct ipc_stream {
+    int connfd;
+    bool binary;
+    char *id;
+    ipc_stream_fill_t fill;
+    void (*release)(void *);
+    void *ctx;
+    uint32_t seq;       /* Of the next chunk */
+    int retcode;
+    bool filled;        /* The producer has nothing more to give */
+    bool finished;      /* The final response has been built */
+    char *msg;          /* The next message, if it could not be sent yet */
+    size_t msglen;
+    char data[IPC_STREAM_CHUNK_SIZE + 1];   /* What the producer gave, but is not in a chunk yet */
+    size_t data_len;
+};
 
 int
 ipc_init(void)
@@ -52,68 +91,22 @@ void ipc_shutdown(void)
     if (initialized) {
         jsonrpc_shutdown();
         close(ipc_sockfd);
+        if (ipc_listen_fd >= 0)
+            close(ipc_listen_fd);
+        ipc_listen_fd = -1;
         free(socketpath);
         initialized = 0;
     }
 }
 
-int
-ipc_client_request(const char *job_id, const char *method)
-{
-    ssize_t bytes;
-    struct sockaddr_un sa_to;
-    socklen_t len;
-    struct jsonrpc_request CLEANUP_JSONRPC_REQUEST *req = NULL;
-    struct jsonrpc_response CLEANUP_JSONRPC_RESPONSE *response = NULL;
-
-    if (!initialized)
-        return -1;
-
-    memset(&sa_to, 0, sizeof(struct sockaddr_un));
-    sa_to.sun_family = AF_UNIX;
-    strncpy(sa_to.sun_path, socketpath, sizeof(sa_to.sun_path) - 1);
-
-    req = jsonrpc_request_new("1", method, 1, "job_id", job_id);
-    if (!req)
-        return printlog(LOG_ERR, "unable to allocate request");
-    char CLEANUP_STR *buf = NULL;
-    if (jsonrpc_request_serialize(&buf, req) < 0)
-        return printlog(LOG_ERR, "serialization failed");
-    len = (socklen_t) sizeof(struct sockaddr_un);
-    bytes = sendto(ipc_sockfd, buf, strlen(buf), 0,
-                   (const struct sockaddr *) &sa_to,
-                   sizeof(sa_to));
-    if (bytes < 0) {
-        return printlog(LOG_ERR, "sendto(2): %s", strerror(errno));
-    } else if ((size_t) bytes < sizeof(req)) {
-        return printlog(LOG_ERR, "TODO - handle short write");
-    }
-    printlog(LOG_DEBUG, "sent IPC request: %s", buf);
-
-    char resbuf[IPC_MAX_MSGLEN + 1];
-    len = sizeof(struct sockaddr_un);
-    bytes = recvfrom(ipc_sockfd, resbuf, sizeof(resbuf), 0,
-                     (struct sockaddr *) &sa_to,
-                     &len);
-    if (bytes < 0)
-        return printlog(LOG_ERR, "recvfrom(2): %s", strerror(errno));
-    resbuf[bytes] = '\0';
-    printlog(LOG_DEBUG, "<<< %s", resbuf);
-
-    if (jsonrpc_response_parse(&response, resbuf, bytes) < 0)
-        return printlog(LOG_ERR, "error parsing response");
-
-    return (response->error.code);
-}
-
 static char *
-_make_socketpath(const char *service)
+_make_socketpath(const char *service, const char *suffix)
 {
     char *result;
     struct sockaddr_un saun;
 
-    if (asprintf(&result, "%s/%s/%s.sock", compile_time_option.runstatedir,
-                 compile_time_option.project_name, service) < 0) {
+    if (asprintf(&result, "%s/%s/%s%s.sock", compile_time_option.runstatedir,
+                 compile_time_option.project_name, service, suffix) < 0) {
         printlog(LOG_ERR, "memory error");
         return NULL;
     }
@@ -134,7 +127,7 @@ create_ipc_socket(const char *service)
     if (socketpath)
         return printlog(LOG_ERR, "socket already exists");
 
-    socketpath = _make_socketpath(service);
+    socketpath = _make_socketpath(service, "");
     if (!socketpath)
         return printlog(LOG_ERR, "allocation failed");
 
@@ -155,6 +148,40 @@ create_ipc_socket(const char *service)
     return 0;
 }
 
+static int
+create_listen_socket(const char *service)
+{
+    char CLEANUP_STR *path = NULL;
+    struct sockaddr_un saun;
+    int sd;
+
+    path = _make_socketpath(service, "-session");
+    if (!path)
+        return printlog(LOG_ERR, "allocation failed");
+
+    sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sd < 0)
+        return printlog(LOG_ERR, "socket(2): %s", strerror(errno));
+
+    memset(&saun, 0, sizeof(saun));
+    saun.sun_family = AF_UNIX;
+    strncpy(saun.sun_path, path, sizeof(saun.sun_path) - 1);
+    (void) unlink(path);
+    if (bind(sd, (struct sockaddr *) &saun, sizeof(saun)) < 0) {
+        printlog(LOG_ERR, "bind(2) to %s: %s", path, strerror(errno));
+        (void) close(sd);
+        return -1;
+    }
+    if (listen(sd, SOMAXCONN) < 0) {
+        printlog(LOG_ERR, "listen(2): %s", strerror(errno));
+        (void) close(sd);
+        return -1;
+    }
+    printlog(LOG_DEBUG, "listening on %s", path);
+    ipc_listen_fd = sd;
+    return 0;
+}
+
 int
 ipc_bind(const char *service)
 {
@@ -162,6 +189,8 @@ ipc_bind(const char *service)
 
     if (create_ipc_socket(service) < 0)
         return -1;
+    if (create_listen_socket(service) < 0)
+        return -1;
 
     rv = bind(ipc_sockfd, (struct sockaddr *) &ipc_server_addr, sizeof(ipc_server_addr));
     if (rv < 0) {
@@ -178,12 +207,27 @@ ipc_bind(const char *service)
     return 0;
 }
 
-int ipc_send_response(struct ipc_session *s, const struct ipc_result result)
+/* Build the message for a response, as a frame if binary is set. Caller must free. */
+static int
+encode_response(char **msg, size_t *msglen, bool binary, const char *id,
+        const struct ipc_result result)
 {
-    ssize_t bytes;
     struct jsonrpc_response CLEANUP_JSONRPC_RESPONSE *response = NULL;
 
-    char *id = s->req ? s->req->id : NULL;
+    *msg = NULL;
+    if (binary) {
+        if (!(*msg = malloc(IPC_MAX_MSGLEN)))
+            return printlog(LOG_ERR, "malloc(3): %s", strerror(errno));
+        if (ipc_frame_encode_response(*msg, IPC_MAX_MSGLEN, msglen, id,
+                result.code, result.data, result.errmsg) < 0) {
+            free(*msg);
+            *msg = NULL;
+            return printlog(LOG_ERR, "error building response");
+        }
+        printlog(LOG_DEBUG, ">>> frame of %zu bytes", *msglen);
+        return (0);
+    }
+
     response = jsonrpc_response_new(id);
     if (!response)
         return printlog(LOG_ERR, "error allocating response");
@@ -193,13 +237,124 @@ int ipc_send_response(struct ipc_session *s, const struct ipc_result result)
     } else {
         if (jsonrpc_response_set_error(response, result.code, result.errmsg) < 0)
             return printlog(LOG_ERR, "error building response");
+        if (result.data && jsonrpc_response_set_error_data(response, result.data) < 0)
+            return printlog(LOG_ERR, "error building response");
     }
-    char CLEANUP_STR *buf = NULL;
-    if (jsonrpc_response_serialize(&buf, response) < 0)
+    if (jsonrpc_response_serialize(msg, response) < 0)
         return printlog(LOG_ERR, "serialization failed");
+    *msglen = strlen(*msg);
+    printlog(LOG_DEBUG, ">>> %s", *msg);
+    return (0);
+}
+
+int
+ipc_outbox_new(struct ipc_outbox **outbox, int connfd, void (*backlog_changed)(void *), void *ctx)
+{
+    struct ipc_outbox *ob;
+
+    *outbox = NULL;
+    ob = calloc(1, sizeof(*ob));
+    if (!ob)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    ob->connfd = connfd;
+    ob->backlog_changed = backlog_changed;
+    ob->ctx = ctx;
+    STAILQ_INIT(&ob->queue);
+    *outbox = ob;
+    return 0;
+}
+
+void
+ipc_outbox_free(struct ipc_outbox *outbox)
+{
+    struct queued_response *qr;
+
+    if (!outbox)
+        return;
+    while (!STAILQ_EMPTY(&outbox->queue)) {
+        qr = STAILQ_FIRST(&outbox->queue);
+        STAILQ_REMOVE_HEAD(&outbox->queue, entries);
+        free(qr->msg);
+        free(qr);
+    }
+    free(outbox);
+}
+
+int
+ipc_outbox_flush(struct ipc_outbox *outbox)
+{
+    struct queued_response *qr;
+    bool full = false;
+
+    if (outbox->failed)
+        return -1;
+    while (!STAILQ_EMPTY(&outbox->queue)) {
+        qr = STAILQ_FIRST(&outbox->queue);
+        if (send(outbox->connfd, qr->msg, qr->len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                full = true;
+                break;
+            }
+            outbox->failed = true;
+            return printlog(LOG_ERR, "send(2) to connection %d: %s", outbox->connfd, strerror(errno));
+        }
+        STAILQ_REMOVE_HEAD(&outbox->queue, entries);
+        free(qr->msg);
+        free(qr);
+    }
+
+    /* Only ask to hear about writability while there is a backlog */
+    if (full != outbox->writing) {
+        outbox->writing = full;
+        outbox->backlog_changed(outbox->ctx);
+    }
+    return 0;
+}
+
+bool
+ipc_outbox_backlogged(const struct ipc_outbox *outbox)
+{
+    return (outbox->writing);
+}
+
+/* Takes ownership of msg */
+static int
+outbox_enqueue(struct ipc_outbox *outbox, char *msg, size_t len)
+{
+    struct queued_response *qr;
+
+    if (outbox->failed) {
+        free(msg);
+        return -1;
+    }
+    if (!(qr = calloc(1, sizeof(*qr)))) {
+        free(msg);
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    }
+    qr->msg = msg;
+    qr->len = len;
+    STAILQ_INSERT_TAIL(&outbox->queue, qr, entries);
+    if (outbox->writing)
+        return 0;
+    return (ipc_outbox_flush(outbox));
+}
+
+static int
+send_response(struct ipc_session *s, const char *id, const struct ipc_result result)
+{
+    ssize_t bytes;
+    char CLEANUP_STR *buf = NULL;
+    size_t len;
+
+    if (encode_response(&buf, &len, s->binary, id, result) < 0)
+        return (-1);
+    if (s->outbox) {
+        char *msg = buf;
 
-    printlog(LOG_DEBUG, ">>> %s", buf);
-    bytes = sendto(ipc_sockfd, buf, strlen(buf), 0,
+        buf = NULL;
+        return (outbox_enqueue(s->outbox, msg, len));
+    }
+    bytes = sendto(ipc_sockfd, buf, len, 0,
                    (struct sockaddr *) &s->client_addr, s->client_addrlen);
     if (bytes < 0) {
         printlog(LOG_ERR, "sendto(2): %s", strerror(errno));
@@ -209,6 +364,149 @@ int ipc_send_response(struct ipc_session *s, const struct ipc_result result)
     return (0);
 }
 
+int ipc_send_response(struct ipc_session *s, const struct ipc_result result)
+{
+    return (send_response(s, s->req ? s->req->id : NULL, result));
+}
+
+/* Answer a request that could not be parsed, with its id if it has one */
+static void
+reject_request(struct ipc_session *s, const char *buf, size_t len)
+{
+    char CLEANUP_STR *id = NULL;
+
+    if (s->binary)
+        (void) ipc_frame_request_id(&id, buf, len);
+    else
+        (void) jsonrpc_request_parse_id(&id, buf, (int) len);
+    (void) send_response(s, id, IPC_RES_ERR(-32600, "Invalid request"));
+}
+
+int
+ipc_stream_new(struct ipc_stream **stream, const struct ipc_session *s, ipc_stream_fill_t fill,
+        void (*release)(void *), void *ctx)
+{
+    struct ipc_stream *st;
+
+    *stream = NULL;
+    if (s->connfd < 0)
+        return printlog(LOG_ERR, "streams need a persistent connection");
+    st = calloc(1, sizeof(*st));
+    if (!st)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    if (!(st->id = strdup(s->req->id ? s->req->id : "0"))) {
+        free(st);
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    }
+    st->connfd = s->connfd;
+    st->binary = s->binary;
+    st->fill = fill;
+    st->release = release;
+    st->ctx = ctx;
+    *stream = st;
+    return 0;
+}
+
+/*
+ * Build a chunk from the first len bytes of the data, if its encoding fits
+ * into one message. Escaping can make a JSON chunk several times as long as
+ * its data. Returns 1 if it does not fit.
+ */
+static int
+encode_chunk(struct ipc_stream *st, size_t len)
+{
+    char saved = st->data[len];
+    int rv = 0;
+
+    st->data[len] = '\0';
+    if (st->binary) {
+        if (!(st->msg = malloc(IPC_MAX_MSGLEN)))
+            rv = printlog(LOG_ERR, "malloc(3): %s", strerror(errno));
+        else if (ipc_frame_encode_chunk(st->msg, IPC_MAX_MSGLEN, &st->msglen, st->id, st->seq, st->data) < 0)
+            rv = printlog(LOG_ERR, "error building chunk");
+    } else if (jsonrpc_chunk_serialize(&st->msg, st->id, st->seq, st->data) < 0) {
+        rv = printlog(LOG_ERR, "error building chunk");
+    } else if ((st->msglen = strlen(st->msg)) > IPC_MAX_MSGLEN) {
+        free(st->msg);
+        st->msg = NULL;
+        rv = 1;
+    }
+    st->data[len] = saved;
+    return (rv);
+}
+
+/* Build the next message of the stream: a chunk, or the final response */
+static int
+stream_next_message(struct ipc_stream *st)
+{
+    char summary[32];
+    size_t len = 0;
+    int rv;
+
+    while (!st->filled || st->data_len > 0) {
+        if (st->data_len == 0) {
+            rv = st->fill(st->ctx, st->data, IPC_STREAM_CHUNK_SIZE, &len);
+            if (rv < 0) {
+                st->retcode = IPC_RESPONSE_ERROR;
+                len = 0;
+            }
+            st->filled = (rv <= 0);
+            st->data_len = len;
+            continue;
+        }
+
+        /* Whatever does not fit goes into the next chunk */
+        for (len = st->data_len; (rv = encode_chunk(st, len)) == 1; len /= 2) {
+            if (len == 1)
+                return printlog(LOG_ERR, "the id of the stream is too long");
+        }
+        if (rv < 0)
+            return -1;
+        memmove(st->data, st->data + len, st->data_len - len);
+        st->data_len -= len;
+        st->seq++;
+        return 0;
+    }
+
+    snprintf(summary, sizeof(summary), "{\"chunks\": %u}", st->seq);
+    st->finished = true;
+    return (encode_response(&st->msg, &st->msglen, st->binary, st->id,
+            IPC_RES(st->retcode, summary, "unable to produce the result")));
+}
+
+int
+ipc_stream_pump(struct ipc_stream *stream)
+{
+    for (int i = 0; i < IPC_STREAM_BATCH_MAX; i++) {
+        if (!stream->msg) {
+            if (stream->finished)
+                return 0;
+            if (stream_next_message(stream) < 0)
+                return -1;
+        }
+        if (send(stream->connfd, stream->msg, stream->msglen, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return printlog(LOG_ERR, "send(2): %s", strerror(errno));
+        }
+        free(stream->msg);
+        stream->msg = NULL;
+    }
+    return (stream->msg || !stream->finished);
+}
+
+void
+ipc_stream_free(struct ipc_stream *stream)
+{
+    if (!stream)
+        return;
+    if (stream->release)
+        stream->release(stream->ctx);
+    free(stream->msg);
+    free(stream->id);
+    free(stream);
+}
+
 int
 ipc_read_request(struct ipc_session *session)
 {
@@ -221,27 +519,73 @@ ipc_read_request(struct ipc_session *session)
         return printlog(LOG_ERR, "recvfrom(2): %s", strerror(errno));
     printlog(LOG_DEBUG, "<<< %s", buf);
     if (jsonrpc_request_parse(&session->req, buf, bytes) < 0) {
-        (void) ipc_send_response(session, IPC_RES_ERR(-32600, "Invalid request"));
+        reject_request(session, buf, (size_t) bytes);
         return printlog(LOG_ERR, "unable to parse client request");
     }
     return 0;
 }
 
 int
-ipc_connect(const char *service)
+ipc_read_connection_request(struct ipc_session *session, int connfd, struct ipc_outbox *outbox)
 {
-    struct sockaddr_un saun;
+    char buf[IPC_MAX_MSGLEN + 1];
+    ssize_t bytes;
 
-    if (create_ipc_socket(service) < 0)
+    session->connfd = connfd;
+    session->outbox = outbox;
+    bytes = recv(connfd, buf, IPC_MAX_MSGLEN, MSG_DONTWAIT | MSG_TRUNC);
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return printlog(LOG_ERR, "recv(2): %s", strerror(errno));
+    }
+    if (bytes == 0) {
+        printlog(LOG_DEBUG, "client hung up on connection %d", connfd);
         return -1;
+    }
+    if ((size_t) bytes > IPC_MAX_MSGLEN) {
+        printlog(LOG_ERR, "request of %zd bytes is too long", bytes);
+        session->binary = ipc_frame_detect(buf, IPC_MAX_MSGLEN);
+        reject_request(session, buf, IPC_MAX_MSGLEN);
+        return 0;
+    }
+    buf[bytes] = '\0';
+    if (ipc_frame_detect(buf, (size_t) bytes)) {
+        session->binary = true;
+        printlog(LOG_DEBUG, "<<< frame of %zd bytes", bytes);
+        if (ipc_frame_decode_request(&session->req, buf, (size_t) bytes) < 0) {
+            reject_request(session, buf, (size_t) bytes);
+            printlog(LOG_ERR, "unable to decode client request");
+        }
+        return 0;
+    }
+    printlog(LOG_DEBUG, "<<< %s", buf);
+    if (jsonrpc_request_parse(&session->req, buf, bytes) < 0) {
+        reject_request(session, buf, (size_t) bytes);
+        printlog(LOG_ERR, "unable to parse client request");
+    }
+    return 0;
+}
 
-    memset(&saun, 0, sizeof(saun));
-    saun.sun_family = AF_UNIX;
-    memset(saun.sun_path, 0, sizeof(saun.sun_path));
-    if (bind(ipc_sockfd, (struct sockaddr *) &saun, sizeof(saun)) < 0)
-        return printlog(LOG_ERR, "bind(2) to %s: %s", saun.sun_path, strerror(errno));
+int
+ipc_accept(void)
+{
+    int fd;
 
-    return 0;
+    fd = accept4(ipc_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            printlog(LOG_ERR, "accept4(2): %s", strerror(errno));
+        return -1;
+    }
+    printlog(LOG_DEBUG, "accepted connection %d", fd);
+    return fd;
+}
+
+int
+ipc_get_listen_fd(void)
+{
+    return ipc_listen_fd;
 }
 
 int
@@ -254,6 +598,8 @@ struct ipc_session * ipc_session_new(void)
 {
     struct ipc_session *p;
     p = calloc(1, sizeof(*p));
+    if (p)
+        p->connfd = -1;
     return p;
 }
 
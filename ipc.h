@@ -17,6 +17,7 @@
 #ifndef _IPC_H
 #define _IPC_H
 
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -31,6 +32,7 @@ struct ipc_response {
         IPC_RESPONSE_ERROR,
         IPC_RESPONSE_NOT_FOUND,
         IPC_RESPONSE_INVALID_STATE,
+        IPC_RESPONSE_TIMEOUT,
     } retcode;
 };
 
@@ -45,21 +47,67 @@ struct ipc_result {
 #define IPC_RES_DATA(_data)        ((struct ipc_result) { 0, _data, NULL })
 #define IPC_RES_ERR(_code, _errmsg) ((struct ipc_result) { _code, NULL, _errmsg })
 
+struct ipc_outbox;
+
+/*
+ * A request being handled by the server. It either arrived as a datagram on
+ * the main socket, or as a message on a persistent connection, in which case
+ * connfd is the connection that the response is sent back on.
+ */
 struct ipc_session {
     struct sockaddr_un client_addr;
     socklen_t client_addrlen;
+    int connfd;     /* -1 for datagrams */
+    struct ipc_outbox *outbox;  /* Where the response waits for the connection; NULL for datagrams */
+    bool binary;    /* The request was a frame, so the response must be one; see ipc_frame.h */
     struct jsonrpc_request *req;
 };
 
+/*
+ * Persistent connections use a SOCK_SEQPACKET socket next to the datagram
+ * socket, named <service>-session.sock. Each message is one JSON-RPC request
+ * or response. Clients can send more requests without waiting for the
+ * responses to earlier ones, and must match the responses by their id,
+ * since they are not necessarily sent in the order of the requests.
+ */
+
+/* Events pushed to subscribers are notifications that start like this */
+#define IPC_EVENT_PREFIX "{\"jsonrpc\":\"2.0\",\"method\":\"event\""
+
+/*
+ * Results that may not fit in one message (the list of jobs, the run
+ * history of a job, or its log) can be streamed over a persistent
+ * connection, by setting the "stream" parameter of the request. The result
+ * is then sent as a series of chunks:
+ *
+ *      {"jsonrpc":"2.0","id":"7","chunk":{"seq":0,"data":"..."}}
+ *
+ * numbered from 0, each carrying the next piece of the result as a string,
+ * followed by an ordinary response to the request, with {"chunks": N} as
+ * the result or an error. The chunks are produced as the connection drains,
+ * so the server never holds more than one chunk of the result, and does not
+ * read further requests from the connection until the stream has ended.
+ */
+
+/* The most data that is put into one chunk, before escaping */
+#define IPC_STREAM_CHUNK_SIZE 8192U
+
+/* The number of chunks sent each time the connection becomes writable */
+#define IPC_STREAM_BATCH_MAX 16
+
+struct ipc_stream;
+
+/*
+ * Fill buf with at most size bytes of text, and set *len. Returns 1 if
+ * there is more to come, 0 at the end of the result, or -1 on failure.
+ */
+typedef int (*ipc_stream_fill_t)(void *ctx, char *buf, size_t size, size_t *len);
+
 int ipc_init(void);
 void ipc_shutdown(void);
 
 int ipc_bind(const char *service);
 
-int ipc_connect(const char *service);
-
-int ipc_client_request(const char *job_id, const char *method);
-
 int ipc_read_request(struct ipc_session *s);
 
 int ipc_send_response(struct ipc_session *s, struct ipc_result res);
@@ -69,6 +117,40 @@ struct ipc_session * ipc_session_new(void);
 void ipc_session_destroy(struct ipc_session **s);
 #define CLEANUP_IPC_SESSION __attribute__((__cleanup__(ipc_session_destroy)))
 
+/* Stream the result of the session's request; release(ctx) is called when the stream is freed */
+int ipc_stream_new(struct ipc_stream **stream, const struct ipc_session *s, ipc_stream_fill_t fill,
+        void (*release)(void *), void *ctx);
+/*
+ * Called when the connection is writable. Returns 1 if there is more to
+ * send, 0 once the final response has been sent, or -1 if the client has
+ * gone away.
+ */
+int ipc_stream_pump(struct ipc_stream *stream);
+void ipc_stream_free(struct ipc_stream *stream);
+
 int ipc_get_sockfd(void);
 
+/* The listening socket for persistent connections */
+int ipc_get_listen_fd(void);
+/* Returns the fd of a new connection, or -1 */
+int ipc_accept(void);
+/*
+ * Leaves s->req NULL if nothing is waiting. Fails when the client has hung up.
+ * Every request gets a response, even one that could not be parsed, in
+ * which case it has the id of the request if that much could be read.
+ */
+int ipc_read_connection_request(struct ipc_session *s, int connfd, struct ipc_outbox *outbox);
+
+/*
+ * The responses that are waiting to be sent on a connection. Nothing blocks
+ * the server: what the connection cannot take yet is kept until it becomes
+ * writable, and backlog_changed(ctx) is called whenever that starts or stops
+ * being the case, so that the caller can ask for EVENT_WRITE.
+ */
+int ipc_outbox_new(struct ipc_outbox **outbox, int connfd, void (*backlog_changed)(void *), void *ctx);
+void ipc_outbox_free(struct ipc_outbox *outbox);
+/* Called when the connection is writable. Fails when the client has gone away. */
+int ipc_outbox_flush(struct ipc_outbox *outbox);
+bool ipc_outbox_backlogged(const struct ipc_outbox *outbox);
+
 #endif /* _IPC_H */
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipc_frame.h"
+#include "logger.h"
+
+/* The id of a method is its index in this table; new methods go at the end */
+static const char * const methods[] = {
+    NULL,
+    "start",
+    "stop",
+    "enable",
+    "disable",
+    "logs",
+    "bulk",
+    "subscribe",
+    "unsubscribe",
+    "reopen_database",
+    "loop_stats",
+    "list",
+    "status",
+    "properties",
+    "history",
+};
+
+#define METHODS_LEN (sizeof(methods) / sizeof(methods[0]))
+
+static const struct {
+    const char *name;
+    enum ipc_frame_tag tag;
+} params[] = {
+    { "job_id", IPC_TAG_JOB_ID },
+    { "operation", IPC_TAG_OPERATION },
+    { "states", IPC_TAG_STATES },
+    { "events", IPC_TAG_EVENTS },
+    { "wait", IPC_TAG_WAIT },
+    { "timeout", IPC_TAG_TIMEOUT },
+    { "sort", IPC_TAG_SORT },
+    { "offset", IPC_TAG_OFFSET },
+    { "limit", IPC_TAG_LIMIT },
+    { "stream", IPC_TAG_STREAM },
+};
+
+#define PARAMS_LEN (sizeof(params) / sizeof(params[0]))
+
+uint16_t
+ipc_frame_method_id(const char *name)
+{
+    uint16_t i;
+
+    for (i = 1; i < METHODS_LEN; i++) {
+        if (!strcmp(methods[i], name))
+            return i;
+    }
+    return 0;
+}
+
+const char *
+ipc_frame_method_name(uint16_t id)
+{
+    return (id > 0 && id < METHODS_LEN ? methods[id] : NULL);
+}
+
+int
+ipc_frame_detect(const char *buf, size_t len)
+{
+    struct ipc_frame_header hdr;
+
+    if (len < sizeof(hdr))
+        return 0;
+    memcpy(&hdr, buf, sizeof(hdr));
+    return (hdr.magic == IPC_FRAME_MAGIC);
+}
+
+static int
+start_frame(char *buf, size_t size, size_t *len, enum ipc_frame_type type, uint32_t id)
+{
+    struct ipc_frame_header hdr = {
+            .magic = IPC_FRAME_MAGIC,
+            .version = IPC_FRAME_VERSION,
+            .type = type,
+            .id = id,
+    };
+
+    if (size < sizeof(hdr))
+        return printlog(LOG_ERR, "buffer too small for a frame");
+    memcpy(buf, &hdr, sizeof(hdr));
+    *len = sizeof(hdr);
+    return 0;
+}
+
+static int
+append_tlv(char *buf, size_t size, size_t *len, enum ipc_frame_tag tag, const char *value)
+{
+    struct ipc_frame_tlv tlv;
+    size_t value_len = strlen(value);
+
+    if (value_len > UINT16_MAX || *len + sizeof(tlv) + value_len > size)
+        return printlog(LOG_ERR, "frame too long");
+    tlv.tag = tag;
+    tlv.length = (uint16_t) value_len;
+    memcpy(buf + *len, &tlv, sizeof(tlv));
+    memcpy(buf + *len + sizeof(tlv), value, value_len);
+    *len += sizeof(tlv) + value_len;
+    return 0;
+}
+
+static void
+finish_frame(char *buf, size_t len, uint16_t method, int16_t retcode)
+{
+    struct ipc_frame_header hdr;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    hdr.length = (uint32_t) (len - sizeof(hdr));
+    hdr.method = method;
+    hdr.retcode = retcode;
+    memcpy(buf, &hdr, sizeof(hdr));
+}
+
+int
+ipc_frame_encode_request(char *buf, size_t size, size_t *len, const struct jsonrpc_request *req)
+{
+    uint16_t method;
+    uint32_t i;
+    size_t j;
+
+    method = ipc_frame_method_id(req->method);
+    if (method == 0)
+        return printlog(LOG_ERR, "method `%s' has no binary encoding", req->method);
+    if (start_frame(buf, size, len, IPC_FRAME_REQUEST, (uint32_t) strtoul(req->id, NULL, 10)) < 0)
+        return -1;
+    for (i = 0; i < req->nparams; i++) {
+        for (j = 0; j < PARAMS_LEN; j++) {
+            if (!strcmp(params[j].name, req->param_name[i]))
+                break;
+        }
+        if (j == PARAMS_LEN)
+            return printlog(LOG_ERR, "parameter `%s' has no binary encoding", req->param_name[i]);
+        if (append_tlv(buf, size, len, params[j].tag, req->param_value[i]) < 0)
+            return -1;
+    }
+    finish_frame(buf, *len, method, 0);
+    return 0;
+}
+
+int
+ipc_frame_encode_response(char *buf, size_t size, size_t *len, const char *id,
+        int retcode, const char *data, const char *errmsg)
+{
+    if (start_frame(buf, size, len, IPC_FRAME_RESPONSE, id ? (uint32_t) strtoul(id, NULL, 10) : 0) < 0)
+        return -1;
+    /* An error may have data too, such as the state that a waiting request ended in */
+    if (data && append_tlv(buf, size, len, IPC_TAG_RESULT, data) < 0)
+        return -1;
+    if (retcode != 0 && errmsg && append_tlv(buf, size, len, IPC_TAG_ERROR, errmsg) < 0)
+        return -1;
+    finish_frame(buf, *len, 0, (int16_t) retcode);
+    return 0;
+}
+
+int
+ipc_frame_encode_event(char *buf, size_t size, size_t *len, const char *json)
+{
+    if (start_frame(buf, size, len, IPC_FRAME_EVENT, 0) < 0)
+        return -1;
+    if (append_tlv(buf, size, len, IPC_TAG_RESULT, json) < 0)
+        return -1;
+    finish_frame(buf, *len, 0, 0);
+    return 0;
+}
+
+int
+ipc_frame_encode_chunk(char *buf, size_t size, size_t *len, const char *id, uint32_t seq,
+        const char *data)
+{
+    char seqstr[16];
+
+    snprintf(seqstr, sizeof(seqstr), "%u", seq);
+    if (start_frame(buf, size, len, IPC_FRAME_CHUNK, (uint32_t) strtoul(id, NULL, 10)) < 0)
+        return -1;
+    if (append_tlv(buf, size, len, IPC_TAG_SEQ, seqstr) < 0 ||
+            append_tlv(buf, size, len, IPC_TAG_RESULT, data) < 0)
+        return -1;
+    finish_frame(buf, *len, 0, 0);
+    return 0;
+}
+
+/* Check the header, and call back for each TLV; stops at the first callback that fails */
+static int
+parse_frame(struct ipc_frame_header *hdr, const char *buf, size_t len,
+        int (*func)(void *, enum ipc_frame_tag, char *), void *ctx)
+{
+    struct ipc_frame_tlv tlv;
+    size_t pos;
+    char *value;
+
+    if (!ipc_frame_detect(buf, len))
+        return printlog(LOG_ERR, "not a frame");
+    memcpy(hdr, buf, sizeof(*hdr));
+    if (hdr->version != IPC_FRAME_VERSION)
+        return printlog(LOG_ERR, "unsupported frame version %u", hdr->version);
+    if (hdr->length != len - sizeof(*hdr))
+        return printlog(LOG_ERR, "frame length %u does not match the message length %zu",
+                hdr->length, len - sizeof(*hdr));
+
+    for (pos = sizeof(*hdr); pos < len; pos += sizeof(tlv) + tlv.length) {
+        if (len - pos < sizeof(tlv))
+            return printlog(LOG_ERR, "truncated frame");
+        memcpy(&tlv, buf + pos, sizeof(tlv));
+        if (len - pos - sizeof(tlv) < tlv.length)
+            return printlog(LOG_ERR, "truncated frame");
+        value = strndup(buf + pos + sizeof(tlv), tlv.length);
+        if (!value)
+            return printlog(LOG_ERR, "strndup(3): %s", strerror(errno));
+        if (func(ctx, tlv.tag, value) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Takes ownership of the value */
+static int
+add_request_param(void *ctx, enum ipc_frame_tag tag, char *value)
+{
+    struct jsonrpc_request *req = ctx;
+    size_t i;
+
+    for (i = 0; i < PARAMS_LEN; i++) {
+        if (params[i].tag == tag)
+            break;
+    }
+    if (i == PARAMS_LEN || req->nparams == IPC_REQUEST_PARAM_MAX) {
+        free(value);
+        return printlog(LOG_ERR, "unexpected tag %d in a request", tag);
+    }
+    req->param_name[req->nparams] = strdup(params[i].name);
+    req->param_value[req->nparams] = value;
+    req->nparams++;
+    if (!req->param_name[req->nparams - 1])
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    return 0;
+}
+
+int
+ipc_frame_decode_request(struct jsonrpc_request **dest, const char *buf, size_t len)
+{
+    struct jsonrpc_request CLEANUP_JSONRPC_REQUEST *req = NULL;
+    struct ipc_frame_header hdr;
+    const char *method;
+    char id[16];
+
+    *dest = NULL;
+    if (!(req = calloc(1, sizeof(*req))))
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    if (parse_frame(&hdr, buf, len, add_request_param, req) < 0)
+        return -1;
+    if (hdr.type != IPC_FRAME_REQUEST)
+        return printlog(LOG_ERR, "expected a request, got a frame of type %u", hdr.type);
+    if (!(method = ipc_frame_method_name(hdr.method)))
+        return printlog(LOG_ERR, "unknown method %u", hdr.method);
+
+    snprintf(id, sizeof(id), "%u", hdr.id);
+    req->id = strdup(id);
+    req->method = strdup(method);
+    if (!req->id || !req->method)
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+
+    *dest = req;
+    req = NULL;
+    return 0;
+}
+
+int
+ipc_frame_request_id(char **id, const char *buf, size_t len)
+{
+    struct ipc_frame_header hdr;
+    char idstr[16];
+
+    *id = NULL;
+    if (!ipc_frame_detect(buf, len))
+        return 0;
+    memcpy(&hdr, buf, sizeof(hdr));
+    snprintf(idstr, sizeof(idstr), "%u", hdr.id);
+    if (!(*id = strdup(idstr)))
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    return 0;
+}
+
+static int
+add_response_part(void *ctx, enum ipc_frame_tag tag, char *value)
+{
+    struct jsonrpc_response *res = ctx;
+
+    if (tag == IPC_TAG_RESULT && !res->result) {
+        res->result = value;
+    } else if (tag == IPC_TAG_ERROR && !res->error.message) {
+        res->error.message = value;
+    } else if (tag == IPC_TAG_SEQ) {
+        res->seq = (uint32_t) strtoul(value, NULL, 10);
+        free(value);
+    } else {
+        free(value);
+        return printlog(LOG_ERR, "unexpected tag %d in a response", tag);
+    }
+    return 0;
+}
+
+int
+ipc_frame_decode_response(struct jsonrpc_response **dest, const char *buf, size_t len)
+{
+    struct jsonrpc_response CLEANUP_JSONRPC_RESPONSE *res = NULL;
+    struct ipc_frame_header hdr;
+    char id[16];
+
+    *dest = NULL;
+    if (!(res = calloc(1, sizeof(*res))))
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    if (parse_frame(&hdr, buf, len, add_response_part, res) < 0)
+        return -1;
+    if (hdr.type != IPC_FRAME_RESPONSE && hdr.type != IPC_FRAME_EVENT && hdr.type != IPC_FRAME_CHUNK)
+        return printlog(LOG_ERR, "expected a response, got a frame of type %u", hdr.type);
+    if (hdr.type != IPC_FRAME_EVENT) {
+        snprintf(id, sizeof(id), "%u", hdr.id);
+        if (!(res->id = strdup(id)))
+            return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+        res->error.code = hdr.retcode;
+        res->chunk = (hdr.type == IPC_FRAME_CHUNK);
+    }
+
+    *dest = res;
+    res = NULL;
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _IPC_FRAME_H
+#define _IPC_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jsonrpc.h"
+
+/*
+ * A compact binary encoding of IPC messages, for clients that send many
+ * requests. It carries the same requests and responses as JSON-RPC, and is
+ * translated to and from the same structures, so the server dispatches both
+ * in the same way; it just avoids running SQLite's JSON functions on every
+ * message.
+ *
+ * Each message is a header, followed by `length' bytes of parameters, each
+ * of which is a tag, a length and a value (TLV). Strings are not terminated.
+ * Integers are in host byte order, since both ends are on the same host.
+ *
+ * Binary frames are only accepted on persistent connections, where a client
+ * picks the encoding by what it sends: the response to a frame is a frame,
+ * and the events of a subscription made with a frame are sent as frames,
+ * each carrying the same JSON text as a JSON-RPC event would. The chunks of
+ * a streamed result are frames with the id of the request, a sequence
+ * number and a piece of the result.
+ */
+
+#define IPC_FRAME_MAGIC     0x424a  /* "JB" in little-endian */
+#define IPC_FRAME_VERSION   1
+
+enum ipc_frame_type {
+    IPC_FRAME_REQUEST = 1,
+    IPC_FRAME_RESPONSE,
+    IPC_FRAME_EVENT,
+    IPC_FRAME_CHUNK,
+};
+
+struct ipc_frame_header {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint32_t length;        /* of the TLVs that follow */
+    uint32_t id;            /* Matches a response to its request */
+    uint16_t method;        /* Requests only; see ipc_frame_method_id() */
+    int16_t retcode;        /* Responses only */
+};
+
+struct ipc_frame_tlv {
+    uint16_t tag;
+    uint16_t length;
+};
+
+/* Request parameters, followed by the parts of responses and events */
+enum ipc_frame_tag {
+    IPC_TAG_JOB_ID = 1,
+    IPC_TAG_OPERATION,
+    IPC_TAG_STATES,
+    IPC_TAG_EVENTS,
+    IPC_TAG_WAIT,
+    IPC_TAG_TIMEOUT,
+    IPC_TAG_SORT,
+    IPC_TAG_OFFSET,
+    IPC_TAG_LIMIT,
+    IPC_TAG_STREAM,
+    IPC_TAG_RESULT = 16,    /* The result of a response, the data of an error, the JSON text of an event, or a chunk */
+    IPC_TAG_ERROR,
+    IPC_TAG_SEQ,            /* Of a chunk, in decimal */
+};
+
+/* Returns 0 for unknown methods, and NULL for unknown ids */
+uint16_t ipc_frame_method_id(const char *name);
+const char *ipc_frame_method_name(uint16_t id);
+
+/* True if the message starts with a frame header */
+int ipc_frame_detect(const char *buf, size_t len);
+
+/* The encoders write at most `size' bytes into buf, and set *len */
+int ipc_frame_encode_request(char *buf, size_t size, size_t *len, const struct jsonrpc_request *req);
+int ipc_frame_encode_response(char *buf, size_t size, size_t *len, const char *id,
+        int retcode, const char *data, const char *errmsg);
+int ipc_frame_encode_event(char *buf, size_t size, size_t *len, const char *json);
+int ipc_frame_encode_chunk(char *buf, size_t size, size_t *len, const char *id, uint32_t seq,
+        const char *data);
+
+int ipc_frame_decode_request(struct jsonrpc_request **req, const char *buf, size_t len);
+/* The id of a request that could not be decoded, if it has one; caller must free */
+int ipc_frame_request_id(char **id, const char *buf, size_t len);
+/*
+ * Events are decoded into a response with a NULL id, and their JSON text as
+ * the result. Chunks are decoded like the JSON-RPC ones; see jsonrpc.h.
+ */
+int ipc_frame_decode_response(struct jsonrpc_response **res, const char *buf, size_t len);
+
+#endif /* _IPC_FRAME_H */
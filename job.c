@@ -16,24 +16,148 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <pwd.h>
 #include <time.h>
 
+#include "cgroup.h"
 #include "database.h"
+#include "job_output.h"
+#include "job_table.h"
 #include "logger.h"
 #include "memory.h"
 #include "job.h"
 #include "parser.h"
+#include "runner.h"
+#include "script_cache.h"
+#include "worker_pool.h"
+
+static const struct {
+    const char *name;
+    int resource;
+} rlimit_names[] = {
+    { "as", RLIMIT_AS },
+    { "core", RLIMIT_CORE },
+    { "nofile", RLIMIT_NOFILE },
+    { "nproc", RLIMIT_NPROC },
+};
 
-struct child_context {
+#define RLIMIT_NAMES_LEN (sizeof(rlimit_names) / sizeof(rlimit_names[0]))
+
+/*
+ * The child reports a failure to reach execve(2) through a pipe that is
+ * close-on-exec; see read_exec_status().
+ */
+enum exec_stage {
+    EXEC_STAGE_NONE,
+    EXEC_STAGE_CGROUP,
+    EXEC_STAGE_CREDENTIALS,
+    EXEC_STAGE_RLIMIT,
+    EXEC_STAGE_ROOT_DIRECTORY,
+    EXEC_STAGE_WORKING_DIRECTORY,
+    EXEC_STAGE_UMASK,
+    EXEC_STAGE_STDIO,
+    EXEC_STAGE_EXECVE,
+};
+
+static const char *exec_stage_names[] = {
+    "none", "cgroup", "credentials", "rlimit", "root_directory",
+    "working_directory", "umask", "stdio", "execve",
+};
+
+struct exec_failure {
+    int stage;
+    int error;
+};
+
+/* Who the child runs as; looked up before fork(2), since NSS is not async-signal-safe */
+struct credentials {
+    int error;          /* Why the user or group could not be found; 0 if they were */
+    uid_t uid;          /* Only looked up if jobd runs as root */
+    gid_t gid;
+    gid_t *groups;      /* Supplementary groups; NULL unless init_groups is set */
+    int ngroups;
+};
+
+/* Credentials are looked up again, in the background, once they are this old */
+#define CREDENTIALS_TTL 600
+
+/*
+ * The credentials of each combination of user, group and init_groups that a
+ * job has asked for. They are looked up in the worker pool; entries are kept
+ * for the life of jobd, so only the first start as a given user has to wait.
+ */
+struct credentials_entry {
+    char *user_name;
+    char *group_name;
+    bool init_groups;
+    bool resolved;          /* creds is valid */
+    bool lookup_pending;
+    time_t resolved_at;
+    struct credentials creds;
+    LIST_ENTRY(credentials_entry) entries;
+};
+
+static LIST_HEAD(, credentials_entry) credentials_cache = LIST_HEAD_INITIALIZER(credentials_cache);
+
+/* A private copy for the worker pool */
+struct credentials_lookup {
+    struct credentials_entry *entry;
+    char *user_name;
+    char *group_name;
+    bool init_groups;
+    struct credentials creds;
+};
+
+/* A start that is waiting for the credentials of its job to be looked up */
+struct deferred_start {
+    job_id_t jid;
+    enum job_start_reason reason;
+    struct credentials_entry *entry;
+    LIST_ENTRY(deferred_start) entries;
+};
+
+static LIST_HEAD(, deferred_start) deferred_starts = LIST_HEAD_INITIALIZER(deferred_starts);
+
+struct spawn_result {
+    int64_t latency;                /* Microseconds from fork(2) to execve(2) */
+    struct exec_failure failure;    /* stage is EXEC_STAGE_NONE on success */
+};
+
+enum spawn_kind {
+    SPAWN_START,        /* The start method, whose process is the job */
+    SPAWN_METHOD,       /* Any other method, which merely manages the job */
+    SPAWN_WORKER,       /* A worker of the shared runner */
+};
+
+/* A child that has been forked, but is not known to have reached execve(2) yet */
+struct pending_spawn {
+    enum spawn_kind kind;
+    job_id_t jid;
+    pid_t pid;
+    char *method_name;
+    int status_fd;          /* -1 once the outcome is known */
+    void *watch;
+    struct timespec fork_time;
+    bool failed;            /* The child gave up, and has yet to be reaped */
+    LIST_ENTRY(pending_spawn) entries;
+};
+
+static LIST_HEAD(, pending_spawn) pending_spawns = LIST_HEAD_INITIALIZER(pending_spawns);
+static struct job_spawn_callbacks spawn_callbacks;
+
+/* How every child of a job is set up, apart from its script; kept in the script cache */
+struct spawn_settings {
     char *working_directory;
     char *root_directory;
     int init_groups;
@@ -43,19 +167,168 @@ struct child_context {
     char *stdin_path;
     char *stdout_path;
     char *umask_str;
+    mode_t umask;
+    int umask_error;        /* Why umask_str could not be parsed; 0 if it was */
+    struct credentials_entry *credentials;  /* Shared with the jobs that run as the same user */
+    struct {
+        int resource;
+        rlim_t value;
+    } rlimits[RLIMIT_NAMES_LEN];
+    size_t rlimits_len;
+    struct string_array *cgroup_limits;     /* name, value pairs */
+    struct job_output_options log_options;
+    bool wants_shared_runner;
+    char *worker_key;       /* NULL unless the job can use the shared runner */
+};
+
+struct child_context {
+    const struct spawn_settings *settings;  /* Borrowed from the script cache */
+    bool discard_output;    /* Send output that would be captured to /dev/null */
+    int cgroup_fd;
+    int script_fd;      /* Borrowed from the script cache; never closed here */
+    int output_fd;      /* Borrowed from job_output; never closed here */
+    struct exec_failure failure;
 };
 
+/*
+ * Record where the child failed. Between fork(2) and execve(2), the child
+ * only makes async-signal-safe calls, so it never logs; the parent does.
+ */
+#define child_error(ctx, _stage, _error) \
+    ((ctx)->failure.stage = (_stage), (ctx)->failure.error = (_error), -1)
+
+int
+job_parse_rlimit(int *resource, rlim_t *value, const char *name, const char *str)
+{
+    unsigned long long ull;
+    char *endptr;
+    size_t i;
+
+    for (i = 0; i < RLIMIT_NAMES_LEN; i++) {
+        if (!strcmp(rlimit_names[i].name, name))
+            break;
+    }
+    if (i == RLIMIT_NAMES_LEN)
+        return printlog(LOG_ERR, "unsupported resource limit: %s", name);
+    *resource = rlimit_names[i].resource;
+
+    if (!strcmp(str, "unlimited")) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    errno = 0;
+    ull = strtoull(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr != '\0' || str[0] == '-')
+        return printlog(LOG_ERR, "invalid value for resource limit %s: %s", name, str);
+    *value = (rlim_t) ull;
+    return 0;
+}
+
 static int
-get_child_context(struct child_context *ctx, int64_t jid)
+load_rlimits(struct spawn_settings *settings, int64_t jid)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char sql[] = "SELECT name, value FROM job_resource_limits "
+                       "WHERE job_id = ? AND kind = 'rlimit'";
+    int rv;
+
+    if (db_query(&stmt, sql, "i", jid) < 0)
+        return db_error;
+
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (settings->rlimits_len == RLIMIT_NAMES_LEN)
+            return printlog(LOG_ERR, "too many resource limits");
+        if (job_parse_rlimit(&settings->rlimits[settings->rlimits_len].resource,
+                    &settings->rlimits[settings->rlimits_len].value,
+                    (const char *) sqlite3_column_text(stmt, 0),
+                    (const char *) sqlite3_column_text(stmt, 1)) < 0)
+            return -1;
+        settings->rlimits_len++;
+    }
+    if (rv != SQLITE_DONE)
+        return db_error;
+
+    return 0;
+}
+
+static int
+load_cgroup_limits(struct spawn_settings *settings, int64_t jid)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char sql[] = "SELECT name, value FROM job_resource_limits "
+                       "WHERE job_id = ? AND kind = 'cgroup'";
+    int rv;
+
+    if (db_query(&stmt, sql, "i", jid) < 0)
+        return db_error;
+
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (string_array_push_back(settings->cgroup_limits,
+                    strdup((const char *) sqlite3_column_text(stmt, 0))) < 0 ||
+            string_array_push_back(settings->cgroup_limits,
+                    strdup((const char *) sqlite3_column_text(stmt, 1))) < 0)
+            return printlog(LOG_ERR, "unable to add a cgroup limit");
+    }
+    if (rv != SQLITE_DONE)
+        return db_error;
+
+    return 0;
+}
+
+/* The [log] section of the manifest */
+static int
+load_log_options(struct spawn_settings *settings, int64_t jid)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char sql[] = "SELECT name, value FROM job_resource_limits "
+                       "WHERE job_id = ? AND kind = 'log'";
+    int rv;
+
+    job_output_default_options(&settings->log_options);
+    if (db_query(&stmt, sql, "i", jid) < 0)
+        return db_error;
+
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (job_output_parse_option(&settings->log_options,
+                    (const char *) sqlite3_column_text(stmt, 0),
+                    (const char *) sqlite3_column_text(stmt, 1)) < 0)
+            return -1;
+    }
+    if (rv != SQLITE_DONE)
+        return db_error;
+
+    return 0;
+}
+
+/* Cgroup limits are mandatory: if they cannot be applied, the job must not run */
+static int
+apply_cgroup_limits(int64_t jid, const struct spawn_settings *settings)
+{
+    const char *name, *value;
+
+    for (uint32_t i = 0; i + 1 < string_array_len(settings->cgroup_limits); i += 2) {
+        name = string_array_data(settings->cgroup_limits)[i];
+        value = string_array_data(settings->cgroup_limits)[i + 1];
+        if (!cgroup_enabled())
+            return printlog(LOG_ERR, "job `%s' requires %s, but cgroups are not available",
+                    job_id_to_str(jid), name);
+        if (cgroup_job_set_limit(jid, name, value) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+load_child_context(struct spawn_settings *settings, int64_t jid)
 {
     sqlite3_stmt CLEANUP_STMT *stmt = NULL;
     const char sql[] = "SELECT working_directory, root_directory, init_groups, "
                        "user_name, gid, "
                        "standard_error_path, standard_in_path, standard_out_path, "
-                       "umask "
+                       "umask, runner = 'shared' AND job_type_id = ? "
                        "FROM jobs WHERE id = ?";
 
-    if (db_query(&stmt, sql, "i", jid) < 0)
+    if (db_query(&stmt, sql, "ii", (int64_t) JOB_TYPE_TASK, jid) < 0)
         return db_error;
 
     switch (sqlite3_step(stmt)) {
@@ -67,31 +340,353 @@ get_child_context(struct child_context *ctx, int64_t jid)
             return db_error;
     }
 
-    // FIXME: need to error check strdup() calls
-    ctx->working_directory = strdup((char *) sqlite3_column_text(stmt, 0));
-    ctx->root_directory = strdup((char *) sqlite3_column_text(stmt, 1));
-    ctx->init_groups = sqlite3_column_int(stmt, 2);
-    ctx->user_name = strdup((char *) sqlite3_column_text(stmt, 3));
-    ctx->group_name = strdup((char *) sqlite3_column_text(stmt, 4));
-    ctx->stderr_path = strdup((char *) sqlite3_column_text(stmt, 5));
-    ctx->stdin_path = strdup((char *) sqlite3_column_text(stmt, 6));
-    ctx->stdout_path = strdup((char *) sqlite3_column_text(stmt, 7));
-    ctx->umask_str = strdup((char *) sqlite3_column_text(stmt, 8));
+    settings->working_directory = strdup((char *) sqlite3_column_text(stmt, 0));
+    settings->root_directory = strdup((char *) sqlite3_column_text(stmt, 1));
+    settings->init_groups = sqlite3_column_int(stmt, 2);
+    settings->user_name = strdup((char *) sqlite3_column_text(stmt, 3));
+    settings->group_name = strdup((char *) sqlite3_column_text(stmt, 4));
+    settings->stderr_path = strdup((char *) sqlite3_column_text(stmt, 5));
+    settings->stdin_path = strdup((char *) sqlite3_column_text(stmt, 6));
+    settings->stdout_path = strdup((char *) sqlite3_column_text(stmt, 7));
+    settings->umask_str = strdup((char *) sqlite3_column_text(stmt, 8));
+    if (!settings->working_directory || !settings->root_directory || !settings->user_name ||
+        !settings->group_name || !settings->stderr_path || !settings->stdin_path ||
+        !settings->stdout_path || !settings->umask_str)
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    settings->wants_shared_runner = sqlite3_column_int(stmt, 9);
+
+    return 0;
+}
+
+/* A bad umask is reported by the child, like any other setting that it cannot apply */
+static void
+parse_umask(struct spawn_settings *settings)
+{
+    char *endptr;
+    long value;
+
+    errno = 0;
+    value = strtol(settings->umask_str, &endptr, 10);
+    if (errno != 0)
+        settings->umask_error = errno;
+    else if (value > INT_MAX || value < INT_MIN)
+        settings->umask_error = ERANGE;
+    else if (endptr == settings->umask_str || *endptr != '\0')
+        settings->umask_error = EINVAL;
+    else
+        settings->umask = (mode_t) value;
+}
+
+/* getpwnam_r(3) and friends want a buffer whose size is only a hint */
+static size_t
+nss_buffer_size(int name)
+{
+    long size = sysconf(name);
+
+    return (size > 0 ? (size_t) size : 16384);
+}
+
+static int
+lookup_uid(uid_t *uid, const char *user_name)
+{
+    struct passwd pwd, *result;
+    size_t len = nss_buffer_size(_SC_GETPW_R_SIZE_MAX);
+    char *buf;
+    int rv;
+
+    for (;;) {
+        if (!(buf = malloc(len)))
+            return (ENOMEM);
+        rv = getpwnam_r(user_name, &pwd, buf, len, &result);
+        if (rv != ERANGE)
+            break;
+        free(buf);
+        len *= 2;
+    }
+    if (rv == 0 && result)
+        *uid = pwd.pw_uid;
+    free(buf);
+    return (rv ? rv : (result ? 0 : ENOENT));
+}
+
+static int
+lookup_gid(gid_t *gid, const char *group_name)
+{
+    struct group grp, *result;
+    size_t len = nss_buffer_size(_SC_GETGR_R_SIZE_MAX);
+    char *buf;
+    int rv;
+
+    for (;;) {
+        if (!(buf = malloc(len)))
+            return (ENOMEM);
+        rv = getgrnam_r(group_name, &grp, buf, len, &result);
+        if (rv != ERANGE)
+            break;
+        free(buf);
+        len *= 2;
+    }
+    if (rv == 0 && result)
+        *gid = grp.gr_gid;
+    free(buf);
+    return (rv ? rv : (result ? 0 : ENOENT));
+}
+
+/* The equivalent of initgroups(3), without changing the groups of jobd */
+static int
+lookup_groups(struct credentials *creds, const char *user_name)
+{
+    gid_t *groups;
+    int len = 16, ngroups;
+
+    for (;;) {
+        if (!(groups = malloc((size_t) len * sizeof(gid_t))))
+            return (ENOMEM);
+        ngroups = len;
+        if (getgrouplist(user_name, creds->gid, groups, &ngroups) >= 0)
+            break;
+        free(groups);
+        if (len > NGROUPS_MAX)
+            return (EINVAL);
+        /* glibc says how many are needed, but BSD does not */
+        len = (ngroups > len) ? ngroups : len * 2;
+    }
+    creds->groups = groups;
+    creds->ngroups = ngroups;
+    return 0;
+}
+
+/* Thread-safe and silent; the caller reports creds->error */
+static void
+resolve_credentials(struct credentials *creds, const char *user_name, const char *group_name, bool init_groups)
+{
+    memset(creds, 0, sizeof(*creds));
+    if (group_name[0] == '\0')
+        creds->gid = getgid();
+    else if ((creds->error = lookup_gid(&creds->gid, group_name)))
+        return;
+    /* Only root can become someone else */
+    if (getuid() != 0)
+        return;
+    if ((creds->error = lookup_uid(&creds->uid, user_name)))
+        return;
+    if (init_groups)
+        creds->error = lookup_groups(creds, user_name);
+}
+
+static void
+credentials_update(struct credentials_entry *entry, struct credentials *creds)
+{
+    if (creds->error && (!entry->resolved || entry->creds.error != creds->error))
+        printlog(LOG_ERR, "unable to look up user `%s' or group `%s': %s",
+                entry->user_name, entry->group_name, strerror(creds->error));
+    free(entry->creds.groups);
+    entry->creds = *creds;
+    memset(creds, 0, sizeof(*creds));
+    entry->resolved = true;
+    entry->resolved_at = time(NULL);
+}
+
+static void
+credentials_lookup_work(void *arg)
+{
+    struct credentials_lookup *cl = arg;
+
+    resolve_credentials(&cl->creds, cl->user_name, cl->group_name, cl->init_groups);
+}
+
+static void
+credentials_lookup_done(void *arg)
+{
+    struct credentials_lookup *cl = arg;
+    struct credentials_entry *entry = cl->entry;
+    struct deferred_start *ds;
+    struct job_table_entry *jte;
+    pid_t pid;
+
+    entry->lookup_pending = false;
+    credentials_update(entry, &cl->creds);
+    free(cl->user_name);
+    free(cl->group_name);
+    free(cl);
+
+    /* Starting a job may stop another, and so change the list */
+    for (;;) {
+        LIST_FOREACH(ds, &deferred_starts, entries) {
+            if (ds->entry == entry)
+                break;
+        }
+        if (!ds)
+            break;
+        LIST_REMOVE(ds, entries);
+        /* Unless the job was stopped in the meantime; see job_stop() */
+        jte = job_table_lookup_by_id(ds->jid);
+        if (jte && jte->state == JOB_STATE_STARTING && jte->pid == 0)
+            (void) job_start(&pid, ds->jid, ds->reason);
+        free(ds);
+    }
+}
 
+static int
+credentials_lookup(struct credentials_entry *entry)
+{
+    struct credentials_lookup *cl;
+
+    cl = calloc(1, sizeof(*cl));
+    if (!cl || !(cl->user_name = strdup(entry->user_name)) || !(cl->group_name = strdup(entry->group_name))) {
+        if (cl)
+            free(cl->user_name);
+        free(cl);
+        return printlog(LOG_ERR, "unable to allocate memory: %s", strerror(errno));
+    }
+    cl->entry = entry;
+    cl->init_groups = entry->init_groups;
+    entry->lookup_pending = true;
+    if (worker_pool_submit(credentials_lookup_work, credentials_lookup_done, cl) < 0) {
+        entry->lookup_pending = false;
+        free(cl->user_name);
+        free(cl->group_name);
+        free(cl);
+        return (-1);
+    }
+    return 0;
+}
+
+/* Stale credentials are still used until the new ones are in */
+static void
+credentials_refresh(struct credentials_entry *entry)
+{
+    if (!entry->lookup_pending && (!entry->resolved || time(NULL) - entry->resolved_at >= CREDENTIALS_TTL))
+        (void) credentials_lookup(entry);
+}
+
+/* Returns NULL if out of memory; the credentials may not have been looked up yet */
+static struct credentials_entry *
+credentials_get(const char *user_name, const char *group_name, bool init_groups)
+{
+    struct credentials_entry *entry;
+
+    LIST_FOREACH(entry, &credentials_cache, entries) {
+        if (!strcmp(entry->user_name, user_name) && !strcmp(entry->group_name, group_name) &&
+            entry->init_groups == init_groups)
+            break;
+    }
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry));
+        if (!entry || !(entry->user_name = strdup(user_name)) || !(entry->group_name = strdup(group_name))) {
+            printlog(LOG_ERR, "unable to allocate memory: %s", strerror(errno));
+            if (entry)
+                free(entry->user_name);
+            free(entry);
+            return (NULL);
+        }
+        entry->init_groups = init_groups;
+        LIST_INSERT_HEAD(&credentials_cache, entry, entries);
+    }
+
+    credentials_refresh(entry);
+    return (entry);
+}
+
+/* For the rare spawn that cannot wait, such as a method of a job that never started */
+static void
+credentials_resolve_now(struct credentials_entry *entry)
+{
+    struct credentials creds;
+
+    printlog(LOG_DEBUG, "looking up user `%s' and group `%s' on the event loop", entry->user_name,
+            entry->group_name);
+    resolve_credentials(&creds, entry->user_name, entry->group_name, entry->init_groups);
+    credentials_update(entry, &creds);
+}
+
+/*
+ * Tasks can share a worker if everything that is set up before the shell runs
+ * is the same. Captured output cannot be attributed to the task that wrote it,
+ * and cgroup limits would apply to the whole worker, so tasks that use either
+ * of them get a process of their own.
+ */
+static int
+build_worker_key(struct spawn_settings *settings)
+{
+    char rlimits[RLIMIT_NAMES_LEN * 32] = "";
+    size_t len = 0;
+    char *key;
+
+    if (!settings->wants_shared_runner ||
+        settings->stdout_path[0] == '\0' || settings->stderr_path[0] == '\0' ||
+        string_array_len(settings->cgroup_limits) > 0)
+        return 0;
+
+    for (size_t i = 0; i < settings->rlimits_len; i++) {
+        len += (size_t) snprintf(rlimits + len, sizeof(rlimits) - len, "%s%d=%llu",
+                i ? "," : "", settings->rlimits[i].resource,
+                (unsigned long long) settings->rlimits[i].value);
+    }
+    key = sqlite3_mprintf("%Q %Q %d %Q %Q %Q %Q %Q %Q %Q",
+            settings->user_name, settings->group_name, settings->init_groups,
+            settings->root_directory, settings->working_directory, settings->umask_str,
+            settings->stdin_path, settings->stdout_path, settings->stderr_path, rlimits);
+    if (!key)
+        return printlog(LOG_ERR, "sqlite3_mprintf(3): out of memory");
+    settings->worker_key = strdup(key);
+    sqlite3_free(key);
+    if (!settings->worker_key)
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    return 0;
+}
+
+void
+job_free_spawn_settings(struct spawn_settings *settings)
+{
+    if (settings) {
+        free(settings->working_directory);
+        free(settings->root_directory);
+        free(settings->user_name);
+        free(settings->group_name);
+        free(settings->stderr_path);
+        free(settings->stdin_path);
+        free(settings->stdout_path);
+        free(settings->umask_str);
+        string_array_free(settings->cgroup_limits);
+        free(settings->worker_key);
+        free(settings);
+    }
+}
+
+int
+job_load_spawn_settings(struct spawn_settings **result, job_id_t jid)
+{
+    struct spawn_settings *settings;
+
+    *result = NULL;
+    settings = calloc(1, sizeof(*settings));
+    if (!settings)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    if (!(settings->cgroup_limits = string_array_new()) ||
+        load_child_context(settings, jid) < 0 ||
+        load_rlimits(settings, jid) < 0 ||
+        load_cgroup_limits(settings, jid) < 0 ||
+        load_log_options(settings, jid) < 0 ||
+        build_worker_key(settings) < 0) {
+        job_free_spawn_settings(settings);
+        return printlog(LOG_ERR, "unable to load the settings of job `%s'", job_id_to_str(jid));
+    }
+    parse_umask(settings);
+    settings->credentials = credentials_get(settings->user_name, settings->group_name, settings->init_groups);
+    if (!settings->credentials) {
+        job_free_spawn_settings(settings);
+        return printlog(LOG_ERR, "unable to load the settings of job `%s'", job_id_to_str(jid));
+    }
+    *result = settings;
     return 0;
 }
 
 static void free_child_context(struct child_context *ctx)
 {
     if (ctx) {
-        free(ctx->working_directory);
-        free(ctx->root_directory);
-        free(ctx->user_name);
-        free(ctx->group_name);
-        free(ctx->stderr_path);
-        free(ctx->stdin_path);
-        free(ctx->stdout_path);
-        free(ctx->umask_str);
+        if (ctx->cgroup_fd >= 0)
+            (void) close(ctx->cgroup_fd);
         free(ctx);
     }
 }
@@ -103,152 +698,389 @@ void autofree_child_context(struct child_context **ctx)
     *ctx = NULL;
 }
 
-static int
-parse_gid(gid_t *result, const char *group_name)
+/* Connect stdout and stderr to jobd, unless the job redirects them elsewhere */
+static void
+get_child_output(struct child_context *ctx, int64_t jid)
 {
-    struct group *grp;
-
-    if (!group_name || group_name[0] == '\0') {
-        *result = getgid();
-        return (0);
+    if (ctx->settings->stdout_path[0] != '\0' && ctx->settings->stderr_path[0] != '\0')
+        return;
+    if (job_output_open(&ctx->output_fd, jid, &ctx->settings->log_options) < 0) {
+        /* Capture is not available on every platform */
+        if (job_output_get_fd() >= 0)
+            printlog(LOG_WARNING, "the output of job `%s' will be discarded", job_id_to_str(jid));
+        ctx->discard_output = true;
     }
+}
+
+/* Like logger_redirect_file_descriptor(), but safe to call in the child */
+static int
+redirect_file(int oldfd, const char *path, int flags)
+{
+    int newfd, saved_errno;
 
-    grp = getgrnam(group_name);
-    if (grp) {
-        *result = grp->gr_gid;
+    if ((newfd = open(path, flags, 0600)) < 0)
+        return (-1);
+    if (newfd == oldfd)
         return (0);
-    } else {
-        printlog(LOG_ERR, "group not found: %s", group_name);
+    if (dup2(newfd, oldfd) < 0) {
+        saved_errno = errno;
+        (void) close(newfd);
+        errno = saved_errno;
         return (-1);
     }
+    return (close(newfd));
+}
+
+static int
+redirect_output(struct child_context *ctx, int fd, const char *path)
+{
+    if (path[0] == '\0' && ctx->discard_output)
+        path = "/dev/null";
+    if (path[0] == '\0')
+        return dup2(ctx->output_fd, fd) < 0 ? -1 : 0;
+    return redirect_file(fd, path, O_CREAT | O_WRONLY | O_APPEND);
 }
 
-/* Run actions in the child after fork(2) but before execve(2) */
+/*
+ * Run actions in the child after fork(2) but before execve(2). jobd has
+ * other threads, so only async-signal-safe calls may be made here: no
+ * logging, no malloc(3), and no NSS. Whatever needs those is worked out
+ * beforehand, and kept in the spawn settings.
+ */
 static int
 _job_child_pre_exec(struct child_context *ctx)
 {
-    gid_t gid;
+    const struct credentials *creds = &ctx->settings->credentials->creds;
     sigset_t mask;
 
-    if (parse_gid(&gid, ctx->group_name) < 0)
-        return printlog(LOG_ERR, "unable to resolve group name `%s'", ctx->group_name);
+    if (ctx->cgroup_fd >= 0) {
+        if (cgroup_job_attach(ctx->cgroup_fd) < 0)
+            return child_error(ctx, EXEC_STAGE_CGROUP, errno);
+        ctx->cgroup_fd = -1;
+    }
+
+    if (creds->error)
+        return child_error(ctx, EXEC_STAGE_CREDENTIALS, creds->error);
 
     (void) setsid();
     sigfillset(&mask);
     (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
-    //TODO: setrlimit
-
     if (getuid() == 0) {
-        if (strcmp(ctx->root_directory, "/") && (chroot(ctx->root_directory) < 0))
-            return printlog(LOG_ERR, "chroot(2) to %s: %s", ctx->root_directory, strerror(errno));
+        if (strcmp(ctx->settings->root_directory, "/") && (chroot(ctx->settings->root_directory) < 0))
+            return child_error(ctx, EXEC_STAGE_ROOT_DIRECTORY, errno);
     }
-    if (chdir(ctx->working_directory) < 0)
-        return printlog(LOG_ERR, "chdir(2) to %s: %s", ctx->working_directory, strerror(errno));
+    if (chdir(ctx->settings->working_directory) < 0)
+        return child_error(ctx, EXEC_STAGE_WORKING_DIRECTORY, errno);
     if (getuid() == 0) {
-        if (ctx->init_groups && (initgroups(ctx->user_name, gid) < 0))
-            return printlog(LOG_ERR, "initgroups(3): %s", strerror(errno));
-        if (setgid(gid) < 0)
-            return printlog(LOG_ERR, "setgid(2): %s", strerror(errno));
+        if (creds->groups && setgroups(creds->ngroups, creds->groups) < 0)
+            return child_error(ctx, EXEC_STAGE_CREDENTIALS, errno);
+        if (setgid(creds->gid) < 0)
+            return child_error(ctx, EXEC_STAGE_CREDENTIALS, errno);
 #ifndef __GLIBC__
         /* KLUDGE: above is actually a test for BSD */
-        if (setlogin(user_name) < 0) {
-            printlog(LOG_ERR, "setlogin(2): %s", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+        if (setlogin(ctx->settings->user_name) < 0)
+            return child_error(ctx, EXEC_STAGE_CREDENTIALS, errno);
 #endif
-        struct passwd *pwd = getpwnam(ctx->user_name);
-        if (!pwd)
-            return printlog(LOG_ERR, "user not found: %s", ctx->user_name);
-        if (setuid(pwd->pw_uid) < 0)
-            return printlog(LOG_ERR, "setuid(2): %s", strerror(errno));
+        if (setuid(creds->uid) < 0)
+            return child_error(ctx, EXEC_STAGE_CREDENTIALS, errno);
     }
 
-    errno = 0;
-    char *endptr;
-    long job_umask_l = strtol(ctx->umask_str, &endptr, 10);
-    if (errno != 0)
-        return printlog(LOG_ERR, "bad umask");
-    if (job_umask_l > INT_MAX || job_umask_l < INT_MIN)
-        return printlog(LOG_ERR, "bad range: umask");
-    if (endptr == ctx->umask_str || *endptr != '\0')
-        return printlog(LOG_ERR, "non-numeric characters: umask");
-    (void) umask((mode_t) job_umask_l);
+    if (ctx->settings->umask_error)
+        return child_error(ctx, EXEC_STAGE_UMASK, ctx->settings->umask_error);
+    (void) umask(ctx->settings->umask);
 
     //TODO this->setup_environment();
     //this->createDescriptors();
 
-    if (logger_redirect_file_descriptor(STDIN_FILENO, ctx->stdin_path, O_RDONLY, 0600) < 0)
-        return printlog(LOG_ERR, "unable to redirect STDIN");
-    if (logger_redirect_file_descriptor(STDOUT_FILENO, ctx->stdout_path, O_CREAT | O_WRONLY, 0600) < 0)
-        return printlog(LOG_ERR, "unable to redirect STDOUT");
-    if (logger_redirect_file_descriptor(STDERR_FILENO, ctx->stderr_path, O_CREAT | O_WRONLY, 0600) < 0)
-        return printlog(LOG_ERR, "unable to redirect STDERR");
+    if (redirect_file(STDIN_FILENO, ctx->settings->stdin_path, O_RDONLY) < 0)
+        return child_error(ctx, EXEC_STAGE_STDIO, errno);
+    if (redirect_output(ctx, STDOUT_FILENO, ctx->settings->stdout_path) < 0)
+        return child_error(ctx, EXEC_STAGE_STDIO, errno);
+    if (redirect_output(ctx, STDERR_FILENO, ctx->settings->stderr_path) < 0)
+        return child_error(ctx, EXEC_STAGE_STDIO, errno);
+
+    /*
+     * The descriptors of jobd are still open until execve(2), so a low
+     * limit on open files would break the redirections above.
+     */
+    for (size_t i = 0; i < ctx->settings->rlimits_len; i++) {
+        struct rlimit rl = { ctx->settings->rlimits[i].value, ctx->settings->rlimits[i].value };
+        if (setrlimit(ctx->settings->rlimits[i].resource, &rl) < 0)
+            return child_error(ctx, EXEC_STAGE_RLIMIT, errno);
+    }
+
+    /*
+     * The shell reads the script from /proc/self/fd, so it must survive execve(2).
+     * This is done last, because it may replace the descriptor of the log file.
+     */
+    if (ctx->script_fd >= 0) {
+        if (ctx->script_fd == SCRIPT_CACHE_FILENO) {
+            if (fcntl(ctx->script_fd, F_SETFD, 0) < 0)
+                return child_error(ctx, EXEC_STAGE_STDIO, errno);
+        } else if (dup2(ctx->script_fd, SCRIPT_CACHE_FILENO) < 0) {
+            return child_error(ctx, EXEC_STAGE_STDIO, errno);
+        }
+    }
+
+    return 0;
+}
 
+/* Create the exec status pipe, with the write end clear of the descriptors laid out in the child */
+static int
+exec_status_pipe(int fds[2])
+{
+    int fd;
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return printlog(LOG_ERR, "pipe2(2): %s", strerror(errno));
+    if (fds[1] < 10) {
+        fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 10);
+        (void) close(fds[1]);
+        if (fd < 0) {
+            (void) close(fds[0]);
+            return printlog(LOG_ERR, "fcntl(2): %s", strerror(errno));
+        }
+        fds[1] = fd;
+    }
     return 0;
 }
 
-static int job_script_exec(pid_t *child, job_id_t jid, char *script);
+/* Tell the parent why the child is giving up, then give up */
+static void __attribute__((noreturn))
+child_abort(struct child_context *ctx, int status_fd)
+{
+    ssize_t len;
+
+    do {
+        len = write(status_fd, &ctx->failure, sizeof(ctx->failure));
+    } while (len < 0 && errno == EINTR);
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Find out whether the child has called execve(2), or has failed trying. The
+ * write end of the status pipe is close-on-exec, so EOF means success. This
+ * blocks until one or the other has happened, unless the pipe is readable.
+ */
+static void
+read_exec_status(struct spawn_result *result, int status_fd, const struct timespec *fork_time)
+{
+    struct timespec now;
+    ssize_t len;
+
+    do {
+        len = read(status_fd, &result->failure, sizeof(result->failure));
+    } while (len < 0 && errno == EINTR);
+    (void) close(status_fd);
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    result->latency = (now.tv_sec - fork_time->tv_sec) * 1000000 +
+                      (now.tv_nsec - fork_time->tv_nsec) / 1000;
+    if (len <= 0) {
+        /* If the pipe cannot be read, the reaper will still see how the child ends */
+        if (len < 0)
+            printlog(LOG_ERR, "read(2): %s", strerror(errno));
+        result->failure.stage = EXEC_STAGE_NONE;
+        return;
+    }
+
+    if (len != sizeof(result->failure) || result->failure.stage <= EXEC_STAGE_NONE ||
+        result->failure.stage > EXEC_STAGE_EXECVE) {
+        result->failure.stage = EXEC_STAGE_EXECVE;
+        result->failure.error = EIO;
+    }
+}
+
+static int job_script_exec(pid_t *child, int *status_fd, struct timespec *fork_time, job_id_t jid,
+        const char *method_name, bool own_cgroup);
+static void track_spawn(enum spawn_kind kind, job_id_t jid, pid_t pid, const char *method_name,
+        int status_fd, const struct timespec *fork_time);
 
 int
 job_method_exec(pid_t *child, job_id_t jid, const char *method_name)
 {
-    char *script;
-    if (job_get_method(&script, jid, method_name) < 0)
+    struct timespec fork_time;
+    int status_fd;
+
+    /* Only the start method belongs to the job; other methods merely manage it */
+    if (job_script_exec(child, &status_fd, &fork_time, jid, method_name, !strcmp(method_name, "start")) < 0)
         return -1;
-    if (!script) {
-        printlog(LOG_DEBUG, "job `%s': method not found: `%s'", job_id_to_str(jid), method_name);
-        return 0;
-    }
-    printlog(LOG_DEBUG, "job `%s': invoking method `%s'", job_id_to_str(jid), method_name);
-    int result = job_script_exec(child, jid, script);
-    free(script);
-    return result;
+    if (*child > 0)
+        track_spawn(SPAWN_METHOD, jid, *child, method_name, status_fd, &fork_time);
+    return 0;
 }
 
 static int
-job_script_exec(pid_t *child, job_id_t jid, char *script)
+job_script_exec(pid_t *child, int *status_fd, struct timespec *fork_time, job_id_t jid,
+        const char *method_name, bool own_cgroup)
 {
     const char **empty_envp = {NULL};
+    int status_pipe[2];
     pid_t pid;
     char *filename = NULL;
     char *argv[5];
     char **envp;
+    char CLEANUP_STR *script = NULL;
+    char script_path[32];
 
     *child = 0;
+    *status_fd = -1;
 
     struct child_context CLEANUP_CHILD_CTX *ctx = NULL;
-    if (NULL == (ctx = malloc(sizeof(*ctx))))
-        return printlog(LOG_ERR, "malloc(3): %s", strerror(errno));
-    if (get_child_context(ctx, jid) < 0)
+    if (NULL == (ctx = calloc(1, sizeof(*ctx))))
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    ctx->cgroup_fd = -1;
+    ctx->script_fd = -1;
+    ctx->output_fd = -1;
+    if (!(ctx->settings = script_cache_get_settings(jid)))
         return printlog(LOG_ERR, "error getting child context");
+    if (!ctx->settings->credentials->resolved)
+        credentials_resolve_now(ctx->settings->credentials);
 
+    /*
+     * Prefer the cached copy of the script. A chrooted job might not have /proc,
+     * so it gets the script on the command line instead.
+     */
     filename = "/bin/sh";
     argv[0] = "/bin/sh";
-    argv[1] = "-c";
-    argv[2] = script;
-    argv[3] = NULL;
+    if (!strcmp(ctx->settings->root_directory, "/") &&
+        script_cache_lookup(&ctx->script_fd, jid, method_name) == 0) {
+        if (ctx->script_fd < 0)
+            goto not_found;
+        snprintf(script_path, sizeof(script_path), "/proc/self/fd/%d", SCRIPT_CACHE_FILENO);
+        argv[1] = script_path;
+        argv[2] = NULL;
+    } else {
+        if (job_get_method(&script, jid, method_name) < 0)
+            return -1;
+        if (!script)
+            goto not_found;
+        argv[1] = "-c";
+        argv[2] = script;
+        argv[3] = NULL;
+    }
+    printlog(LOG_DEBUG, "job `%s': invoking method `%s'", job_id_to_str(jid), method_name);
+
+    get_child_output(ctx, jid);
+
+    if (own_cgroup) {
+        if (cgroup_enabled()) {
+            ctx->cgroup_fd = cgroup_job_prepare(jid, job_id_to_str(jid));
+            if (ctx->cgroup_fd < 0)
+                printlog(LOG_WARNING, "job `%s' will not be placed in a cgroup", job_id_to_str(jid));
+        }
+        if (apply_cgroup_limits(jid, ctx->settings) < 0)
+            return printlog(LOG_ERR, "unable to apply the cgroup limits of job `%s'", job_id_to_str(jid));
+    }
+
     envp = (char **) empty_envp; //XXX-FIXME string_array_data(job->environment_variables);
 
+    if (exec_status_pipe(status_pipe) < 0)
+        return -1;
+    (void) clock_gettime(CLOCK_MONOTONIC, fork_time);
     pid = fork();
-    if (pid < 0)
+    if (pid < 0) {
+        (void) close(status_pipe[0]);
+        (void) close(status_pipe[1]);
         return printlog(LOG_ERR, "fork(2): %s", strerror(errno));
+    }
 
     if (pid == 0) {
-        if (_job_child_pre_exec(ctx) < 0) {
-            printlog(LOG_ERR, "error setting child context");
-            exit(EXIT_FAILURE);
-        }
-        if (execve(filename, argv, envp) < 0) {
-            printlog(LOG_ERR, "execve(2): %s", strerror(errno));
-            exit(EXIT_FAILURE);
+        (void) close(status_pipe[0]);
+        if (_job_child_pre_exec(ctx) < 0)
+            child_abort(ctx, status_pipe[1]);
+        (void) execve(filename, argv, envp);
+        (void) child_error(ctx, EXEC_STAGE_EXECVE, errno);
+        child_abort(ctx, status_pipe[1]);
+    }
+
+    (void) close(status_pipe[1]);
+    if (ctx->cgroup_fd >= 0) {
+        (void) close(ctx->cgroup_fd);
+        ctx->cgroup_fd = -1;
+    }
+    *status_fd = status_pipe[0];
+    *child = pid;
+
+    return 0;
+
+not_found:
+    printlog(LOG_DEBUG, "job `%s': method not found: `%s'", job_id_to_str(jid), method_name);
+    return 0;
+}
+
+int
+job_get_worker_key(const char **key, job_id_t jid)
+{
+    const struct spawn_settings *settings;
+
+    *key = NULL;
+    if (!(settings = script_cache_get_settings(jid)))
+        return printlog(LOG_ERR, "unable to load the settings of job `%s'", job_id_to_str(jid));
+    *key = settings->worker_key;
+    return 0;
+}
+
+int
+job_spawn_shared_worker(pid_t *child, job_id_t jid, int command_fd, int status_fd)
+{
+    char *argv[] = { "/bin/sh", "-s", NULL };
+    char *envp[] = { NULL };
+    struct timespec fork_time;
+    int status_pipe[2];
+    pid_t pid;
+
+    *child = 0;
+
+    struct child_context CLEANUP_CHILD_CTX *ctx = NULL;
+    if (NULL == (ctx = calloc(1, sizeof(*ctx))))
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    ctx->cgroup_fd = -1;
+    ctx->script_fd = -1;
+    ctx->output_fd = -1;
+    if (!(ctx->settings = script_cache_get_settings(jid)))
+        return printlog(LOG_ERR, "error getting child context");
+    if (!ctx->settings->credentials->resolved)
+        credentials_resolve_now(ctx->settings->credentials);
+    /* Only tasks that redirect their output share a worker, so nothing should be captured */
+    ctx->discard_output = true;
+
+    if (exec_status_pipe(status_pipe) < 0)
+        return -1;
+    (void) clock_gettime(CLOCK_MONOTONIC, &fork_time);
+    pid = fork();
+    if (pid < 0) {
+        (void) close(status_pipe[0]);
+        (void) close(status_pipe[1]);
+        return printlog(LOG_ERR, "fork(2): %s", strerror(errno));
+    }
+
+    if (pid == 0) {
+        (void) close(status_pipe[0]);
+        if (_job_child_pre_exec(ctx) < 0)
+            child_abort(ctx, status_pipe[1]);
+        /* Move both descriptors out of the way before laying out fds 0, 3 and 4 */
+        if ((command_fd = fcntl(command_fd, F_DUPFD, 10)) < 0 ||
+            (status_fd = fcntl(status_fd, F_DUPFD, 10)) < 0 ||
+            dup2(STDIN_FILENO, RUNNER_STDIN_FILENO) < 0 ||
+            dup2(status_fd, RUNNER_STATUS_FILENO) < 0 ||
+            dup2(command_fd, STDIN_FILENO) < 0) {
+            (void) child_error(ctx, EXEC_STAGE_STDIO, errno);
+            child_abort(ctx, status_pipe[1]);
         }
-        /* NOTREACHED */
-    } else {
-        printlog(LOG_DEBUG, "job `%s': child pid %d is running", job_id_to_str(jid), pid);
-        *child = pid;
+        (void) close(command_fd);
+        (void) close(status_fd);
+        (void) execve(argv[0], argv, envp);
+        (void) child_error(ctx, EXEC_STAGE_EXECVE, errno);
+        child_abort(ctx, status_pipe[1]);
     }
 
+    (void) close(status_pipe[1]);
+    /* If the worker fails before execve(2), runner_reap() sees it exit */
+    track_spawn(SPAWN_WORKER, jid, pid, NULL, status_pipe[0], &fork_time);
+
+    *child = pid;
     return 0;
 }
 
@@ -273,21 +1105,311 @@ const char *job_state_to_str(enum job_state state)
             return ("complete");
         case JOB_STATE_ERROR:
             return ("error");
+        case JOB_STATE_EXEC_FAILED:
+            return ("exec_failed");
         default:
             return ("invalid_state");
     }
 }
 
+static int
+job_set_exec_failure(job_id_t id, const struct exec_failure *failure)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    char error[128];
+    const char *sql = "INSERT OR REPLACE INTO processes "
+                      " (pid, job_id, start_time, end_time, exec_error) "
+                      "VALUES "
+                      " (NULL, ?, ?, ?, ?)";
+    time_t now = time(NULL);
+
+    snprintf(error, sizeof(error), "%s: %s", exec_stage_names[failure->stage], strerror(failure->error));
+    if (db_query(&stmt, sql, "iiis", id, (int64_t) now, (int64_t) now, error) < 0)
+        return db_error;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        return db_error;
+    job_table_run_started(id, now, now);
+
+    return 0;
+}
+
+static int
+job_set_spawn_latency(job_id_t id, int64_t latency)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql = "UPDATE processes SET spawn_latency = ? WHERE job_id = ?";
+
+    if (db_query(&stmt, sql, "ii", latency, id) < 0)
+        return db_error;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        return db_error;
+
+    return 0;
+}
+
+static void
+start_succeeded(job_id_t id, int64_t latency)
+{
+    struct job_table_entry *jte;
+
+    if (job_set_spawn_latency(id, latency) < 0)
+        printlog(LOG_ERR, "unable to record the spawn latency");
+
+    /* The job may have been stopped while it was starting */
+    jte = job_table_lookup_by_id(id);
+    if (jte && jte->state == JOB_STATE_STARTING && job_set_state(id, JOB_STATE_RUNNING) < 0)
+        printlog(LOG_ERR, "unable to set job state");
+}
+
+/* Keep the scheduler from picking the same job over and over */
+static void
+start_failed(job_id_t id, const struct exec_failure *failure)
+{
+    job_output_close(id);
+    if (job_set_exec_failure(id, failure) < 0)
+        printlog(LOG_ERR, "unable to record the exec failure");
+    if (job_table_set_pid(id, job_id_to_str(id), 0) < 0)
+        printlog(LOG_ERR, "unable to remove the pid from the job table");
+    if (job_run_end(id, W_EXITCODE(EXIT_FAILURE, 0), NULL) < 0)
+        printlog(LOG_ERR, "unable to record the end of the run of %s", job_id_to_str(id));
+    (void) job_set_state(id, JOB_STATE_EXEC_FAILED);
+    if (spawn_callbacks.on_start_aborted)
+        spawn_callbacks.on_start_aborted(id);
+}
+
+static void
+finish_spawn(const struct pending_spawn *ps, const struct spawn_result *result)
+{
+    const struct exec_failure *failure = &result->failure;
+
+    if (failure->stage == EXEC_STAGE_NONE && ps->kind == SPAWN_WORKER) {
+        printlog(LOG_DEBUG, "shared runner pid %d is running (%lld us from fork to exec)",
+                ps->pid, (long long) result->latency);
+        return;
+    }
+    if (failure->stage == EXEC_STAGE_NONE) {
+        printlog(LOG_DEBUG, "job `%s': child pid %d is running (%lld us from fork to exec)",
+                job_id_to_str(ps->jid), ps->pid, (long long) result->latency);
+        if (ps->kind == SPAWN_START)
+            start_succeeded(ps->jid, result->latency);
+        return;
+    }
+
+    if (ps->kind == SPAWN_WORKER) {
+        printlog(LOG_ERR, "shared runner for job `%s' failed before execve(2): %s: %s",
+                job_id_to_str(ps->jid), exec_stage_names[failure->stage], strerror(failure->error));
+    } else {
+        printlog(LOG_ERR, "job `%s': method `%s' failed before execve(2): %s: %s",
+                job_id_to_str(ps->jid), ps->method_name, exec_stage_names[failure->stage],
+                strerror(failure->error));
+    }
+    if (ps->kind == SPAWN_START)
+        start_failed(ps->jid, failure);
+}
+
+static void
+free_pending_spawn(struct pending_spawn *ps)
+{
+    if (ps) {
+        if (ps->watch)
+            spawn_callbacks.unwatch(ps->watch);
+        if (ps->status_fd >= 0)
+            (void) close(ps->status_fd);
+        free(ps->method_name);
+        free(ps);
+    }
+}
+
+/*
+ * Learn the outcome of a spawn from the event loop, so that jobd never waits
+ * for a child to reach execve(2). Without an event loop, wait for it here.
+ */
+static void
+track_spawn(enum spawn_kind kind, job_id_t jid, pid_t pid, const char *method_name,
+        int status_fd, const struct timespec *fork_time)
+{
+    struct pending_spawn *ps;
+    struct spawn_result result;
+    int status;
+
+    ps = calloc(1, sizeof(*ps));
+    if (ps) {
+        ps->kind = kind;
+        ps->jid = jid;
+        ps->pid = pid;
+        ps->status_fd = status_fd;
+        ps->fork_time = *fork_time;
+        ps->method_name = strdup(method_name ? method_name : "start");
+        if (ps->method_name && spawn_callbacks.watch && (ps->watch = spawn_callbacks.watch(status_fd))) {
+            LIST_INSERT_HEAD(&pending_spawns, ps, entries);
+            return;
+        }
+    }
+    if (!ps || !ps->method_name) {
+        printlog(LOG_ERR, "unable to track pid %d: %s", pid, strerror(errno));
+        (void) close(status_fd);
+        free(ps);
+        return;
+    }
+
+    read_exec_status(&result, status_fd, fork_time);
+    ps->status_fd = -1;
+    finish_spawn(ps, &result);
+    /* A worker that failed is left for runner_reap() */
+    if (result.failure.stage != EXEC_STAGE_NONE && kind != SPAWN_WORKER) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+    }
+    free_pending_spawn(ps);
+}
+
+void
+job_set_spawn_callbacks(const struct job_spawn_callbacks *callbacks)
+{
+    spawn_callbacks = *callbacks;
+}
+
+int
+job_spawn_complete(int fd)
+{
+    struct pending_spawn *ps;
+    struct spawn_result result;
+
+    LIST_FOREACH(ps, &pending_spawns, entries) {
+        if (ps->status_fd == fd)
+            break;
+    }
+    if (!ps)
+        return 0;
+
+    spawn_callbacks.unwatch(ps->watch);
+    ps->watch = NULL;
+    read_exec_status(&result, ps->status_fd, &ps->fork_time);
+    ps->status_fd = -1;
+    finish_spawn(ps, &result);
+
+    /* A child that gave up is forgotten once job_spawn_reap() sees it exit */
+    if (result.failure.stage != EXEC_STAGE_NONE) {
+        ps->failed = true;
+    } else {
+        LIST_REMOVE(ps, entries);
+        free_pending_spawn(ps);
+    }
+    return 0;
+}
+
+int
+job_spawn_reap(pid_t pid)
+{
+    struct pending_spawn *ps;
+    struct spawn_result result;
+    bool failed;
+
+    LIST_FOREACH(ps, &pending_spawns, entries) {
+        if (ps->pid == pid)
+            break;
+    }
+    if (!ps)
+        return 1;
+
+    /* The child has exited, so the pipe is at EOF or holds the failure */
+    if (ps->status_fd >= 0) {
+        spawn_callbacks.unwatch(ps->watch);
+        ps->watch = NULL;
+        read_exec_status(&result, ps->status_fd, &ps->fork_time);
+        ps->status_fd = -1;
+        finish_spawn(ps, &result);
+        ps->failed = (result.failure.stage != EXEC_STAGE_NONE);
+    }
+    failed = ps->failed && ps->kind != SPAWN_WORKER;
+    LIST_REMOVE(ps, entries);
+    free_pending_spawn(ps);
+    return failed ? 0 : 1;
+}
+
+static struct deferred_start *
+deferred_start_lookup(job_id_t id)
+{
+    struct deferred_start *ds;
+
+    LIST_FOREACH(ds, &deferred_starts, entries) {
+        if (ds->jid == id)
+            return (ds);
+    }
+    return (NULL);
+}
+
+/* The job is starting, without a process, until credentials_lookup_done() resumes it */
+static int
+defer_start(job_id_t id, enum job_start_reason reason, struct credentials_entry *entry)
+{
+    struct deferred_start *ds;
+
+    if (deferred_start_lookup(id))
+        return 0;
+    ds = calloc(1, sizeof(*ds));
+    if (!ds)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    ds->jid = id;
+    ds->reason = reason;
+    ds->entry = entry;
+    LIST_INSERT_HEAD(&deferred_starts, ds, entries);
+    printlog(LOG_DEBUG, "job %s will start once user `%s' and group `%s' have been looked up",
+            job_id_to_str(id), entry->user_name, entry->group_name);
+    return job_set_state(id, JOB_STATE_STARTING);
+}
+
+bool
+job_start_is_deferred(job_id_t id)
+{
+    return (deferred_start_lookup(id) != NULL);
+}
+
 int
-job_start(pid_t *pid, job_id_t id)
+job_start(pid_t *pid, job_id_t id, enum job_start_reason reason)
 {
-    if (job_method_exec(pid, id, "start") < 0)
+    const struct spawn_settings *settings;
+    struct timespec fork_time;
+    int status_fd;
+
+    *pid = 0;
+    if ((settings = script_cache_get_settings(id))) {
+        credentials_refresh(settings->credentials);
+        if (!settings->credentials->resolved) {
+            if (settings->credentials->lookup_pending)
+                return defer_start(id, reason, settings->credentials);
+            credentials_resolve_now(settings->credentials);
+        }
+    }
+
+    /* Tasks with runner = "shared" do not get a process of their own */
+    switch (runner_submit(pid, id)) {
+        case 0:
+            if (job_run_begin(id, reason) < 0)
+                printlog(LOG_ERR, "unable to record the start of job %s", job_id_to_str(id));
+            return 0;
+        case 1:
+            break;
+        default:
+            (void) job_set_state(id, JOB_STATE_ERROR);
+            return printlog(LOG_ERR, "unable to submit job %s to the shared runner", job_id_to_str(id));
+    }
+
+    if (job_script_exec(pid, &status_fd, &fork_time, id, "start", true) < 0) {
+        job_output_close(id);
+        (void) job_set_state(id, JOB_STATE_ERROR);
         return printlog(LOG_ERR, "start method failed");
+    }
 
+    /* The job is starting until the child has reached execve(2); see finish_spawn() */
     if (*pid > 0) {
         printlog(LOG_DEBUG, "job %s started with pid %d", job_id_to_str(id), *pid);
-        if (job_register_pid(id, *pid) < 0)
-            return printlog(LOG_ERR, "unable to register pid");
+        if (job_register_pid(id, *pid) < 0 ||
+            job_table_set_pid(id, job_id_to_str(id), *pid) < 0 ||
+            job_run_begin(id, reason) < 0 ||
+            job_set_state(id, JOB_STATE_STARTING) < 0)
+            printlog(LOG_ERR, "unable to record the start of job %s", job_id_to_str(id));
+        track_spawn(SPAWN_START, id, *pid, "start", status_fd, &fork_time);
     }
 
     return 0;
@@ -298,6 +1420,7 @@ job_stop(job_id_t id)
 {
     pid_t pid, job_pid;
     enum job_state state;
+    bool populated;
 
     if (job_get_state(&state, id) < 0)
         return printlog(LOG_ERR, "state lookup failed");
@@ -322,16 +1445,26 @@ job_stop(job_id_t id)
         return (-1);
     }
 
-    char *script;
-    if (job_get_method(&script, id, "stop") < 0)
-        return printlog(LOG_ERR, "job_get_method() failed");
-    if (script) {
-        if (job_script_exec(&pid, id, script) < 0)
-            return printlog(LOG_ERR, "stop method failed");
-    } else {
-        pid = 0;
+    /* A start that is still waiting for credentials_lookup_done() has nothing to kill */
+    struct deferred_start *ds = deferred_start_lookup(id);
+    if (ds) {
+        printlog(LOG_DEBUG, "job %s is stopped before it was started", job_id_to_str(id));
+        LIST_REMOVE(ds, entries);
+        free(ds);
+        if (job_set_state(id, JOB_STATE_STOPPED) < 0)
+            return (-1);
+        if (spawn_callbacks.on_start_aborted)
+            spawn_callbacks.on_start_aborted(id);
+        return (0);
     }
 
+    int rv = runner_stop(id);
+    if (rv <= 0)
+        return rv;
+
+    if (job_method_exec(&pid, id, "stop") < 0)
+        return printlog(LOG_ERR, "stop method failed");
+
     if (pid > 0 && (job_pid == 0)) {
         job_pid = pid;
     } else if (!pid && (job_pid > 0)) {
@@ -349,6 +1482,13 @@ job_stop(job_id_t id)
         }
         if (job_set_state(id, JOB_STATE_STOPPING) < 0)
             return (-1);
+    } else if (!pid && cgroup_job_is_populated(&populated, id) == 0 && populated) {
+        /* The main process is gone, but it left some descendants behind */
+        printlog(LOG_DEBUG, "killing the remaining processes of job %s", job_id_to_str(id));
+        if (cgroup_job_kill(id) < 0)
+            return (-1);
+        if (job_set_state(id, JOB_STATE_STOPPING) < 0)
+            return (-1);
     } else {
         /* FIXME: open design question: what about jobs with a PID *and* a stop method? */
     }
@@ -375,6 +1515,12 @@ job_new(void)
         goto err_out;
     if (!(j->methods = string_array_new()))
         goto err_out;
+    if (!(j->rlimits = string_array_new()))
+        goto err_out;
+    if (!(j->cgroup_limits = string_array_new()))
+        goto err_out;
+    if (!(j->log_options = string_array_new()))
+        goto err_out;
 
     return (j);
 
@@ -393,6 +1539,9 @@ job_free(struct job *job)
         string_array_free(job->environment_variables);
         free(job->id);
         string_array_free(job->methods);
+        string_array_free(job->rlimits);
+        string_array_free(job->cgroup_limits);
+        string_array_free(job->log_options);
         free(job->title);
         free(job->root_directory);
         free(job->standard_error_path);
@@ -460,10 +1609,11 @@ int job_set_property(int64_t jid, const char *key, const char *value)
 
     switch (sqlite3_step(stmt)) {
         case SQLITE_DONE:
-            if (sqlite3_changes(dbh) == 1)
-                return 0;
-            else
+            if (sqlite3_changes(dbh) != 1)
                 return printlog(LOG_ERR, "update had no effect");
+            /* Method scripts embed the current value of every property */
+            script_cache_invalidate(jid);
+            return 0;
         default:
             return db_error;
     }
@@ -506,6 +1656,22 @@ job_get_method(char **dest, job_id_t jid, const char *method_name)
     }
 }
 
+/* Write the current values of the properties of a job through to the job table */
+static void
+update_cached_properties(job_id_t id)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql = "SELECT json_group_object(name, current_value) FROM properties WHERE job_id = ?";
+
+    if (!job_table_lookup_by_id(id))
+        return;
+    if (db_query(&stmt, sql, "i", id) < 0 || sqlite3_step(stmt) != SQLITE_ROW) {
+        printlog(LOG_ERR, "unable to read the properties of job %s", job_id_to_str(id));
+        return;
+    }
+    job_table_set_properties(id, (const char *) sqlite3_column_text(stmt, 0));
+}
+
 int
 job_enable(job_id_t id)
 {
@@ -530,12 +1696,14 @@ job_enable(job_id_t id)
         return db_error;
     if (sqlite3_changes(dbh) == 0)
         return printlog(LOG_ERR, "job %s does not exist", job_id_to_str(id));
+    script_cache_invalidate(id);
+    update_cached_properties(id);
 
     if (job_set_state(id, JOB_STATE_PENDING) < 0)
         return -1;
 
     printlog(LOG_DEBUG, "job %s has been enabled", job_id_to_str(id));
-    job_start(&pid, id);
+    job_start(&pid, id, JOB_START_ENABLED);
     return 0;
 }
 
@@ -562,6 +1730,8 @@ job_disable(job_id_t id)
         return db_error;
     if (sqlite3_changes(dbh) == 0)
         return printlog(LOG_ERR, "job %s does not exist", job_id_to_str(id));
+    script_cache_invalidate(id);
+    update_cached_properties(id);
 
     printlog(LOG_DEBUG, "job %s has been disabled", job_id_to_str(id));
     if (state == JOB_STATE_STARTING ||
@@ -581,17 +1751,20 @@ job_register_pid(int64_t row_id, pid_t pid)
                       " (pid, job_id, start_time) "
                       "VALUES "
                       " (?, ?, ?)";
+    time_t now = time(NULL);
 
     if (sqlite3_prepare_v2(dbh, sql, -1, &stmt, 0) != SQLITE_OK)
         return db_error;
-    if (sqlite3_bind_int64(stmt, 1, pid) != SQLITE_OK)
+    /* A task in the shared runner has no pid of its own */
+    if ((pid > 0 ? sqlite3_bind_int64(stmt, 1, pid) : sqlite3_bind_null(stmt, 1)) != SQLITE_OK)
         return db_error;
     if (sqlite3_bind_int64(stmt, 2, row_id) != SQLITE_OK)
         return db_error;
-    if (sqlite3_bind_int64(stmt, 3, time(NULL)) != SQLITE_OK)
+    if (sqlite3_bind_int64(stmt, 3, now) != SQLITE_OK)
         return db_error;
     if (sqlite3_step(stmt) != SQLITE_DONE)
         return db_error;
+    job_table_run_started(row_id, now, 0);
 
     return 0;
 }
@@ -600,7 +1773,7 @@ int
 job_get_pid(pid_t *pid, int64_t row_id)
 {
     int64_t result;
-    const char *sql = "SELECT processes.pid FROM processes WHERE job_id = ?";
+    const char *sql = "SELECT processes.pid FROM processes WHERE job_id = ? AND end_time = 0";
 
     if (db_get_id(&result, sql, "i", row_id) < 0) {
         printlog(LOG_ERR, "database error");
@@ -645,12 +1818,12 @@ job_get_label_by_pid(char label[JOB_ID_MAX], pid_t pid)
 }
 
 int
-job_set_exit_status(pid_t pid, int status)
+job_set_exit_status(job_id_t id, int status)
 {
     sqlite3_stmt CLEANUP_STMT *stmt = NULL;
     const char *sql = "UPDATE processes "
                       "SET exited = 1, exit_status = ?, end_time = ?"
-                      "WHERE pid = ?";
+                      "WHERE job_id = ?";
 
     if (sqlite3_prepare_v2(dbh, sql, -1, &stmt, 0) != SQLITE_OK)
         return db_error;
@@ -658,21 +1831,22 @@ job_set_exit_status(pid_t pid, int status)
         return db_error;
     if (sqlite3_bind_int64(stmt, 2, time(NULL)) != SQLITE_OK)
         return db_error;
-    if (sqlite3_bind_int64(stmt, 3, pid) != SQLITE_OK)
+    if (sqlite3_bind_int64(stmt, 3, id) != SQLITE_OK)
         return db_error;
     if (sqlite3_step(stmt) != SQLITE_DONE)
         return db_error;
+    job_table_run_ended(id, TERMINFO_EXIT, status);
 
     return 0;
 }
 
 int
-job_set_signal_status(pid_t pid, int signum)
+job_set_signal_status(job_id_t id, int signum)
 {
     sqlite3_stmt CLEANUP_STMT *stmt = NULL;
     const char *sql = "UPDATE processes "
                       "SET signaled = 1, signal_number = ?, end_time = ?"
-                      "WHERE pid = ?";
+                      "WHERE job_id = ?";
 
     if (sqlite3_prepare_v2(dbh, sql, -1, &stmt, 0) != SQLITE_OK)
         return db_error;
@@ -680,14 +1854,141 @@ job_set_signal_status(pid_t pid, int signum)
         return db_error;
     if (sqlite3_bind_int64(stmt, 2, time(NULL)) != SQLITE_OK)
         return db_error;
-    if (sqlite3_bind_int64(stmt, 3, pid) != SQLITE_OK)
+    if (sqlite3_bind_int64(stmt, 3, id) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        return db_error;
+    job_table_run_ended(id, TERMINFO_SIGNAL, signum);
+
+    return 0;
+}
+
+int
+job_set_oom_kills(job_id_t id, uint64_t count)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql = "UPDATE processes SET oom_kills = ? WHERE job_id = ?";
+
+    if (sqlite3_prepare_v2(dbh, sql, -1, &stmt, 0) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_bind_int64(stmt, 1, (int64_t) count) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_bind_int64(stmt, 2, id) != SQLITE_OK)
         return db_error;
     if (sqlite3_step(stmt) != SQLITE_DONE)
         return db_error;
+    job_table_set_oom_kills(id, count);
 
     return 0;
 }
 
+static int64_t
+monotonic_msec(void)
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+int
+job_run_begin(job_id_t id, enum job_start_reason reason)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql = "INSERT INTO job_runs "
+                      " (job_id, start_reason_id, start_time, start_monotonic) "
+                      "VALUES "
+                      " (?, ?, ?, ?)";
+
+    if (db_query(&stmt, sql, "iiii", id, (int64_t) reason, (int64_t) time(NULL), monotonic_msec()) < 0)
+        return -1;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        return db_error;
+
+    return 0;
+}
+
+static int64_t
+timeval_usec(const struct timeval *tv)
+{
+    return ((int64_t) tv->tv_sec * 1000000 + tv->tv_usec);
+}
+
+static int
+bind_usage(sqlite3_stmt *stmt, int64_t id, const struct rusage *usage)
+{
+    uint64_t user_usec, system_usec;
+    int64_t values[7];
+    int i;
+
+    if (!usage) {
+        /* Shared tasks run inside a worker, so their usage is unknown */
+        for (i = 0; i < 7; i++) {
+            if (sqlite3_bind_null(stmt, 6 + i) != SQLITE_OK)
+                return db_error;
+        }
+        return 0;
+    }
+
+    /* The cgroup also accounts for descendants that were not waited for */
+    if (cgroup_job_get_cpu_usage(&user_usec, &system_usec, id) == 0) {
+        values[0] = (int64_t) user_usec;
+        values[1] = (int64_t) system_usec;
+    } else {
+        values[0] = timeval_usec(&usage->ru_utime);
+        values[1] = timeval_usec(&usage->ru_stime);
+    }
+    values[2] = usage->ru_maxrss;
+    values[3] = usage->ru_inblock;
+    values[4] = usage->ru_oublock;
+    values[5] = usage->ru_nvcsw;
+    values[6] = usage->ru_nivcsw;
+    for (i = 0; i < 7; i++) {
+        if (sqlite3_bind_int64(stmt, 6 + i, values[i]) != SQLITE_OK)
+            return db_error;
+    }
+    return 0;
+}
+
+/* Finish the most recent run of the job, given a status and usage from wait4(2) */
+int
+job_run_end(job_id_t id, int status, const struct rusage *usage)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql = "UPDATE job_runs "
+                      "SET end_time = ?1, end_monotonic = ?2, duration = ?2 - start_monotonic, "
+                      "    exit_status = ?3, signal_number = ?4, "
+                      "    user_time = ?6, system_time = ?7, max_rss = ?8, in_blocks = ?9, "
+                      "    out_blocks = ?10, voluntary_switches = ?11, involuntary_switches = ?12 "
+                      "WHERE id = (SELECT max(id) FROM job_runs WHERE job_id = ?5 AND end_time IS NULL)";
+    int64_t now = monotonic_msec();
+
+    if (sqlite3_prepare_v2(dbh, sql, -1, &stmt, 0) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_bind_int64(stmt, 1, time(NULL)) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, now) != SQLITE_OK ||
+        (WIFEXITED(status) ? sqlite3_bind_int64(stmt, 3, WEXITSTATUS(status)) :
+                             sqlite3_bind_null(stmt, 3)) != SQLITE_OK ||
+        (WIFSIGNALED(status) ? sqlite3_bind_int64(stmt, 4, WTERMSIG(status)) :
+                               sqlite3_bind_null(stmt, 4)) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 5, id) != SQLITE_OK)
+        return db_error;
+    if (bind_usage(stmt, id, usage) < 0)
+        return -1;
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        return db_error;
+
+    return 0;
+}
+
+static void (*state_observer)(job_id_t, enum job_state);
+
+void
+job_set_state_observer(void (*observer)(job_id_t id, enum job_state state))
+{
+    state_observer = observer;
+}
+
 int job_set_state(int64_t job_id, enum job_state state)
 {
     sqlite3_stmt CLEANUP_STMT *stmt = NULL;
@@ -705,10 +2006,54 @@ int job_set_state(int64_t job_id, enum job_state state)
         return db_error;
     if (sqlite3_changes(dbh) == 0)
         return printlog(LOG_ERR, "job %s does not exist", job_id_to_str(job_id));
+    job_table_set_state(job_id, state);
 
+    if (state_observer)
+        state_observer(job_id, state);
     return 0;
 }
 
+int
+job_parse_states(uint32_t *result, const char *states)
+{
+    char CLEANUP_STR *copy = NULL;
+    char *name, *next;
+    int state;
+
+    *result = 0;
+    if (!states || states[0] == '\0')
+        return 0;
+    if (!(copy = strdup(states)))
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    for (next = copy; (name = strsep(&next, ",")) != NULL;) {
+        for (state = JOB_STATE_UNKNOWN; state <= JOB_STATE_EXEC_FAILED; state++) {
+            if (!strcmp(name, job_state_to_str(state)))
+                break;
+        }
+        if (state > JOB_STATE_EXEC_FAILED)
+            return printlog(LOG_ERR, "unknown job state: %s", name);
+        *result |= 1U << state;
+    }
+    return 0;
+}
+
+bool
+job_label_matches(const char *label, const char *patterns)
+{
+    char CLEANUP_STR *copy = NULL;
+    char *pattern, *next;
+
+    if (!patterns || patterns[0] == '\0')
+        return true;
+    if (!(copy = strdup(patterns)))
+        return false;
+    for (next = copy; (pattern = strsep(&next, ",")) != NULL;) {
+        if (pattern[0] != '\0' && fnmatch(pattern, label, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
 int job_get_state(enum job_state *state, job_id_t id)
 {
     int64_t result;
@@ -731,6 +2076,16 @@ int job_get_state(enum job_state *state, job_id_t id)
     return (0);
 }
 
+int job_get_cached_state(enum job_state *state, job_id_t id)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(id);
+
+    if (!jte)
+        return job_get_state(state, id);
+    *state = jte->state;
+    return (0);
+}
+
 int job_get_type(enum job_type *type, job_id_t id)
 {
     int64_t result;
@@ -757,8 +2112,15 @@ job_id_to_str(job_id_t jid)
     const char sql[] = "SELECT job_id FROM jobs WHERE id = ?";
     static char label[JOB_ID_MAX + 1];
     sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    struct job_table_entry *jte;
     int rv;
 
+    /* Copied, so that the result outlives the entry like it always has */
+    if ((jte = job_table_lookup_by_id(jid)) != NULL) {
+        snprintf(label, sizeof(label), "%s", jte->jte_label);
+        return ((const char *) &label);
+    }
+
     if (db_query(&stmt, sql, "i", jid) < 0) {
         printlog(LOG_ERR, "db_query() failed");
         strcpy(label, "__error__");
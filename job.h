@@ -18,6 +18,8 @@
 #define _JOB_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -49,7 +51,15 @@ enum job_state {
 	JOB_STATE_STOPPING,
 	JOB_STATE_STOPPED,
 	JOB_STATE_COMPLETE,
-	JOB_STATE_ERROR
+	JOB_STATE_ERROR,
+	JOB_STATE_EXEC_FAILED
+};
+
+/* Keep this in sync with the start_reasons table */
+enum job_start_reason {
+	JOB_START_SCHEDULED = 1,
+	JOB_START_REQUESTED,
+	JOB_START_ENABLED
 };
 
 enum job_type {
@@ -75,6 +85,9 @@ struct job {
 	bool keep_alive;
 	struct string_array *methods;
     struct string_array *properties;
+	struct string_array *rlimits;		/* name, value pairs */
+	struct string_array *cgroup_limits;	/* name, value pairs */
+	struct string_array *log_options;	/* name, value pairs */
 	char *title;
 	char *root_directory;
 	char *standard_error_path;
@@ -87,9 +100,16 @@ struct job {
 	char *working_directory;
 	char **options;
 	enum job_type job_type;
+	bool shared_runner;
 };
 
-int job_start(pid_t *pid, job_id_t id);
+/*
+ * The credentials of a job are looked up in the worker pool. If they are not
+ * known yet, the job is left in the starting state without a pid, and
+ * job_start_is_deferred() is true until the lookup is done.
+ */
+int job_start(pid_t *pid, job_id_t id, enum job_start_reason reason);
+bool job_start_is_deferred(job_id_t id);
 int job_stop(job_id_t id);
 int job_enable(job_id_t id);
 int job_disable(job_id_t id);
@@ -106,14 +126,59 @@ int job_get_pid(pid_t *pid, int64_t row_id);
 int job_get_property(char **value, const char *key, int64_t jid);
 int job_get_method(char **dest, job_id_t jid, const char *method_name);
 int job_get_state(enum job_state *state, job_id_t id);
+/* Reads the job table instead of the database, if jobd has an entry for the job */
+int job_get_cached_state(enum job_state *state, job_id_t id);
 int job_set_property(int64_t jid, const char *key, const char *value);
 int job_set_state(int64_t job_id, enum job_state state);
+/* The observer is called after every successful job_set_state() */
+void job_set_state_observer(void (*observer)(job_id_t id, enum job_state state));
+/* Match against a comma-separated list of glob(7) patterns; an empty list matches everything */
+bool job_label_matches(const char *label, const char *patterns);
+/* Turn a comma-separated list of state names into a mask of (1 << state) bits */
+int job_parse_states(uint32_t *result, const char *states);
 int job_get_type(enum job_type *type, job_id_t id);
 int job_method_exec(pid_t *child, job_id_t jid, const char *method_name);
 int job_register_pid(int64_t row_id, pid_t pid);
+int job_spawn_shared_worker(pid_t *child, job_id_t jid, int command_fd, int status_fd);
+/* Sets *key to NULL if the job cannot use the shared runner */
+int job_get_worker_key(const char **key, job_id_t jid);
 
-int job_set_exit_status(pid_t pid, int status);
-int job_set_signal_status(pid_t pid, int signum);
+/*
+ * Spawning a child does not wait for it to reach execve(2). The status pipe of
+ * each child is given to watch(), and job_spawn_complete() should be called
+ * when it becomes readable; until then, a job that is being started is in the
+ * starting state. unwatch() is given whatever watch() returned. Without
+ * these callbacks, e.g. outside of jobd, spawning waits for the child.
+ *
+ * The reaper calls job_spawn_reap() first, in case the child exits before its
+ * status pipe has been read. It returns 0 if the child never ran, and needs no
+ * further reaping.
+ *
+ * on_start_aborted() is called when the start of a job ends without leaving a
+ * process behind, because the child failed before execve(2), or because the
+ * job was stopped while its start was deferred.
+ */
+struct job_spawn_callbacks {
+    void *(*watch)(int fd);
+    void (*unwatch)(void *handle);
+    void (*on_start_aborted)(job_id_t jid);
+};
+void job_set_spawn_callbacks(const struct job_spawn_callbacks *callbacks);
+int job_spawn_complete(int fd);
+int job_spawn_reap(pid_t pid);
+
+/* For the script cache, which keeps the settings so that spawning a job does not query the database */
+struct spawn_settings;
+int job_load_spawn_settings(struct spawn_settings **result, job_id_t jid);
+void job_free_spawn_settings(struct spawn_settings *settings);
+
+int job_set_exit_status(job_id_t id, int status);
+int job_set_signal_status(job_id_t id, int signum);
+int job_set_oom_kills(job_id_t id, uint64_t count);
+int job_run_begin(job_id_t id, enum job_start_reason reason);
+int job_run_end(job_id_t id, int status, const struct rusage *usage);
+
+int job_parse_rlimit(int *resource, rlim_t *value, const char *name, const char *str);
 
 const char *job_state_to_str(enum job_state state);
 const char *job_id_to_str(job_id_t id);
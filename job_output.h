@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _JOB_OUTPUT_H
+#define _JOB_OUTPUT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct ipc_session;
+struct ipc_stream;
+
+/*
+ * Capture of job output.
+ *
+ * Unless a job redirects its stdout or stderr to a file of its own, both
+ * are connected to a pipe owned by jobd. jobd moves everything written to
+ * the pipe into <localstatedir>/log/jobd/<label>.log using splice(2), and
+ * keeps a copy of the most recent output in a second pipe, the "ring",
+ * by splicing what was written back out of the log. The output never
+ * passes through the memory of jobd.
+ *
+ * The ring of a job outlives its processes, so the output of a task
+ * can be looked at after it has finished.
+ *
+ * The log is rotated once it grows too large or too old, by renaming it to
+ * <label>.log.<UTC timestamp> and opening a new one. This is done by the
+ * worker pool, and output keeps going to the old log until it is finished;
+ * writers only see the pipe, so nothing is lost. Rotated logs can be compressed by a child
+ * process, and only the newest few are kept. Output beyond the rate limit
+ * of a job is dropped, and a note of how much was dropped goes into the log.
+ *
+ * On other systems, job_output_open() always fails, and the caller
+ * should redirect the output to /dev/null instead.
+ */
+
+/* The amount of recent output kept for each job */
+#define JOB_OUTPUT_RING_SIZE 32768
+
+/* The most that job_output_tail() will return; it has to fit into an IPC response */
+#define JOB_OUTPUT_TAIL_MAX 8192
+
+/* Set in the [log] section of a manifest */
+struct job_output_options {
+    int64_t max_size;       /* Rotate the log when it reaches this many bytes; 0 to disable */
+    int64_t max_age;        /* Rotate the log when it is this many seconds old; 0 to disable */
+    int64_t keep;           /* The number of rotated logs to keep */
+    int64_t rate_limit;     /* Bytes per second; 0 to disable */
+    int compress;           /* Index into the table of compressors; 0 is none */
+};
+
+/* Set the defaults for a job that has no [log] section */
+void job_output_default_options(struct job_output_options *opts);
+int job_output_parse_option(struct job_output_options *opts, const char *name, const char *value);
+
+int job_output_init(void);
+void job_output_shutdown(void);
+int job_output_get_fd(void);
+int job_output_dispatch_events(void);
+
+/* Get the write end of the pipe of a job, which remains owned by job_output; opts take effect if it was closed */
+int job_output_open(int *fd, int64_t job_id, const struct job_output_options *opts);
+/* Called when the job has exited. Output from any descendants is still captured. */
+void job_output_close(int64_t job_id);
+/* Get the most recent output of a job, starting at a line boundary. Caller must free. */
+int job_output_tail(char **text, int64_t job_id);
+/* Stream the whole current log of a job in chunks; see ipc.h */
+int job_output_stream(struct ipc_stream **stream, const struct ipc_session *session, const char *label);
+/* Returns 1 if the process is not a compressor started by job_output */
+int job_output_reap(pid_t pid, int status);
+
+#endif /* _JOB_OUTPUT_H */
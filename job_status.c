@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "database.h"
+#include "ipc.h"
+#include "job_status.h"
+#include "job_table.h"
+#include "logger.h"
+#include "memory.h"
+
+/* Leave room for escaping the result into the JSON-RPC response */
+#define JOB_STATUS_REPLY_MAX (IPC_MAX_MSGLEN / 2)
+
+/* The value of "PRAGMA data_version" when the table was last loaded */
+static int64_t data_version = -1;
+static unsigned int generation;
+
+enum sort_key {
+    SORT_LABEL,
+    SORT_ID,
+    SORT_STATE,
+    SORT_START_TIME,
+    SORT_DURATION,
+};
+
+static const char *sort_keys[] = { "label", "id", "state", "start_time", "duration" };
+
+/* For compare_entries(); qsort(3) has no portable way to pass these */
+static enum sort_key sort_by;
+static int sort_order;
+static time_t sort_now;
+
+static const char *
+job_type_to_str(enum job_type type)
+{
+    switch (type) {
+        case JOB_TYPE_TASK:
+            return ("task");
+        case JOB_TYPE_SERVICE:
+            return ("service");
+        default:
+            return ("unknown");
+    }
+}
+
+static int64_t
+duration_of(const struct job_table_entry *jte, time_t now)
+{
+    if (jte->start_time == 0)
+        return (-1);
+    if (jte->terminfo.ti_timestamp == 0)
+        return (now - jte->start_time);
+    return (jte->terminfo.ti_timestamp - jte->start_time);
+}
+
+static int
+load_jobs(void)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    struct job_table_entry *jte, *next;
+    const char *sql = "SELECT jobs.id, jobs.job_id, jobs.job_type_id, jobs_current_states.job_state_id, "
+                      "       processes.start_time, processes.end_time, processes.exited, processes.exit_status, "
+                      "       processes.signaled, processes.signal_number, processes.oom_kills, "
+                      "       props.json "
+                      "FROM jobs "
+                      "LEFT JOIN jobs_current_states ON jobs_current_states.job_id = jobs.id "
+                      "LEFT JOIN processes ON processes.job_id = jobs.id "
+                      "LEFT JOIN (SELECT job_id, json_group_object(name, current_value) AS json "
+                      "           FROM properties GROUP BY job_id) AS props ON props.job_id = jobs.id";
+    const char *properties;
+    size_t count = 0;
+    int rv;
+
+    if (db_query(&stmt, sql, "") < 0)
+        return printlog(LOG_ERR, "unable to load the jobs");
+
+    generation++;
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        jte = job_table_get(sqlite3_column_int64(stmt, 0), (const char *) sqlite3_column_text(stmt, 1));
+        if (!jte)
+            return -1;
+        properties = (const char *) sqlite3_column_text(stmt, 11);
+        free(jte->properties);
+        jte->properties = strdup(properties ? properties : "{}");
+        if (!jte->properties)
+            return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+        jte->type = (enum job_type) sqlite3_column_int(stmt, 2);
+        jte->state = (enum job_state) sqlite3_column_int(stmt, 3);
+        jte->start_time = (time_t) sqlite3_column_int64(stmt, 4);
+        jte->terminfo.ti_timestamp = (time_t) sqlite3_column_int64(stmt, 5);
+        if (sqlite3_column_int(stmt, 6) == 1) {
+            jte->terminfo.ti_event = TERMINFO_EXIT;
+            jte->terminfo.ti_data = sqlite3_column_int(stmt, 7);
+        } else if (sqlite3_column_int(stmt, 8) == 1) {
+            jte->terminfo.ti_event = TERMINFO_SIGNAL;
+            jte->terminfo.ti_data = sqlite3_column_int(stmt, 9);
+        } else {
+            jte->terminfo.ti_event = TERMINFO_NEVER_RAN;
+            jte->terminfo.ti_data = 0;
+        }
+        jte->oom_kills = (uint64_t) sqlite3_column_int64(stmt, 10);
+        jte->generation = generation;
+        job_table_changed(jte);
+        count++;
+    }
+    if (rv != SQLITE_DONE)
+        return db_error;
+
+    /* Forget the jobs that were deleted, unless they still have a process */
+    for (jte = job_table_next(NULL); jte; jte = next) {
+        next = job_table_next(jte);
+        if (jte->generation != generation && jte->pid == 0)
+            job_table_remove(jte);
+    }
+    printlog(LOG_DEBUG, "loaded the status of %zu job(s)", count);
+    return 0;
+}
+
+/* Reload the table if another process has committed changes to the database */
+static int
+refresh(void)
+{
+    int64_t version;
+
+    if (db_get_id(&version, "PRAGMA data_version", "") < 0)
+        return printlog(LOG_ERR, "unable to query the data version");
+    if (version == data_version)
+        return 0;
+    if (load_jobs() < 0)
+        return -1;
+    data_version = version;
+    return 0;
+}
+
+/* Returns the length, which is at least the size of buf if it was truncated */
+static int
+render_job(char *buf, size_t bufsz, const struct job_table_entry *jte, time_t now)
+{
+    char terminated[32], duration[32];
+    int64_t secs;
+
+    if (jte->oom_kills > 0)
+        strcpy(terminated, "oom_kill");
+    else if (jte->terminfo.ti_event == TERMINFO_EXIT)
+        snprintf(terminated, sizeof(terminated), "exit(%d)", jte->terminfo.ti_data);
+    else if (jte->terminfo.ti_event == TERMINFO_SIGNAL)
+        snprintf(terminated, sizeof(terminated), "kill(%d)", jte->terminfo.ti_data);
+    else
+        strcpy(terminated, "-");
+
+    secs = duration_of(jte, now);
+    if (secs < 0)
+        strcpy(duration, "null");
+    else
+        snprintf(duration, sizeof(duration), "%lld", (long long) secs);
+
+    return (snprintf(buf, bufsz,
+            "{\"id\": %lld, \"label\": \"%s\", \"state\": \"%s\", \"type\": \"%s\", \"pid\": %d, "
+            "\"terminated\": \"%s\", \"start_time\": %lld, \"end_time\": %lld, \"duration\": %s, "
+            "\"oom_kills\": %llu}",
+            (long long) jte->jte_id, jte->jte_label, job_state_to_str(jte->state),
+            job_type_to_str(jte->type), (int) jte->pid, terminated,
+            (long long) jte->start_time, (long long) jte->terminfo.ti_timestamp, duration,
+            (unsigned long long) jte->oom_kills));
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    const struct job_table_entry *x = *(const struct job_table_entry * const *) a;
+    const struct job_table_entry *y = *(const struct job_table_entry * const *) b;
+    int64_t dx = 0, dy = 0;
+
+    switch (sort_by) {
+        case SORT_ID:
+            dx = x->jte_id;
+            dy = y->jte_id;
+            break;
+        case SORT_STATE:
+            dx = x->state;
+            dy = y->state;
+            break;
+        case SORT_START_TIME:
+            dx = x->start_time;
+            dy = y->start_time;
+            break;
+        case SORT_DURATION:
+            dx = duration_of(x, sort_now);
+            dy = duration_of(y, sort_now);
+            break;
+        case SORT_LABEL:
+            break;
+    }
+    if (dx != dy)
+        return (dx < dy ? -sort_order : sort_order);
+    return (sort_order * strcmp(x->jte_label, y->jte_label));
+}
+
+static int
+parse_sort(const char *sort)
+{
+    size_t i;
+
+    sort_by = SORT_LABEL;
+    sort_order = 1;
+    if (!sort || sort[0] == '\0')
+        return 0;
+    if (sort[0] == '-') {
+        sort_order = -1;
+        sort++;
+    }
+    for (i = 0; i < sizeof(sort_keys) / sizeof(sort_keys[0]); i++) {
+        if (!strcmp(sort, sort_keys[i])) {
+            sort_by = (enum sort_key) i;
+            return 0;
+        }
+    }
+    return printlog(LOG_ERR, "unknown sort key: %s", sort);
+}
+
+/* The sorted entries that match the filters of a list request */
+static int
+match_jobs(struct job_table_entry ***result, size_t *total, const struct jsonrpc_request *req,
+        time_t now)
+{
+    const char *patterns = jsonrpc_request_param(req, "job_id");
+    struct job_table_entry **matches;
+    struct job_table_entry *jte;
+    uint32_t states;
+
+    *result = NULL;
+    *total = 0;
+    if (refresh() < 0)
+        return -1;
+    if (job_parse_states(&states, jsonrpc_request_param(req, "states")) < 0 ||
+            parse_sort(jsonrpc_request_param(req, "sort")) < 0)
+        return -1;
+
+    matches = calloc(job_table_count() + 1, sizeof(*matches));
+    if (!matches)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    for (jte = job_table_next(NULL); jte; jte = job_table_next(jte)) {
+        if (jte->generation != generation)
+            continue;   /* Deleted, but still has a process */
+        if (states && !(states & (1U << jte->state)))
+            continue;
+        if (!job_label_matches(jte->jte_label, patterns))
+            continue;
+        matches[(*total)++] = jte;
+    }
+    sort_now = now;
+    qsort(matches, *total, sizeof(*matches), compare_entries);
+    *result = matches;
+    return 0;
+}
+
+static int
+compare_labels(const void *a, const void *b)
+{
+    const struct job_table_entry *x = *(const struct job_table_entry * const *) a;
+    const struct job_table_entry *y = *(const struct job_table_entry * const *) b;
+
+    return (strcmp(x->jte_label, y->jte_label));
+}
+
+int
+job_status_match(struct job_table_entry ***result, size_t *count, const char *patterns)
+{
+    struct job_table_entry **matches;
+    struct job_table_entry *jte;
+
+    *result = NULL;
+    *count = 0;
+    if (refresh() < 0)
+        return -1;
+    matches = calloc(job_table_count() + 1, sizeof(*matches));
+    if (!matches)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    for (jte = job_table_next(NULL); jte; jte = job_table_next(jte)) {
+        if (jte->generation == generation && job_label_matches(jte->jte_label, patterns))
+            matches[(*count)++] = jte;
+    }
+    qsort(matches, *count, sizeof(*matches), compare_labels);
+    *result = matches;
+    return 0;
+}
+
+int
+job_status_list(char **output, const struct jsonrpc_request *req)
+{
+    const char *offset_param = jsonrpc_request_param(req, "offset");
+    const char *limit_param = jsonrpc_request_param(req, "limit");
+    struct job_table_entry **matches;
+    size_t i, total, offset, limit, len, used;
+    time_t now = time(NULL);
+    char buf[1024];
+    FILE *fp;
+    int n;
+
+    if (match_jobs(&matches, &total, req, now) < 0)
+        return (IPC_RESPONSE_ERROR);
+    offset = offset_param ? strtoul(offset_param, NULL, 10) : 0;
+    limit = limit_param ? strtoul(limit_param, NULL, 10) : 0;
+    if (limit == 0 || limit > JOB_STATUS_PAGE_MAX)
+        limit = JOB_STATUS_PAGE_MAX;
+
+    fp = open_memstream(output, &len);
+    if (!fp) {
+        free(matches);
+        return printlog(LOG_ERR, "open_memstream(3): %s", strerror(errno));
+    }
+    used = (size_t) fprintf(fp, "{\"total\": %zu, \"offset\": %zu, \"jobs\": [", total, offset);
+    for (i = offset; i < total && i - offset < limit; i++) {
+        n = render_job(buf, sizeof(buf), matches[i], now);
+        if (n < 0 || (size_t) n >= sizeof(buf) || used + (size_t) n + 4 > JOB_STATUS_REPLY_MAX)
+            break;
+        used += (size_t) fprintf(fp, "%s%s", i > offset ? ", " : "", buf);
+    }
+    fputs("]}", fp);
+    free(matches);
+    if (fclose(fp) != 0)
+        return printlog(LOG_ERR, "fclose(3): %s", strerror(errno));
+    return (IPC_RESPONSE_OK);
+}
+
+/*
+ * Only the ids of the matching jobs are kept, since jobs can go away while
+ * the list is being streamed; those are left out.
+ */
+struct list_stream {
+    int64_t *ids;
+    size_t total;
+    size_t next;
+    size_t sent;
+    bool started;
+};
+
+static int
+list_stream_fill(void *ctx, char *buf, size_t size, size_t *len)
+{
+    struct list_stream *ls = ctx;
+    struct job_table_entry *jte;
+    time_t now = time(NULL);
+    char job[1024];
+    int n;
+
+    *len = 0;
+    if (!ls->started) {
+        *len = (size_t) snprintf(buf, size, "{\"total\": %zu, \"offset\": 0, \"jobs\": [", ls->total);
+        ls->started = true;
+    }
+    if (refresh() < 0)
+        return -1;
+    for (; ls->next < ls->total; ls->next++) {
+        jte = job_table_lookup_by_id(ls->ids[ls->next]);
+        if (!jte)
+            continue;
+        n = render_job(job, sizeof(job), jte, now);
+        if (n < 0 || (size_t) n >= sizeof(job))
+            return printlog(LOG_ERR, "the status of %s is too long", jte->jte_label);
+        if (*len + (size_t) n + 2 > size)
+            return 1;   /* Goes into the next chunk */
+        *len += (size_t) snprintf(buf + *len, size - *len, "%s%s", ls->sent++ ? ", " : "", job);
+    }
+    if (*len + 2 > size)
+        return 1;
+    memcpy(buf + *len, "]}", 2);
+    *len += 2;
+    return 0;
+}
+
+static void
+list_stream_free(void *ctx)
+{
+    struct list_stream *ls = ctx;
+
+    free(ls->ids);
+    free(ls);
+}
+
+int
+job_status_list_stream(struct ipc_stream **stream, const struct ipc_session *session)
+{
+    struct job_table_entry **matches;
+    struct list_stream *ls;
+    size_t i;
+
+    if (!(ls = calloc(1, sizeof(*ls))))
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    if (match_jobs(&matches, &ls->total, session->req, time(NULL)) < 0) {
+        free(ls);
+        return (IPC_RESPONSE_ERROR);
+    }
+    ls->ids = calloc(ls->total + 1, sizeof(*ls->ids));
+    if (!ls->ids) {
+        free(matches);
+        free(ls);
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    }
+    for (i = 0; i < ls->total; i++)
+        ls->ids[i] = matches[i]->jte_id;
+    free(matches);
+    if (ipc_stream_new(stream, session, list_stream_fill, list_stream_free, ls) < 0) {
+        list_stream_free(ls);
+        return (IPC_RESPONSE_ERROR);
+    }
+    return (IPC_RESPONSE_OK);
+}
+
+/* Runs are read a few at a time, after the last one that was sent */
+struct history_stream {
+    int64_t job_id;
+    int64_t last_run;
+    size_t sent;
+    bool started;
+};
+
+static int
+history_stream_fill(void *ctx, char *buf, size_t size, size_t *len)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    struct history_stream *hs = ctx;
+    const char *sql = "SELECT id, json_object('start_time', start_time, 'end_time', end_time, "
+                      "'duration', duration, 'exit_status', exit_status, "
+                      "'signal_number', signal_number, 'user_time', user_time, "
+                      "'system_time', system_time, 'max_rss', max_rss) "
+                      "FROM job_runs WHERE job_id = ? AND id > ? ORDER BY id LIMIT 64";
+    const char *run;
+    size_t n, rows = 0;
+    int rv;
+
+    *len = 0;
+    if (!hs->started) {
+        buf[(*len)++] = '[';
+        hs->started = true;
+    }
+    if (db_query(&stmt, sql, "ii", hs->job_id, hs->last_run) < 0)
+        return -1;
+    while ((rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+        run = (const char *) sqlite3_column_text(stmt, 1);
+        n = strlen(run);
+        if (*len + n + 3 > size)
+            return 1;   /* Goes into the next chunk */
+        *len += (size_t) snprintf(buf + *len, size - *len, "%s%s", hs->sent++ ? ", " : "", run);
+        hs->last_run = sqlite3_column_int64(stmt, 0);
+        rows++;
+    }
+    if (rv != SQLITE_DONE) {
+        db_error;
+        return -1;
+    }
+    if (rows == 64 || *len + 1 > size)
+        return 1;
+    buf[(*len)++] = ']';
+    return 0;
+}
+
+int
+job_status_history_stream(struct ipc_stream **stream, const struct ipc_session *session,
+        int64_t job_id)
+{
+    struct history_stream *hs;
+
+    if (!(hs = calloc(1, sizeof(*hs))))
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    hs->job_id = job_id;
+    if (ipc_stream_new(stream, session, history_stream_fill, free, hs) < 0) {
+        free(hs);
+        return (IPC_RESPONSE_ERROR);
+    }
+    return (IPC_RESPONSE_OK);
+}
+
+int
+job_status_lookup(struct job_table_entry **result, const char *label)
+{
+    struct job_table_entry *jte;
+
+    *result = NULL;
+    if (refresh() < 0)
+        return -1;
+    jte = job_table_lookup_by_label(label);
+    if (jte && jte->generation == generation)
+        *result = jte;
+    return 0;
+}
+
+int
+job_status_get(char **output, const char *label)
+{
+    struct job_table_entry *jte;
+    char buf[1024];
+    int n;
+
+    if (job_status_lookup(&jte, label) < 0)
+        return (IPC_RESPONSE_ERROR);
+    if (!jte)
+        return (IPC_RESPONSE_NOT_FOUND);
+    n = render_job(buf, sizeof(buf), jte, time(NULL));
+    if (n < 0 || (size_t) n >= sizeof(buf))
+        return printlog(LOG_ERR, "the status of %s is too long", label);
+    *output = strdup(buf);
+    if (!*output)
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    return (IPC_RESPONSE_OK);
+}
+
+int
+job_status_properties(char **output, const char *label)
+{
+    struct job_table_entry *jte;
+
+    if (job_status_lookup(&jte, label) < 0)
+        return (IPC_RESPONSE_ERROR);
+    if (!jte)
+        return (IPC_RESPONSE_NOT_FOUND);
+    if (strlen(jte->properties) > JOB_STATUS_REPLY_MAX)
+        return printlog(LOG_ERR, "the properties of %s do not fit into a response", label);
+    *output = strdup(jte->properties);
+    if (!*output)
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    return (IPC_RESPONSE_OK);
+}
+
+void
+job_status_invalidate(void)
+{
+    data_version = -1;
+}
+
+int
+job_status_load(void)
+{
+    return (refresh());
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _JOB_STATUS_H
+#define _JOB_STATUS_H
+
+#include <stdint.h>
+
+#include "jsonrpc.h"
+
+struct ipc_session;
+struct ipc_stream;
+struct job_table_entry;
+
+/*
+ * The list, status and properties IPC methods, answered from the job table
+ * instead of the views in the database.
+ *
+ * The table is loaded from the database by the first query, and reloaded
+ * whenever another process has committed changes, such as jobcfg importing
+ * jobs or jobprop setting a property. Changes made by jobd itself are
+ * written through to the table as they happen; see job_table.h.
+ *
+ * The list method takes label patterns in the job_id parameter, and these
+ * optional parameters:
+ *
+ *      states      A comma-separated list of states to match
+ *      sort        label (the default), id, state, start_time or duration;
+ *                  with a leading '-' to sort in descending order
+ *      offset      The number of matching jobs to skip
+ *      limit       At most JOB_STATUS_PAGE_MAX jobs are returned at once
+ *
+ * The result is {"total": <matching jobs>, "offset": <offset>, "jobs": [...]}.
+ * A page may end early to fit into one IPC message, so clients should move
+ * the offset by the number of jobs they got.
+ *
+ * Over a persistent connection, the whole list can be streamed instead;
+ * see ipc.h. The offset and limit are then ignored, and the concatenated
+ * chunks are the same document with every matching job. The history method
+ * streams the runs of one job, oldest first, as a JSON array.
+ */
+
+#define JOB_STATUS_PAGE_MAX 64
+
+int job_status_list(char **output, const struct jsonrpc_request *req);
+int job_status_get(char **output, const char *label);
+int job_status_properties(char **output, const char *label);
+int job_status_list_stream(struct ipc_stream **stream, const struct ipc_session *session);
+int job_status_history_stream(struct ipc_stream **stream, const struct ipc_session *session,
+        int64_t job_id);
+
+/* Sets *jte to NULL if there is no such job */
+int job_status_lookup(struct job_table_entry **jte, const char *label);
+
+/*
+ * The entries of the jobs whose label matches the patterns, sorted by label.
+ * The caller must free the array, and must not use it after anything that
+ * could reload the table.
+ */
+int job_status_match(struct job_table_entry ***result, size_t *count, const char *patterns);
+
+/* Reload the table on the next query */
+void job_status_invalidate(void);
+/* Load the table now if it is out of date, so that its observers see every job */
+int job_status_load(void);
+
+#endif /* _JOB_STATUS_H */
@@ -14,13 +14,158 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "job_table.h"
+#include "logger.h"
+
+/* The initial number of slots in each index; must be a power of two */
+#define INDEX_MIN_SIZE 64
+
+/* Marks a slot whose entry was removed, so that probing continues past it */
+#define TOMBSTONE ((struct job_table_entry *) -1)
+
+struct index {
+    struct job_table_entry **slots;
+    size_t size;
+    size_t used;        /* Including tombstones */
+    uint64_t (*hash)(const struct job_table_entry *);
+};
+
+static uint64_t
+hash_int(int64_t key)
+{
+    /* Fibonacci hashing; the high bits are the well-mixed ones */
+    return (((uint64_t) key * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+static uint64_t
+hash_str(const char *key)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+    /* FNV-1a */
+    for (; *key; key++)
+        h = (h ^ (unsigned char) *key) * UINT64_C(0x100000001b3);
+    return (h);
+}
+
+static uint64_t hash_pid(const struct job_table_entry *jte) { return hash_int(jte->pid); }
+static uint64_t hash_id(const struct job_table_entry *jte) { return hash_int(jte->jte_id); }
+static uint64_t hash_label(const struct job_table_entry *jte) { return hash_str(jte->jte_label); }
 
 static LIST_HEAD(, job_table_entry) jobtab;
+static size_t jobtab_count;
+static struct index pid_index = { .hash = hash_pid };
+static struct index id_index = { .hash = hash_id };
+static struct index label_index = { .hash = hash_label };
+static void (*observer)(const struct job_table_entry *, bool);
+
+static void
+index_insert_slot(struct index *idx, struct job_table_entry *jte)
+{
+    size_t mask = idx->size - 1;
+    size_t i;
+
+    for (i = idx->hash(jte) & mask; idx->slots[i] && idx->slots[i] != TOMBSTONE; i = (i + 1) & mask)
+        ;
+    if (!idx->slots[i])
+        idx->used++;
+    idx->slots[i] = jte;
+}
+
+/* Keep the load factor, including tombstones, below 3/4 */
+static int
+index_reserve(struct index *idx)
+{
+    struct job_table_entry **old_slots = idx->slots;
+    size_t old_size = idx->size;
+    size_t new_size, live = 0, i;
+
+    if ((idx->used + 1) * 4 < idx->size * 3)
+        return 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_slots[i] && old_slots[i] != TOMBSTONE)
+            live++;
+    }
+    for (new_size = INDEX_MIN_SIZE; (live + 1) * 2 > new_size; new_size *= 2)
+        ;
+
+    idx->slots = calloc(new_size, sizeof(*idx->slots));
+    if (!idx->slots) {
+        idx->slots = old_slots;
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    }
+    idx->size = new_size;
+    idx->used = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old_slots[i] && old_slots[i] != TOMBSTONE)
+            index_insert_slot(idx, old_slots[i]);
+    }
+    free(old_slots);
+    return 0;
+}
+
+static int
+index_insert(struct index *idx, struct job_table_entry *jte)
+{
+    if (index_reserve(idx) < 0)
+        return -1;
+    index_insert_slot(idx, jte);
+    return 0;
+}
+
+static void
+index_remove(struct index *idx, struct job_table_entry *jte)
+{
+    size_t mask = idx->size - 1;
+    size_t i;
+
+    if (!idx->slots)
+        return;
+    for (i = idx->hash(jte) & mask; idx->slots[i]; i = (i + 1) & mask) {
+        if (idx->slots[i] == jte) {
+            idx->slots[i] = TOMBSTONE;
+            return;
+        }
+    }
+}
+
+static void
+index_free(struct index *idx)
+{
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->size = 0;
+    idx->used = 0;
+}
+
+/* Iterate over the slots that an entry with the given hash may be in */
+#define INDEX_PROBE(idx, h, i, jte) \
+    for ((i) = (idx)->slots ? ((h) & ((idx)->size - 1)) : 0; \
+         (idx)->slots && ((jte) = (idx)->slots[i]) != NULL; \
+         (i) = ((i) + 1) & ((idx)->size - 1)) \
+        if ((jte) != TOMBSTONE)
+
+void
+job_table_set_observer(void (*func)(const struct job_table_entry *jte, bool removed))
+{
+    observer = func;
+}
+
+void
+job_table_changed(const struct job_table_entry *jte)
+{
+    if (observer)
+        observer(jte, false);
+}
 
 int job_table_init()
 {
@@ -28,14 +173,253 @@ int job_table_init()
     return 0;
 }
 
-int job_table_insert(struct job *job)
+void
+job_table_shutdown(void)
+{
+    struct job_table_entry *jte;
+
+    index_free(&pid_index);
+    index_free(&id_index);
+    index_free(&label_index);
+    while (!LIST_EMPTY(&jobtab)) {
+        jte = LIST_FIRST(&jobtab);
+        LIST_REMOVE(jte, jte_ent);
+        free(jte->jte_label);
+        free(jte->properties);
+        free(jte);
+    }
+    jobtab_count = 0;
+}
+
+struct job_table_entry *
+job_table_lookup_by_pid(pid_t pid)
+{
+    struct job_table_entry *jte;
+    size_t i;
+
+    INDEX_PROBE(&pid_index, hash_int(pid), i, jte) {
+        if (jte->pid == pid)
+            return (jte);
+    }
+    return (NULL);
+}
+
+struct job_table_entry *
+job_table_lookup_by_id(int64_t row_id)
+{
+    struct job_table_entry *jte;
+    size_t i;
+
+    INDEX_PROBE(&id_index, hash_int(row_id), i, jte) {
+        if (jte->jte_id == row_id)
+            return (jte);
+    }
+    return (NULL);
+}
+
+struct job_table_entry *
+job_table_lookup_by_label(const char *label)
+{
+    struct job_table_entry *jte;
+    size_t i;
+
+    INDEX_PROBE(&label_index, hash_str(label), i, jte) {
+        if (!strcmp(jte->jte_label, label))
+            return (jte);
+    }
+    return (NULL);
+}
+
+static struct job_table_entry *
+job_table_insert(int64_t row_id, const char *label)
 {
     struct job_table_entry *jte;
 
     jte = calloc(1, sizeof(*jte));
+    if (!jte) {
+        printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        return (NULL);
+    }
+    jte->jte_id = row_id;
+    jte->jte_label = strdup(label);
+    if (!jte->jte_label) {
+        printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+        free(jte);
+        return (NULL);
+    }
+    jte->terminfo.ti_event = TERMINFO_NEVER_RAN;
+    if (index_insert(&id_index, jte) < 0)
+        goto err_out;
+    if (index_insert(&label_index, jte) < 0) {
+        index_remove(&id_index, jte);
+        goto err_out;
+    }
+    LIST_INSERT_HEAD(&jobtab, jte, jte_ent);
+    jobtab_count++;
+    job_table_changed(jte);
+    return (jte);
+
+err_out:
+    free(jte->jte_label);
+    free(jte);
+    return (NULL);
+}
+
+struct job_table_entry *
+job_table_get(int64_t row_id, const char *label)
+{
+    struct job_table_entry *jte;
+    char *new_label;
+
+    jte = job_table_lookup_by_id(row_id);
+    if (!jte)
+        return (job_table_insert(row_id, label));
+    if (strcmp(jte->jte_label, label)) {
+        /* The job was renamed by reloading the configuration */
+        new_label = strdup(label);
+        if (!new_label) {
+            printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+            return (NULL);
+        }
+        index_remove(&label_index, jte);
+        free(jte->jte_label);
+        jte->jte_label = new_label;
+        if (index_insert(&label_index, jte) < 0)
+            return (NULL);
+        job_table_changed(jte);
+    }
+    return (jte);
+}
+
+void
+job_table_remove(struct job_table_entry *jte)
+{
+    if (observer)
+        observer(jte, true);
+    if (jte->pid > 0)
+        index_remove(&pid_index, jte);
+    index_remove(&id_index, jte);
+    index_remove(&label_index, jte);
+    LIST_REMOVE(jte, jte_ent);
+    jobtab_count--;
+    free(jte->jte_label);
+    free(jte->properties);
+    free(jte);
+}
+
+struct job_table_entry *
+job_table_next(struct job_table_entry *jte)
+{
+    return (jte ? LIST_NEXT(jte, jte_ent) : LIST_FIRST(&jobtab));
+}
+
+size_t
+job_table_count(void)
+{
+    return (jobtab_count);
+}
+
+int
+job_table_set_pid(int64_t row_id, const char *label, pid_t pid)
+{
+    struct job_table_entry *jte;
+
+    jte = job_table_get(row_id, label);
     if (!jte)
         return -1;
-    jte->jte_job = job;
-    LIST_INSERT_HEAD(&jobtab, jte, jte_ent);
+
+    if (jte->pid > 0)
+        index_remove(&pid_index, jte);
+    jte->pid = pid;
+    if (pid > 0 && index_insert(&pid_index, jte) < 0) {
+        jte->pid = 0;
+        return -1;
+    }
+    job_table_changed(jte);
     return 0;
-}
\ No newline at end of file
+}
+
+void
+job_table_reaped(struct job_table_entry *jte, int status)
+{
+    if (WIFEXITED(status)) {
+        jte->terminfo.ti_event = TERMINFO_EXIT;
+        jte->terminfo.ti_data = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        jte->terminfo.ti_event = TERMINFO_SIGNAL;
+        jte->terminfo.ti_data = WTERMSIG(status);
+    }
+    jte->terminfo.ti_timestamp = time(NULL);
+    index_remove(&pid_index, jte);
+    jte->pid = 0;
+    job_table_changed(jte);
+}
+
+void
+job_table_set_state(int64_t row_id, enum job_state state)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(row_id);
+
+    if (jte) {
+        jte->state = state;
+        job_table_changed(jte);
+    }
+}
+
+void
+job_table_run_started(int64_t row_id, time_t start_time, time_t end_time)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(row_id);
+
+    if (!jte)
+        return;
+    if (jte->start_time != 0)
+        jte->restarts++;
+    jte->start_time = start_time;
+    jte->oom_kills = 0;
+    jte->terminfo.ti_event = TERMINFO_NEVER_RAN;
+    jte->terminfo.ti_data = 0;
+    jte->terminfo.ti_timestamp = end_time;
+    job_table_changed(jte);
+}
+
+void
+job_table_run_ended(int64_t row_id, enum terminfo event, int data)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(row_id);
+
+    if (!jte)
+        return;
+    jte->terminfo.ti_event = event;
+    jte->terminfo.ti_data = data;
+    jte->terminfo.ti_timestamp = time(NULL);
+    job_table_changed(jte);
+}
+
+void
+job_table_set_oom_kills(int64_t row_id, uint64_t count)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(row_id);
+
+    if (jte) {
+        jte->oom_kills = count;
+        job_table_changed(jte);
+    }
+}
+
+void
+job_table_set_properties(int64_t row_id, const char *json)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(row_id);
+    char *copy;
+
+    if (!jte)
+        return;
+    if (!(copy = strdup(json ? json : "{}"))) {
+        printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+        return;
+    }
+    free(jte->properties);
+    jte->properties = copy;
+    job_table_changed(jte);
+}
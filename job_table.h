@@ -19,6 +19,22 @@
 
 #include <sys/queue.h>
 #include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "job.h"
+
+/*
+ * An in-memory table of jobs, so that the reaper can find the job that owns
+ * a process, and status queries can be answered, without querying the
+ * database.
+ *
+ * Entries are indexed by pid, by the row id of the job, and by its label,
+ * using open addressing. An entry is added the first time a job is started,
+ * or when job_status loads every job from the database; only its pid comes
+ * and goes. The functions in job.c that change the state or the process of a
+ * job write through to the table, if the job has an entry.
+ */
 
 enum terminfo {
     TERMINFO_NEVER_RAN, // has never ran
@@ -27,16 +43,60 @@ enum terminfo {
 };
 
 struct job_table_entry {
-    struct job *jte_job;
-    pid_t pid;
+    int64_t jte_id;     /* The row id in the jobs table */
+    char *jte_label;
+    pid_t pid;          /* 0 if the job does not have a process */
+    enum job_state state;
+    enum job_type type;
+    time_t start_time;  /* Of the last run; 0 if the job never ran */
+    uint64_t oom_kills;
+    unsigned int restarts;      /* Starts after the first one that jobd has seen */
+    char *properties;   /* A JSON object of the current values; NULL if not loaded */
+    unsigned int generation;    /* Of the last load that saw the job */
     struct {
         enum terminfo ti_event;
         int ti_data;
-        time_t ti_timestamp;
+        time_t ti_timestamp;    /* The end of the last run; 0 while running */
     } terminfo;
     LIST_ENTRY(job_table_entry) jte_ent;
 };
 
 int job_table_init();
-int job_table_insert(struct job *job);
+void job_table_shutdown(void);
+
+/* Record the main process of a job, adding the job to the table if needed */
+int job_table_set_pid(int64_t row_id, const char *label, pid_t pid);
+
+/* Forget the process of a job, and record how it terminated */
+void job_table_reaped(struct job_table_entry *jte, int status);
+
+/* Find the entry of a job, adding it or following a rename as needed */
+struct job_table_entry *job_table_get(int64_t row_id, const char *label);
+void job_table_remove(struct job_table_entry *jte);
+
+/*
+ * The observer is called after an entry is added or changed, and before it
+ * is removed. Callers that change an entry directly should call
+ * job_table_changed() afterwards.
+ */
+void job_table_set_observer(void (*observer)(const struct job_table_entry *jte, bool removed));
+void job_table_changed(const struct job_table_entry *jte);
+
+/* Iterate over every entry, starting from NULL */
+struct job_table_entry *job_table_next(struct job_table_entry *jte);
+size_t job_table_count(void);
+
+/* These do nothing if the job has no entry */
+void job_table_set_state(int64_t row_id, enum job_state state);
+void job_table_run_started(int64_t row_id, time_t start_time, time_t end_time);
+void job_table_run_ended(int64_t row_id, enum terminfo event, int data);
+void job_table_set_oom_kills(int64_t row_id, uint64_t count);
+/* The current values of the properties, as a JSON object */
+void job_table_set_properties(int64_t row_id, const char *json);
+
+/* These return NULL if there is no such entry */
+struct job_table_entry *job_table_lookup_by_pid(pid_t pid);
+struct job_table_entry *job_table_lookup_by_id(int64_t row_id);
+struct job_table_entry *job_table_lookup_by_label(const char *label);
+
 #endif //JOBD_JOB_TABLE_H
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include "queue.h"
+#endif /* __linux__ */
+
+#include "job_wait.h"
+#include "logger.h"
+
+#define STATE_BIT(state) (1U << (state))
+
+static const struct {
+    const char *method;
+    uint32_t done;      /* States that answer the request */
+    uint32_t failed;    /* States that answer it with an error */
+} wait_targets[] = {
+    { "start", STATE_BIT(JOB_STATE_RUNNING) | STATE_BIT(JOB_STATE_STOPPED) | STATE_BIT(JOB_STATE_COMPLETE),
+      STATE_BIT(JOB_STATE_ERROR) | STATE_BIT(JOB_STATE_EXEC_FAILED) },
+    { "enable", STATE_BIT(JOB_STATE_RUNNING) | STATE_BIT(JOB_STATE_STOPPED) | STATE_BIT(JOB_STATE_COMPLETE),
+      STATE_BIT(JOB_STATE_ERROR) | STATE_BIT(JOB_STATE_EXEC_FAILED) },
+    { "stop", STATE_BIT(JOB_STATE_STOPPED) | STATE_BIT(JOB_STATE_COMPLETE) | STATE_BIT(JOB_STATE_DISABLED),
+      STATE_BIT(JOB_STATE_ERROR) },
+    { "disable", STATE_BIT(JOB_STATE_STOPPED) | STATE_BIT(JOB_STATE_COMPLETE) | STATE_BIT(JOB_STATE_DISABLED),
+      STATE_BIT(JOB_STATE_ERROR) },
+};
+
+static void
+respond(struct ipc_session *session, int retcode, enum job_state state)
+{
+    char data[64];
+
+    snprintf(data, sizeof(data), "{\"state\": \"%s\"}", job_state_to_str(state));
+    if (ipc_send_response(session, IPC_RES(retcode, data, "")) < 0)
+        printlog(LOG_ERR, "unable to answer a waiting request");
+    ipc_session_destroy(&session);
+}
+
+#ifdef __linux__
+
+struct job_waiter {
+    struct ipc_session *session;
+    job_id_t id;
+    uint32_t done;
+    uint32_t failed;
+    uint64_t deadline;      /* CLOCK_MONOTONIC, in milliseconds */
+    LIST_ENTRY(job_waiter) entries;
+};
+
+static LIST_HEAD(, job_waiter) waiters = LIST_HEAD_INITIALIZER(waiters);
+static int timer_fd = -1;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000);
+}
+
+/* Set the timer for the nearest deadline, or disarm it if nobody is waiting */
+static void
+arm_timer(void)
+{
+    struct itimerspec its = { 0 };
+    struct job_waiter *jw;
+    uint64_t nearest = 0;
+
+    LIST_FOREACH(jw, &waiters, entries) {
+        if (nearest == 0 || jw->deadline < nearest)
+            nearest = jw->deadline;
+    }
+    if (nearest > 0) {
+        its.it_value.tv_sec = (time_t) (nearest / 1000);
+        its.it_value.tv_nsec = (long) (nearest % 1000) * 1000000;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        printlog(LOG_ERR, "timerfd_settime(2): %s", strerror(errno));
+}
+
+static void
+waiter_finish(struct job_waiter *jw, int retcode, enum job_state state)
+{
+    LIST_REMOVE(jw, entries);
+    respond(jw->session, retcode, state);
+    free(jw);
+}
+
+int
+job_wait_init(void)
+{
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0)
+        return printlog(LOG_ERR, "timerfd_create(2): %s", strerror(errno));
+    return 0;
+}
+
+void
+job_wait_shutdown(void)
+{
+    struct job_waiter *jw;
+
+    while (!LIST_EMPTY(&waiters)) {
+        jw = LIST_FIRST(&waiters);
+        LIST_REMOVE(jw, entries);
+        ipc_session_destroy(&jw->session);
+        free(jw);
+    }
+    if (timer_fd >= 0)
+        (void) close(timer_fd);
+    timer_fd = -1;
+}
+
+int
+job_wait_get_fd(void)
+{
+    return timer_fd;
+}
+
+int
+job_wait_dispatch_events(void)
+{
+    struct job_waiter *jw, *tmp;
+    enum job_state state;
+    uint64_t expirations, now;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        return printlog(LOG_ERR, "read(2) of timerfd: %s", strerror(errno));
+
+    now = now_ms();
+    LIST_FOREACH_SAFE(jw, &waiters, entries, tmp) {
+        if (jw->deadline > now)
+            continue;
+        printlog(LOG_DEBUG, "timed out waiting for job %s", job_id_to_str(jw->id));
+        if (job_get_state(&state, jw->id) < 0)
+            state = JOB_STATE_UNKNOWN;
+        waiter_finish(jw, IPC_RESPONSE_TIMEOUT, state);
+    }
+    arm_timer();
+    return 0;
+}
+
+void
+job_wait_request(struct ipc_session *session, job_id_t id)
+{
+    const char *method = session->req->method;
+    const char *timeout = jsonrpc_request_param(session->req, "timeout");
+    struct job_waiter *jw;
+    enum job_state state;
+    size_t i;
+
+    for (i = 0; i < sizeof(wait_targets) / sizeof(wait_targets[0]); i++) {
+        if (!strcmp(wait_targets[i].method, method))
+            break;
+    }
+    if (i == sizeof(wait_targets) / sizeof(wait_targets[0]) || job_get_state(&state, id) < 0) {
+        respond(session, IPC_RESPONSE_ERROR, JOB_STATE_UNKNOWN);
+        return;
+    }
+    if (wait_targets[i].done & STATE_BIT(state)) {
+        respond(session, IPC_RESPONSE_OK, state);
+        return;
+    }
+    if (wait_targets[i].failed & STATE_BIT(state)) {
+        respond(session, IPC_RESPONSE_ERROR, state);
+        return;
+    }
+
+    jw = calloc(1, sizeof(*jw));
+    if (!jw) {
+        printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        respond(session, IPC_RESPONSE_ERROR, state);
+        return;
+    }
+    jw->session = session;
+    jw->id = id;
+    jw->done = wait_targets[i].done;
+    jw->failed = wait_targets[i].failed;
+    jw->deadline = now_ms() + (timeout ? strtoull(timeout, NULL, 10) : JOB_WAIT_TIMEOUT_DEFAULT_MS);
+    LIST_INSERT_HEAD(&waiters, jw, entries);
+    printlog(LOG_DEBUG, "waiting for job %s to %s", job_id_to_str(id), method);
+    arm_timer();
+}
+
+void
+job_wait_notify(job_id_t id, enum job_state state)
+{
+    struct job_waiter *jw, *tmp;
+    bool answered = false;
+
+    LIST_FOREACH_SAFE(jw, &waiters, entries, tmp) {
+        if (jw->id != id)
+            continue;
+        if (jw->done & STATE_BIT(state)) {
+            waiter_finish(jw, IPC_RESPONSE_OK, state);
+            answered = true;
+        } else if (jw->failed & STATE_BIT(state)) {
+            waiter_finish(jw, IPC_RESPONSE_ERROR, state);
+            answered = true;
+        }
+    }
+    if (answered)
+        arm_timer();
+}
+
+void
+job_wait_cancel(int connfd)
+{
+    struct job_waiter *jw, *tmp;
+
+    LIST_FOREACH_SAFE(jw, &waiters, entries, tmp) {
+        if (jw->session->connfd == connfd) {
+            LIST_REMOVE(jw, entries);
+            ipc_session_destroy(&jw->session);
+            free(jw);
+        }
+    }
+}
+
+#else
+
+int job_wait_init(void) { return 0; }
+void job_wait_shutdown(void) { }
+int job_wait_get_fd(void) { return (-1); }
+int job_wait_dispatch_events(void) { return 0; }
+void job_wait_notify(job_id_t id __attribute__((unused)), enum job_state state __attribute__((unused))) { }
+void job_wait_cancel(int connfd __attribute__((unused))) { }
+
+void
+job_wait_request(struct ipc_session *session, job_id_t id)
+{
+    enum job_state state;
+
+    if (job_get_state(&state, id) < 0)
+        state = JOB_STATE_UNKNOWN;
+    respond(session, IPC_RESPONSE_OK, state);
+}
+
+#endif /* __linux__ */
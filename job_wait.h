@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _JOB_WAIT_H
+#define _JOB_WAIT_H
+
+#include "ipc.h"
+#include "job.h"
+
+/*
+ * IPC requests with the "wait" parameter are not answered when the
+ * operation has been started, but once the job has got where it was sent:
+ *
+ *      start, enable       running, or finished (stopped or complete)
+ *      stop, disable       stopped, complete or disabled
+ *
+ * A job is running once its main process has executed its program, so a
+ * start that fails before execve(2) is reported as exec_failed. Whether the
+ * program is ready to do its work is beyond what jobd can tell.
+ *
+ * The response is an error if the job ends up in the error or exec_failed
+ * state instead, and IPC_RESPONSE_TIMEOUT if the "timeout" (in
+ * milliseconds) passes first. Waiting requests are parked, not blocked on,
+ * so any number of clients can wait for the same job. A single timerfd
+ * tracks the nearest deadline.
+ *
+ * Where there is no timerfd(2), requests are answered right away.
+ */
+
+#define JOB_WAIT_TIMEOUT_DEFAULT_MS 30000
+
+int job_wait_init(void);
+void job_wait_shutdown(void);
+int job_wait_get_fd(void);
+int job_wait_dispatch_events(void);
+
+/* Takes ownership of the session, and answers it now or later */
+void job_wait_request(struct ipc_session *session, job_id_t id);
+
+/* Call whenever a job changes state */
+void job_wait_notify(job_id_t id, enum job_state state);
+
+/* Forget the requests that arrived on a connection that is being closed */
+void job_wait_cancel(int connfd);
+
+#endif /* _JOB_WAIT_H */
@@ -15,66 +15,286 @@
  */
 
 #include <err.h>
+#include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
-#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "config.h"
-#include "database.h"
-#include "logger.h"
 #include "ipc.h"
+#include "libjobd.h"
+#include "memory.h"
+
+#define JOB_WAIT_TIMEOUT_DEFAULT_SEC 30
+
+/* The most requests of a session that are waiting for their response */
+#define SESSION_INFLIGHT_MAX 64
 
 static char *progname;
 
+static struct jobd_client *client;
+
 static void
 usage(void)
 {
-    fprintf(stderr, "usage: %s job method\n", progname);
+    fprintf(stderr, "usage: %s [--wait] [--timeout seconds] job method\n"
+                    "       %s --stream job method\n"
+                    "       %s -m pattern[,pattern...] method\n"
+                    "       %s -s < requests\n"
+                    "       %s -w pattern[,pattern...] [event[,event...]]\n",
+                    progname, progname, progname, progname, progname);
     exit(EXIT_FAILURE);
 }
 
+struct session_request {
+    char *line;         /* NULL once the response has been printed */
+    bool answered;
+    int retcode;
+    char *result;
+};
+
+/* The requests of a session that have not been printed, from head to tail */
+static struct session_request window[SESSION_INFLIGHT_MAX];
+static size_t head, tail;
+static int session_failed;
+
+static void
+session_response(void *ctx, int retcode, const char *result)
+{
+    struct session_request *sr = ctx;
+
+    sr->answered = true;
+    sr->retcode = retcode;
+    if (result && !(sr->result = strdup(result)))
+        err(1, "strdup");
+}
+
+/* Print the responses that have come, as far as the order of the requests allows */
+static void
+print_session_responses(void)
+{
+    struct session_request *sr;
+
+    while (head < tail && (sr = &window[head % SESSION_INFLIGHT_MAX])->answered) {
+        if (sr->retcode != IPC_RESPONSE_OK) {
+            fprintf(stderr, "ERROR: %s: request failed with retcode %d\n", sr->line, sr->retcode);
+            session_failed = 1;
+        } else if (sr->result && strcmp(sr->result, "{}")) {
+            printf("%s\n", sr->result);
+        }
+        free(sr->line);
+        free(sr->result);
+        memset(sr, 0, sizeof(*sr));
+        head++;
+    }
+}
+
+/* Wait until no more than max requests of the session are left to print */
+static void
+wait_for_session(size_t max)
+{
+    while (tail - head > max) {
+        /* Losing the connection answers every request */
+        if (jobd_wait(client, -1) < 0 && jobd_pending(client) > 0)
+            errx(1, "%s", jobd_last_error());
+        print_session_responses();
+    }
+}
+
+/*
+ * Read "job method [wait]" lines from stdin, and send them all over one
+ * connection, with up to SESSION_INFLIGHT_MAX requests in flight. The
+ * results are printed in the order of the requests, whichever order jobd
+ * answers them in.
+ */
+static int
+run_session(void)
+{
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &linecap, stdin)) > 0) {
+        char job_id[256], method[64], flag[8] = "";
+        const struct jobd_param params[] = { { "job_id", job_id }, { "wait", "1" } };
+        struct session_request *sr;
+
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (sscanf(line, "%255s %63s %7s", job_id, method, flag) < 2 || (flag[0] && strcmp(flag, "wait"))) {
+            fprintf(stderr, "ERROR: %s: expected a job, a method and optionally `wait'\n", line);
+            session_failed = 1;
+            continue;
+        }
+        wait_for_session(SESSION_INFLIGHT_MAX - 1);
+
+        sr = &window[tail % SESSION_INFLIGHT_MAX];
+        if (!(sr->line = strdup(line)))
+            err(1, "strdup");
+        if (jobd_request_params(client, method, params, flag[0] ? 2 : 1, session_response, sr) < 0)
+            errx(1, "%s", jobd_last_error());
+        tail++;
+    }
+    wait_for_session(0);
+
+    free(line);
+    return (session_failed ? -1 : 0);
+}
+
+static int
+write_chunk(void *ctx __attribute__((unused)), const char *data, size_t len)
+{
+    return (fwrite(data, 1, len, stdout) == len ? 0 : -1);
+}
+
+static void
+stream_done(void *ctx, int retcode, const char *result __attribute__((unused)))
+{
+    *(int *) ctx = retcode;
+}
+
+/* Print a result of any length, such as the whole log of a job, as it arrives */
+static int
+stream(const char *job_id, const char *method)
+{
+    int rv = JOBD_DISCONNECTED;
+
+    if (jobd_request_stream(client, job_id, method, write_chunk, stream_done, &rv) < 0)
+        errx(1, "%s", jobd_last_error());
+    while (jobd_pending(client) > 0 && jobd_wait(client, -1) == 0)
+        ;
+    if (rv != IPC_RESPONSE_OK) {
+        fprintf(stderr, "ERROR: Request failed with retcode %d\n", rv);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+print_event(void *ctx __attribute__((unused)), const char *event)
+{
+    printf("%s\n", event);
+    fflush(stdout);
+}
+
+static void
+subscribed(void *ctx __attribute__((unused)), int retcode, const char *result __attribute__((unused)))
+{
+    if (retcode != IPC_RESPONSE_OK)
+        errx(1, "unable to subscribe");
+}
+
+/* Print the events of the matching jobs as they happen, until interrupted */
+static int
+watch(const char *patterns, const char *events)
+{
+    jobd_set_event_callback(client, print_event, NULL);
+    if (jobd_subscribe(client, patterns, NULL, events, subscribed, NULL) < 0)
+        errx(1, "%s", jobd_last_error());
+    while (jobd_wait(client, -1) == 0)
+        ;
+    return -1;
+}
+
 int
 main(int argc, char *argv[])
 {
     char *job_id, *command;
-    int c, rv;
+    char CLEANUP_STR *result = NULL;
+    struct jobd_param params[3];
+    size_t nparams = 0;
+    char timeout_ms[16];
+    int c, rv, session = 0, bulk = 0, watching = 0, waiting = 0, streaming = 0;
+    long timeout = JOB_WAIT_TIMEOUT_DEFAULT_SEC;
+    char *end;
+    static const struct option longopts[] = {
+        { "wait", no_argument, NULL, 'W' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "stream", no_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
 
     progname = basename(argv[0]);
-    while ((c = getopt(argc, argv, "h")) != -1) {
+    while ((c = getopt_long(argc, argv, "hmsw", longopts, NULL)) != -1) {
         switch (c) {
+            case 'T':
+                timeout = strtol(optarg, &end, 10);
+                if (*end != '\0' || timeout < 0 || timeout > INT_MAX / 1000)
+                    errx(1, "invalid timeout: %s", optarg);
+                waiting = 1;
+                break;
+            case 'W':
+                waiting = 1;
+                break;
+            case 'S':
+                streaming = 1;
+                break;
             case 'h':
                 usage();
                 break;
+            case 'm':
+                bulk = 1;
+                break;
+            case 's':
+                session = 1;
+                break;
+            case 'w':
+                watching = 1;
+                break;
             default:
                 usage();
         }
     }
     argc -= optind;
     argv += optind;
-    if (argc != 2) {
+    if (watching ? (argc < 1 || argc > 2) : argc != (session ? 0 : 2)) {
+        usage();
+    }
+    if ((waiting || streaming) && (bulk || session || watching || waiting + streaming > 1)) {
         usage();
     }
 
-    if (logger_init() < 0)
-        errx(1, "logger_init");
-    logger_add_stderr_appender();
-
-    if (ipc_init() < 0)
-        errx(1, "ipc_init");
+    if (jobd_open(&client, NULL) < 0)
+        errx(1, "%s", jobd_last_error());
 
-    if (ipc_connect("jobd") < 0)
-        errx(1, "ipc_connect");
+    if (session)
+        exit(run_session() < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    if (watching)
+        exit(watch(argv[0], argc > 1 ? argv[1] : NULL) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    if (streaming)
+        exit(stream(argv[0], argv[1]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
 
     job_id = argv[0];
     command = argv[1];
 
-    rv = ipc_client_request(job_id, command);
+    params[nparams++] = (struct jobd_param) { "job_id", job_id };
+    if (bulk) {
+        params[nparams++] = (struct jobd_param) { "operation", command };
+    } else if (waiting) {
+        snprintf(timeout_ms, sizeof(timeout_ms), "%ld", timeout * 1000);
+        params[nparams++] = (struct jobd_param) { "wait", "1" };
+        params[nparams++] = (struct jobd_param) { "timeout", timeout_ms };
+    }
+    rv = jobd_call(client, &result, bulk ? "bulk" : command, params, nparams);
+    jobd_close(client);
     if (rv != IPC_RESPONSE_OK) {
-        fprintf(stderr, "ERROR: Request failed with retcode %d\n", rv);
+        if (rv == IPC_RESPONSE_TIMEOUT)
+            fprintf(stderr, "ERROR: Timed out waiting for %s to %s\n", job_id, command);
+        else
+            fprintf(stderr, "ERROR: Request failed with retcode %d\n", rv);
+        /* The state that the job was left in */
+        if (waiting && result)
+            fprintf(stderr, "%s\n", result);
         exit(EXIT_FAILURE);
     }
+    /* Most methods have nothing to say */
+    if (result && strcmp(result, "{}"))
+        fputs(result, stdout);
 
     exit(EXIT_SUCCESS);
 }
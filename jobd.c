@@ -18,6 +18,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
 #include <libgen.h>
 #include <pwd.h>
@@ -42,19 +43,31 @@
 #ifdef __linux__
 #include <sys/prctl.h>
 #endif
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 
 #include "array.h"
+#include "cgroup.h"
 #include "config.h"
 #include "database.h"
 #include "event_loop.h"
 #include "logger.h"
+#include "memory.h"
 #include "job.h"
+#include "job_output.h"
+#include "job_status.h"
 #include "job_table.h"
+#include "job_wait.h"
 #include "ipc.h"
 #include "pidfile.h"
+#include "queue.h"
+#include "runner.h"
+#include "script_cache.h"
+#include "status_page.h"
+#include "subscription.h"
+#include "worker_pool.h"
 
 static char *progname;
 
@@ -67,7 +80,33 @@ static void reload_configuration(int);
 /* Max length of a job ID. Equivalent to FILE_MAX */
 #define JOB_ID_MAX 255
 
-static pid_t sync_wait_pid;
+/* The number of children that are waited for before their exits are recorded */
+#define REAP_BATCH_MAX 256
+
+struct exited_child {
+	pid_t pid;
+	int status;
+	struct rusage usage;
+	char owner[JOB_ID_MAX];
+};
+
+/* The number of requests read from a connection each time it becomes readable */
+#define IPC_CONNECTION_BATCH_MAX 32
+
+/* A persistent IPC session; see ipc.h */
+struct ipc_connection {
+	int fd;
+	struct event_registration *reg;
+	int interest;			/* What reg is waiting for */
+	struct ipc_outbox *outbox;	/* Responses that the connection could not take yet */
+	struct subscription *sub;	/* NULL unless the client has subscribed */
+	struct ipc_stream *stream;	/* NULL unless a result is being streamed */
+	LIST_ENTRY(ipc_connection) entries;
+};
+
+static LIST_HEAD(, ipc_connection) ipc_connections = LIST_HEAD_INITIALIZER(ipc_connections);
+
+static job_id_t sync_wait_job = INVALID_ROW_ID;
 static struct pidfh *pidfile_fh;
 
 static const struct signal_handler signal_handlers[] = {
@@ -84,6 +123,8 @@ static volatile sig_atomic_t sigalrm_flag = 0;
 
 static void daemonize(void);
 static void schedule(void);
+static void request_schedule(void);
+static void ipc_connection_free(struct ipc_connection *);
 
 static void
 crash(const char *reason)
@@ -139,7 +180,7 @@ daemonize(void)
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-fv]\n", progname);
+	fprintf(stderr, "usage: %s [-fv] [-e epoll | io_uring]\n", progname);
 	exit(EXIT_FAILURE);
 }
 
@@ -168,11 +209,15 @@ schedule(void)
 	job_id_t id;
 	pid_t pid;
 
-	if (sync_wait_pid > 0) {
-		printlog(LOG_DEBUG, "waiting for pid %d", sync_wait_pid);
+	if (sync_wait_job != INVALID_ROW_ID) {
+		printlog(LOG_DEBUG, "waiting for job `%s' to finish", job_id_to_str(sync_wait_job));
 		return;
 	}
 
+	/* Pick up jobs that were added since, for the status page */
+	(void) job_status_load();
+	(void) script_cache_revalidate();
+
 	job_id_t prev_job = INVALID_ROW_ID;
 	printlog(LOG_DEBUG, "scheduling jobs");
 	for (;;) {
@@ -201,10 +246,10 @@ schedule(void)
 			printlog(LOG_ERR, "job no longer exists");
 			wait_flag = 0;
 		}
-		job_start(&pid, id);
-		if (wait_flag && pid) {
-			printlog(LOG_DEBUG, "will not start any more jobs until pid %d exits", pid);
-			sync_wait_pid = pid;
+		job_start(&pid, id, JOB_START_SCHEDULED);
+		if (wait_flag && (pid || job_start_is_deferred(id))) {
+			printlog(LOG_DEBUG, "will not start any more jobs until `%s' finishes", job_id_to_str(id));
+			sync_wait_job = id;
 			break;
 		}
 	}
@@ -212,31 +257,140 @@ schedule(void)
 }
 
 static void
-reaper(pid_t pid, int status)
+deferred_schedule(void *ctx __attribute__((unused)))
+{
+	schedule();
+}
+
+/* Run schedule() once all of the events that are ready have been handled */
+static void
+request_schedule(void)
+{
+	if (event_loop_defer(&deferred_schedule, NULL) < 0)
+		schedule();
+}
+
+/* Called once the job is really gone, including any descendants it left behind */
+static void
+job_exited(job_id_t job_id)
+{
+	uint64_t oom_kills;
+
+	if (cgroup_job_get_oom_kills(&oom_kills, job_id) == 0 && oom_kills > 0) {
+		printlog(LOG_WARNING, "job %s: %llu process(es) killed by the OOM killer",
+				job_id_to_str(job_id), (unsigned long long) oom_kills);
+		if (job_set_oom_kills(job_id, oom_kills) < 0)
+			printlog(LOG_ERR, "unable to record OOM kills");
+	}
+
+	if (job_set_state(job_id, JOB_STATE_STOPPED) < 0) {
+	    printlog(LOG_ERR, "unable to set job state");
+	}
+	job_output_close(job_id);
+	if (cgroup_job_release(job_id) < 0)
+		printlog(LOG_ERR, "unable to stop polling the cgroup of job %s", job_id_to_str(job_id));
+
+	if (sync_wait_job == job_id) {
+		sync_wait_job = INVALID_ROW_ID;
+		if (!jobd_is_shutting_down) {
+			printlog(LOG_DEBUG, "starting the next job now that `%s' is finished", job_id_to_str(job_id));
+			request_schedule();
+		}
+	}
+}
+
+static void
+shared_task_done(job_id_t job_id, int status)
+{
+	const char *label = job_id_to_str(job_id);
+	enum job_state state;
+	bool populated;
+
+	if (WIFEXITED(status)) {
+		printlog(LOG_DEBUG, "job %s (shared runner) exited with status=%d", label, WEXITSTATUS(status));
+		if (job_set_exit_status(job_id, WEXITSTATUS(status)) < 0)
+			printlog(LOG_ERR, "unable to record the exit status of %s", label);
+	} else if (WIFSIGNALED(status)) {
+		printlog(LOG_DEBUG, "job %s (shared runner) caught signal %d", label, WTERMSIG(status));
+		if (job_set_signal_status(job_id, WTERMSIG(status)) < 0)
+			printlog(LOG_ERR, "unable to record the exit status of %s", label);
+	}
+	if (job_run_end(job_id, status, NULL) < 0)
+		printlog(LOG_ERR, "unable to record the end of the run of %s", label);
+	subscription_publish_exit(job_id, status);
+
+	if (cgroup_job_is_populated(&populated, job_id) == 0 && populated) {
+		printlog(LOG_DEBUG, "job %s (shared runner) left processes behind in its cgroup", label);
+		if (job_get_cached_state(&state, job_id) == 0 && state == JOB_STATE_STOPPING)
+			(void) cgroup_job_kill(job_id);
+		return;
+	}
+
+	job_exited(job_id);
+}
+
+static void
+job_cgroup_emptied(job_id_t job_id)
+{
+	struct job_table_entry *jte;
+	enum job_state state;
+
+	/* If the main process has not been reaped yet, reaper() or shared_task_done() will finish the job */
+	jte = job_table_lookup_by_id(job_id);
+	if ((jte && jte->pid > 0) || runner_has_task(job_id))
+		return;
+	if (job_get_cached_state(&state, job_id) < 0)
+		return;
+	if (state == JOB_STATE_RUNNING || state == JOB_STATE_STOPPING) {
+		printlog(LOG_DEBUG, "the last process of job %s has exited", job_id_to_str(job_id));
+		job_exited(job_id);
+	}
+}
+
+static void
+reap_orphan(pid_t pid, const char *owner)
 {
-	char label[JOB_ID_MAX];
+	struct job_table_entry *jte;
+	bool populated;
+
+	if (!owner || owner[0] == '\0') {
+		printlog(LOG_ERR, "unable to find a process with pid %d", pid);
+		return;
+	}
+	printlog(LOG_DEBUG, "reaped orphan pid %d belonging to job %s", pid, owner);
+	if (!(jte = job_table_lookup_by_label(owner)))
+		return;
+	if (cgroup_job_is_populated(&populated, jte->jte_id) == 0 && !populated)
+		job_cgroup_emptied(jte->jte_id);
+}
+
+static void
+reaper(pid_t pid, int status, const struct rusage *usage, const char *owner)
+{
+	struct job_table_entry *jte;
+	const char *label;
 	job_id_t job_id;
 	int last_exit_status, term_signal;
+	enum job_state state;
+	bool populated;
 
 	printlog(LOG_DEBUG, "reaping PID %d", pid);
 
-	const char *sql = "SELECT jobs.id "
-					  "  FROM jobs "
-					  "INNER JOIN processes ON processes.job_id = jobs.id "
-					  "  WHERE pid = ?";
-	if (db_get_id(&job_id, sql, "i", pid) < 0) {
-		printlog(LOG_ERR, "database lookup error; pid %d", pid);
+	if (job_spawn_reap(pid) == 0)
 		return;
-	}
-	if (job_id < 0) {
-	 	printlog(LOG_ERR, "unable to find a process with pid %d", pid);
+	if (runner_reap(pid, status) == 0)
+		return;
+	if (job_output_reap(pid, status) == 0)
 		return;
-	}
 
-	if (job_get_label_by_pid(label, pid) < 0) {
-		printlog(LOG_ERR, "unable to lookup the label for pid %d", pid);
-		label[0] = '\0';
+	jte = job_table_lookup_by_pid(pid);
+	if (!jte) {
+		reap_orphan(pid, owner);
+		return;
 	}
+	job_id = jte->jte_id;
+	label = jte->jte_label;
+	job_table_reaped(jte, status);
 
 	// if (job->state != JOB_STATE_STOPPING) {
 	// 	printlog(LOG_NOTICE, "job %s terminated unexpectedly", job->id);
@@ -247,36 +401,40 @@ reaper(pid_t pid, int status)
 	if (WIFEXITED(status)) {
 		last_exit_status = WEXITSTATUS(status);
 		printlog(LOG_DEBUG, "job %s (pid %d) exited with status=%d", label, pid, last_exit_status);
-		job_set_exit_status(pid, last_exit_status); // TODO: errcheck
+		job_set_exit_status(job_id, last_exit_status); // TODO: errcheck
 	} else if (WIFSIGNALED(status)) {
 		term_signal = WTERMSIG(status);
 		printlog(LOG_DEBUG, "job %s (pid %d) caught signal %d",	label, pid, term_signal);
-		job_set_signal_status(pid, term_signal); // TODO: errcheck
+		job_set_signal_status(job_id, term_signal); // TODO: errcheck
 	} else {
 		// TODO: Handle sigstop/sigcont
 		printlog(LOG_ERR, "unhandled exit status type");
 	}
-
-	if (job_set_state(job_id, JOB_STATE_STOPPED) < 0) {
-	    printlog(LOG_ERR, "unable to set job state");
+	if (job_run_end(job_id, status, usage) < 0)
+		printlog(LOG_ERR, "unable to record the end of the run of %s", label);
+	subscription_publish_exit(job_id, status);
+
+	if (cgroup_job_is_populated(&populated, job_id) == 0 && populated) {
+		printlog(LOG_DEBUG, "job %s (pid %d) left processes behind in its cgroup", label, pid);
+		if (job_get_cached_state(&state, job_id) == 0 && state == JOB_STATE_STOPPING)
+			(void) cgroup_job_kill(job_id);
+		return;
 	}
 
-	if (sync_wait_pid == pid) {
-		printlog(LOG_DEBUG, "starting the next job now that `%s' is finished", label);
-		sync_wait_pid = 0;
-		schedule();
-	}
+	job_exited(job_id);
 }
 
 static void
 shutdown_handler(int signum)
 {
+    struct rusage usage;
     pid_t pid;
     int status;
 
     printlog(LOG_NOTICE, "terminating due to signal %d", signum);
 
     jobd_is_shutting_down = true;
+    runner_shutdown();
 
     int64_t id;
     const char *sql = "SELECT job_id FROM jobs_current_states "
@@ -312,9 +470,9 @@ shutdown_handler(int signum)
         } else if (state == JOB_STATE_STOPPING) {
             printlog(LOG_DEBUG, "waiting for a random job to stop"); // why not wait for specific job??
             //FIXME: SIGALRM timeout isnt being set
-            pid = wait(&status);
+            pid = wait4(-1, &status, 0, &usage);
             if (pid > 0) {
-                reaper(pid, status);
+                reaper(pid, status, &usage, NULL);
             } else {
                 if (errno == EINTR) {
                     if (sigalrm_flag) {
@@ -339,7 +497,15 @@ shutdown_handler(int signum)
     if (db_close(dbh) < 0)
         printlog(LOG_WARNING, "error closing database");
 
+    while (!LIST_EMPTY(&ipc_connections))
+        ipc_connection_free(LIST_FIRST(&ipc_connections));
     ipc_shutdown();
+    job_wait_shutdown();
+    worker_pool_shutdown();
+    job_output_shutdown();
+    status_page_shutdown();
+    job_table_shutdown();
+    cgroup_shutdown();
     db_shutdown();
     logger_shutdown();
 
@@ -353,26 +519,255 @@ shutdown_handler(int signum)
 static void
 reload_configuration(int signum __attribute__((unused)))
 {
-	schedule();
+	request_schedule();
 }
 
 static int
-_jobd_ipc_request_handler(const char *method)
+_jobd_ipc_request_handler(char **output, const char *method)
 {
 	if (!strcmp(method, "reopen_database")) {
+		script_cache_clear();
+		job_status_invalidate();
 		return (db_reopen());
+	} else if (!strcmp(method, "loop_stats")) {
+		return (event_loop_get_stats(output));
 	} else {
 		return (IPC_RESPONSE_NOT_FOUND);
 	}
 }
 
+/* The methods that can be applied to a single job */
 static int
-ipc_server_handler(event_t *ev __attribute__((unused)))
+job_method_handler(char **output, job_id_t id, const char *method)
 {
-    struct ipc_session CLEANUP_IPC_SESSION *session;
+	if (!strcmp(method, "start")) {
+		pid_t pid;
+		return (job_start(&pid, id, JOB_START_REQUESTED));
+	} else if (!strcmp(method, "stop")) {
+		return (job_stop(id));
+	} else if (!strcmp(method, "enable")) {
+		return (job_enable(id));
+	} else if (!strcmp(method, "disable")) {
+		return (job_disable(id));
+	} else if (!strcmp(method, "logs")) {
+		return (job_output_tail(output, id));
+	} else {
+		return (IPC_RESPONSE_NOT_FOUND);
+	}
+}
+
+/*
+ * Apply an operation to every job that matches the patterns, and schedule
+ * once afterwards. The output is an array of the retcode for each job.
+ *
+ * The database writes for all of the jobs are made in a single transaction,
+ * but processes are started and stopped as each job is handled, and are not
+ * undone if the commit fails. The request then fails, and the job table is
+ * reloaded from the database.
+ */
+static int
+bulk_request_handler(char **output, const char *patterns, const char *operation)
+{
+	struct job_table_entry **matches;
+	char label[JOB_ID_MAX * JSONRPC_ESCAPE_MAX + 1];
+	bool in_transaction;
+	size_t i, len, matched;
+	int retcode = IPC_RESPONSE_OK;
+	FILE *fp;
+
+	if (!operation)
+		return printlog(LOG_ERR, "missing operation parameter");
+	if (patterns[0] == '\0')
+		return (IPC_RESPONSE_NOT_FOUND);
+	if (strcmp(operation, "start") && strcmp(operation, "stop") &&
+	    strcmp(operation, "enable") && strcmp(operation, "disable"))
+		return (IPC_RESPONSE_NOT_FOUND);
+	if (job_status_match(&matches, &matched, patterns) < 0)
+		return (IPC_RESPONSE_ERROR);
+	printlog(LOG_DEBUG, "bulk %s matched %zu job(s)", operation, matched);
+	if (matched == 0) {
+		free(matches);
+		return (IPC_RESPONSE_NOT_FOUND);
+	}
+
+	fp = open_memstream(output, &len);
+	if (!fp) {
+		free(matches);
+		return printlog(LOG_ERR, "open_memstream(3): %s", strerror(errno));
+	}
+	fputc('[', fp);
+
+	in_transaction = sqlite3_get_autocommit(dbh) && db_exec(dbh, "BEGIN TRANSACTION") == 0;
+	for (i = 0; i < matched; i++) {
+		(void) jsonrpc_escape(label, sizeof(label), matches[i]->jte_label);
+		fprintf(fp, "%s{\"job_id\": \"%s\", \"retcode\": %d}", (i ? ", " : ""),
+				label, job_method_handler(NULL, matches[i]->jte_id, operation));
+	}
+	free(matches);
+	if (in_transaction && db_exec(dbh, "COMMIT") < 0) {
+		printlog(LOG_ERR, "unable to commit the bulk %s", operation);
+		(void) db_exec(dbh, "ROLLBACK");
+		job_status_invalidate();
+		retcode = IPC_RESPONSE_ERROR;
+	}
+	request_schedule();
+
+	fputc(']', fp);
+	if (fclose(fp) != 0) {
+		free(*output);
+		*output = NULL;
+		return printlog(LOG_ERR, "unable to format the bulk results");
+	}
+	return (retcode);
+}
+
+static struct ipc_connection *
+ipc_connection_lookup(int fd)
+{
+	struct ipc_connection *conn;
+
+	LIST_FOREACH(conn, &ipc_connections, entries) {
+		if (conn->fd == fd)
+			return (conn);
+	}
+	return (NULL);
+}
+
+/*
+ * Requests are not read while a result is being streamed, or while the
+ * client is not reading its responses, and writability only matters while
+ * there is something waiting to be written.
+ */
+static void
+ipc_connection_update_interest(void *ctx)
+{
+	struct ipc_connection *conn = ctx;
+	int interest;
+
+	interest = (conn->stream || ipc_outbox_backlogged(conn->outbox)) ? EVENT_WRITE : EVENT_READ;
+	if (conn->sub && subscription_backlogged(conn->sub))
+		interest |= EVENT_WRITE;
+	if (interest != conn->interest && event_loop_modify(conn->reg, interest) == 0)
+		conn->interest = interest;
+}
+
+/* Start pushing events to the connection that the request arrived on */
+static int
+subscribe_request_handler(const struct ipc_session *session, const char *patterns)
+{
+	struct ipc_connection *conn = ipc_connection_lookup(session->connfd);
+
+	if (!conn)
+		return printlog(LOG_ERR, "subscriptions need a persistent connection");
+
+	subscription_free(conn->sub);
+	conn->sub = NULL;
+	ipc_connection_update_interest(conn);
+	if (!strcmp(session->req->method, "unsubscribe"))
+		return (IPC_RESPONSE_OK);
+	if (subscription_new(&conn->sub, conn->fd, ipc_connection_update_interest, conn,
+			session->binary, patterns,
+			jsonrpc_request_param(session->req, "states"),
+			jsonrpc_request_param(session->req, "events")) < 0)
+		return (IPC_RESPONSE_ERROR);
+	return (IPC_RESPONSE_OK);
+}
+
+/*
+ * Start streaming a result that might not fit into one response; see ipc.h.
+ * The chunks are sent as the connection becomes writable.
+ */
+static int
+stream_request_handler(const struct ipc_session *session, const char *method, const char *label)
+{
+	struct ipc_connection *conn = ipc_connection_lookup(session->connfd);
+	struct job_table_entry *jte;
+	int retcode;
+
+	if (!conn)
+		return printlog(LOG_ERR, "streams need a persistent connection");
+	if (!strcmp(method, "list")) {
+		retcode = job_status_list_stream(&conn->stream, session);
+	} else if (strcmp(method, "history") && strcmp(method, "logs")) {
+		return (IPC_RESPONSE_NOT_FOUND);
+	} else if (job_status_lookup(&jte, label) < 0) {
+		return (IPC_RESPONSE_ERROR);
+	} else if (!jte) {
+		return (IPC_RESPONSE_NOT_FOUND);
+	} else if (!strcmp(method, "history")) {
+		retcode = job_status_history_stream(&conn->stream, session, jte->jte_id);
+	} else {
+		retcode = job_output_stream(&conn->stream, session, label);
+	}
+	if (retcode == IPC_RESPONSE_OK)
+		ipc_connection_update_interest(conn);
+	return (retcode);
+}
+
+/*
+ * Answer a request that has been read from a datagram or a connection.
+ * Requests that wait for the job to change state are handed to job_wait,
+ * and *sessionp is set to NULL.
+ */
+static int
+handle_ipc_request(struct ipc_session **sessionp)
+{
+    struct ipc_session *session = *sessionp;
+    char CLEANUP_STR *output = NULL;
     int retcode;
     job_id_t id;
 
+	const char * const method = session->req->method;
+	const char * const job_id = jsonrpc_request_param(session->req, "job_id");
+	if (!job_id) {
+	    (void) ipc_send_response(session, IPC_RES_ERR(-32602, "Invalid params"));
+	    return printlog(LOG_ERR, "missing job_id parameter");
+	}
+	printlog(LOG_DEBUG, "got IPC request; method=%s job_id=%s", method, job_id);
+
+	if (jsonrpc_request_param(session->req, "stream")) {
+		retcode = stream_request_handler(session, method, job_id);
+		if (retcode == IPC_RESPONSE_OK)
+			return 0;
+	} else if (!strcmp(method, "subscribe") || !strcmp(method, "unsubscribe")) {
+		retcode = subscribe_request_handler(session, job_id);
+	} else if (!strcmp(method, "bulk")) {
+		(void) script_cache_revalidate();
+		retcode = bulk_request_handler(&output, job_id,
+				jsonrpc_request_param(session->req, "operation"));
+	} else if (!strcmp(method, "list")) {
+		retcode = job_status_list(&output, session->req);
+	} else if (!strcmp(method, "status")) {
+		retcode = job_status_get(&output, job_id);
+	} else if (!strcmp(method, "properties")) {
+		retcode = job_status_properties(&output, job_id);
+	} else if (!strcmp(job_id, "jobd")) {
+		retcode = _jobd_ipc_request_handler(&output, method);
+	} else if (db_get_id(&id, "SELECT id FROM jobs WHERE job_id = ?", "s", job_id) < 0) {
+		retcode = IPC_RESPONSE_ERROR;
+	} else {
+		(void) script_cache_revalidate();
+		retcode = job_method_handler(&output, id, method);
+		if (retcode == IPC_RESPONSE_OK && jsonrpc_request_param(session->req, "wait")) {
+			job_wait_request(session, id);
+			*sessionp = NULL;
+			return 0;
+		}
+	}
+
+	/* Errors only carry data if the handler had something to say */
+	if (ipc_send_response(session, IPC_RES(retcode, output || retcode ? output : "{}", "")) < 0)
+		return printlog(LOG_ERR, "ipc_read_request() failed");
+
+	return 0;
+}
+
+static int
+ipc_server_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+    struct ipc_session CLEANUP_IPC_SESSION *session;
+
     session = ipc_session_new();
     if (!session)
         return printlog(LOG_ERR, "session allocation failed");
@@ -382,35 +777,101 @@ ipc_server_handler(event_t *ev __attribute__((unused)))
         return (-1);
     }
 
-	const char * const method = session->req->method;
-	const char * const job_id = jsonrpc_request_param(session->req, "job_id");
-	if (!job_id)
-	    return printlog(LOG_ERR, "missing job_id parameter");
-	printlog(LOG_DEBUG, "got IPC request; method=%s job_id=%s", method, job_id);
+    return handle_ipc_request(&session);
+}
 
-	if (!strcmp(job_id, "jobd")) {
-		retcode = _jobd_ipc_request_handler(method);
-	} else {
-	    if (db_get_id(&id, "SELECT id FROM jobs WHERE job_id = ?", "s", job_id) < 0) {
-			retcode = IPC_RESPONSE_ERROR;
-		} else if (!strcmp(method, "start")) {
-            pid_t pid;
-            retcode = job_start(&pid, id);
-        } else if (!strcmp(method, "stop")) {
-            retcode = job_stop(id);
-        } else if (!strcmp(method, "enable")) {
-            retcode = job_enable(id);
-        } else if (!strcmp(method, "disable")) {
-            retcode = job_disable(id);
-        } else {
-            retcode = IPC_RESPONSE_NOT_FOUND;
+static void
+ipc_connection_free(struct ipc_connection *conn)
+{
+    LIST_REMOVE(conn, entries);
+    job_wait_cancel(conn->fd);
+    subscription_free(conn->sub);
+    ipc_stream_free(conn->stream);
+    ipc_outbox_free(conn->outbox);
+    event_loop_remove(conn->reg);
+    (void) close(conn->fd);
+    free(conn);
+}
+
+/* Handle a few requests at a time, so that one busy client cannot starve the others */
+static int
+ipc_connection_handler(int fd, int events, void *ctx)
+{
+    struct ipc_connection *conn = ctx;
+    int i;
+
+    if ((events & EVENT_WRITE) && ipc_outbox_flush(conn->outbox) < 0) {
+        ipc_connection_free(conn);
+        return 0;
+    }
+    if ((events & EVENT_WRITE) && conn->sub && subscription_flush(conn->sub) < 0) {
+        ipc_connection_free(conn);
+        return 0;
+    }
+    if ((events & EVENT_WRITE) && conn->stream) {
+        switch (ipc_stream_pump(conn->stream)) {
+            case -1:
+                ipc_connection_free(conn);
+                return 0;
+            case 0:
+                ipc_stream_free(conn->stream);
+                conn->stream = NULL;
+                ipc_connection_update_interest(conn);
+                break;
         }
-	}
+    }
 
-	if (ipc_send_response(session, IPC_RES(retcode, "{}", "")) < 0)
-		return printlog(LOG_ERR, "ipc_read_request() failed");
+    /* The requests that follow a stream, or a backlog of responses, wait until it has been sent */
+    for (i = 0; i < IPC_CONNECTION_BATCH_MAX && !conn->stream && !ipc_outbox_backlogged(conn->outbox); i++) {
+        struct ipc_session CLEANUP_IPC_SESSION *session = ipc_session_new();
 
-	return 0;
+        if (!session)
+            return printlog(LOG_ERR, "session allocation failed");
+        if (ipc_read_connection_request(session, fd, conn->outbox) < 0) {
+            ipc_connection_free(conn);
+            return 0;
+        }
+        if (!session->req)
+            break;
+        (void) handle_ipc_request(&session);
+    }
+    /* Anything left to read is handled first; the hangup is noticed on the next read */
+    if (i == 0 && (events & EVENT_ERROR))
+        ipc_connection_free(conn);
+    return 0;
+}
+
+static int
+ipc_listen_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+    struct ipc_connection *conn;
+    int connfd;
+
+    connfd = ipc_accept();
+    if (connfd < 0)
+        return -1;
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        (void) close(connfd);
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    }
+    conn->fd = connfd;
+    conn->interest = EVENT_READ;
+    if (ipc_outbox_new(&conn->outbox, connfd, ipc_connection_update_interest, conn) < 0) {
+        (void) close(connfd);
+        free(conn);
+        return -1;
+    }
+    conn->reg = event_loop_add(connfd, EVENT_READ, &ipc_connection_handler, conn, "ipc");
+    if (!conn->reg) {
+        ipc_outbox_free(conn->outbox);
+        (void) close(connfd);
+        free(conn);
+        return -1;
+    }
+    LIST_INSERT_HEAD(&ipc_connections, conn, entries);
+    return 0;
 }
 
 static void
@@ -420,25 +881,189 @@ sigalrm_handler(int signum)
 	sigalrm_flag = 1;
 }
 
+static int
+cgroup_event_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return cgroup_dispatch_events(&job_cgroup_emptied);
+}
+
+static int
+cgroup_poll_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return cgroup_poll_unwatched(&job_cgroup_emptied);
+}
+
+static int
+runner_event_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return runner_dispatch_events();
+}
+
+static int
+runner_write_handler(int fd, int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return runner_flush(fd);
+}
+
+static void *
+runner_watch(int fd)
+{
+	return event_loop_add(fd, EVENT_WRITE, &runner_write_handler, NULL, "runner");
+}
+
 static void
-sigchld_handler(int signum __attribute__((unused)))
+event_unwatch(void *handle)
 {
-	int status;
-	pid_t pid;
+	event_loop_remove(handle);
+}
 
-	for (;;) {
-		pid = waitpid(-1, &status, WNOHANG);
-		if (pid > 0) {
-			reaper(pid, status);
-		} else {
+static int
+spawn_event_handler(int fd, int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return job_spawn_complete(fd);
+}
+
+static void *
+spawn_watch(int fd)
+{
+	return event_loop_add(fd, EVENT_READ, &spawn_event_handler, NULL, "spawn");
+}
+
+/* A job that never ran has to let the scheduler move on, just like one that has exited */
+static void
+job_start_aborted(job_id_t job_id)
+{
+	if (sync_wait_job == job_id) {
+		sync_wait_job = INVALID_ROW_ID;
+		if (!jobd_is_shutting_down)
+			request_schedule();
+	}
+}
+
+static int
+job_output_event_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return job_output_dispatch_events();
+}
+
+static int
+worker_pool_event_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return worker_pool_dispatch_events();
+}
+
+static int
+job_wait_event_handler(int fd __attribute__((unused)), int events __attribute__((unused)),
+		void *ctx __attribute__((unused)))
+{
+	return job_wait_dispatch_events();
+}
+
+/* Tell the subscribers and the waiting requests about every state change */
+static void
+job_state_changed(job_id_t id, enum job_state state)
+{
+	subscription_publish_state(id, state);
+	job_wait_notify(id, state);
+}
+
+/* Mirror the job table into the status page */
+static void
+job_table_entry_changed(const struct job_table_entry *jte, bool removed)
+{
+	struct status_page_slot status;
+
+	if (removed) {
+		status_page_remove(jte->jte_label);
+		return;
+	}
+	memset(&status, 0, sizeof(status));
+	status.job_id = jte->jte_id;
+	strncpy(status.label, jte->jte_label, sizeof(status.label) - 1);
+	strncpy(status.state, job_state_to_str(jte->state), sizeof(status.state) - 1);
+	status.pid = (int32_t) jte->pid;
+	status.restarts = jte->restarts;
+	if (jte->terminfo.ti_event == TERMINFO_EXIT)
+		status.last_exit = STATUS_PAGE_EXITED;
+	else if (jte->terminfo.ti_event == TERMINFO_SIGNAL)
+		status.last_exit = STATUS_PAGE_SIGNALED;
+	else
+		status.last_exit = STATUS_PAGE_NEVER_RAN;
+	status.last_status = jte->terminfo.ti_data;
+	status.last_exit_time = jte->terminfo.ti_timestamp;
+	status_page_update(&status);
+}
+
+/* Wait for up to REAP_BATCH_MAX children, without looking at the database */
+static size_t
+collect_exited_children(struct exited_child *batch)
+{
+	struct job_table_entry *jte;
+	siginfo_t si;
+	size_t n;
+
+	for (n = 0; n < REAP_BATCH_MAX; n++) {
+		/* Peek first, so the owner of an orphan can be found while it is still a zombie */
+		si.si_pid = 0;
+		if (waitid(P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT) < 0 || si.si_pid == 0)
 			break;
+		/* Only orphans and helpers are missing from the job table; ask /proc about those */
+		jte = job_table_lookup_by_pid(si.si_pid);
+		if (jte != NULL) {
+			strncpy(batch[n].owner, jte->jte_label, sizeof(batch[n].owner) - 1);
+			batch[n].owner[sizeof(batch[n].owner) - 1] = '\0';
+		} else if (cgroup_get_label_by_pid(batch[n].owner, sizeof(batch[n].owner), si.si_pid) < 0) {
+			batch[n].owner[0] = '\0';
 		}
+		batch[n].pid = wait4(si.si_pid, &batch[n].status, WNOHANG, &batch[n].usage);
+		if (batch[n].pid <= 0)
+			break;
 	}
+	return (n);
+}
+
+static void
+sigchld_handler(int signum __attribute__((unused)))
+{
+	static struct exited_child batch[REAP_BATCH_MAX];
+	bool in_transaction;
+	size_t i, n;
+
+	do {
+		n = collect_exited_children(batch);
+		if (n == 0)
+			break;
+		printlog(LOG_DEBUG, "reaping %zu child(ren)", n);
+
+		/* Record every exit in a single transaction, instead of one per statement */
+		in_transaction = sqlite3_get_autocommit(dbh) && db_exec(dbh, "BEGIN TRANSACTION") == 0;
+		for (i = 0; i < n; i++)
+			reaper(batch[i].pid, batch[i].status, &batch[i].usage, batch[i].owner);
+		if (in_transaction && db_exec(dbh, "COMMIT") < 0) {
+			printlog(LOG_ERR, "unable to commit the exit status of %zu child(ren)", n);
+			(void) db_exec(dbh, "ROLLBACK");
+			/* The children are gone, so their exits cannot be recorded again */
+			for (i = 0; i < n; i++)
+				printlog(LOG_ERR, "lost the exit record of pid %d%s%s", (int) batch[i].pid,
+				    batch[i].owner[0] ? " of job " : "", batch[i].owner);
+			/* What reaper() cached no longer matches the database */
+			job_status_invalidate();
+			if (job_status_load() < 0)
+				printlog(LOG_ERR, "unable to reload the status of the jobs");
+		}
+	} while (n == REAP_BATCH_MAX);
 }
 
-/* TODO: for each job, spawn a dedicated subreaper process.
-   Right now, this only serves the purpose of documenting orphan
-   processes in the logs */
+/* Orphans are reparented to jobd, so they can be attributed to the
+   cgroup of the job that created them. Without cgroups, this only
+   serves the purpose of documenting orphan processes in the logs */
 static void
 become_a_subreaper(void)
 {
@@ -503,14 +1128,18 @@ main(int argc, char *argv[])
 	pid_t pid;
 	int c, fd, daemon, verbose;
 	int trace = 0;
+	const char *event_backend = NULL;
 
 	pid = getpid();
 	verbose = (pid == 1);
 	daemon = (pid != 1);
 
 	progname = basename(argv[0]);
-    while ((c = getopt(argc, argv, "fhv")) != -1) {
+    while ((c = getopt(argc, argv, "e:fhv")) != -1) {
         switch (c) {
+            case 'e':
+                event_backend = optarg;
+                break;
             case 'f':
                 daemon = 0;
                 break;
@@ -587,15 +1216,79 @@ main(int argc, char *argv[])
 
 	become_a_subreaper();
 
+	if (cgroup_init() < 0)
+		crash("unable to initialize cgroups");
+
+	struct runner_callbacks runner_cb = {
+	        .on_done = shared_task_done,
+	        .watch = runner_watch,
+	        .unwatch = event_unwatch,
+	};
+	if (runner_init(&runner_cb) < 0)
+		crash("unable to initialize the shared runner");
+
+	if (job_output_init() < 0)
+		crash("unable to initialize output capture");
+
+	job_set_state_observer(&job_state_changed);
+
+	struct job_spawn_callbacks spawn_cb = {
+	        .watch = spawn_watch,
+	        .unwatch = event_unwatch,
+	        .on_start_aborted = job_start_aborted,
+	};
+	job_set_spawn_callbacks(&spawn_cb);
+
+	if (status_page_init() < 0)
+		printlog(LOG_WARNING, "unable to publish the status page");
+	job_table_set_observer(&job_table_entry_changed);
+	if (job_status_load() < 0)
+		printlog(LOG_WARNING, "unable to load the status of the jobs");
+
+	if (job_wait_init() < 0)
+		crash("unable to initialize job_wait");
+
+	if (worker_pool_init() < 0)
+		crash("unable to start the worker threads");
+	if (db_checkpoint_in_background(worker_pool_submit, event_loop_defer) < 0)
+		printlog(LOG_WARNING, "the database will be checkpointed on the event loop");
+
 	struct event_loop_options elopt = {
 	        .daemon = 0,
 	        .signal_handlers = signal_handlers,
+	        .backend = event_backend,
 	};
 	if (event_loop_init(elopt) < 0)
 	    crash("event_loop_init");
 
-	if (event_loop_register_callback(ipc_get_sockfd(), &ipc_server_handler) < 0)
-		crash("event_loop_register_callback");
+	if (!event_loop_add(ipc_get_sockfd(), EVENT_READ, &ipc_server_handler, NULL, "ipc"))
+		crash("event_loop_add");
+
+	if (!event_loop_add(ipc_get_listen_fd(), EVENT_READ, &ipc_listen_handler, NULL, "ipc"))
+		crash("event_loop_add");
+
+	if (cgroup_enabled() &&
+	    !event_loop_add(cgroup_get_notify_fd(), EVENT_READ, &cgroup_event_handler, NULL, "cgroup"))
+		crash("event_loop_add");
+
+	if (cgroup_enabled() &&
+	    !event_loop_add(cgroup_get_poll_fd(), EVENT_READ, &cgroup_poll_handler, NULL, "cgroup"))
+		crash("event_loop_add");
+
+	if (!event_loop_add(runner_get_status_fd(), EVENT_READ, &runner_event_handler, NULL, "runner"))
+		crash("event_loop_add");
+
+	if (job_output_get_fd() >= 0 &&
+	    !event_loop_add(job_output_get_fd(), EVENT_READ, &job_output_event_handler, NULL, "output"))
+		crash("event_loop_add");
+
+	if (worker_pool_get_fd() >= 0 &&
+	    !event_loop_add(worker_pool_get_fd(), EVENT_READ, &worker_pool_event_handler, NULL, "workers"))
+		crash("event_loop_add");
+
+	if (job_wait_get_fd() >= 0 &&
+	    !event_loop_add(job_wait_get_fd(), EVENT_READ, &job_wait_event_handler, NULL, "waiters"))
+		crash("event_loop_add");
 
 	(void)kill(getpid(), SIGHUP);
 
@@ -21,12 +21,17 @@
 
 #include "config.h"
 #include "database.h"
+#include "ipc.h"
 #include "job.h"
+#include "libjobd.h"
 #include "logger.h"
 
 static char *progname;
 static int H_flag;
 
+/* NULL if jobd is not running */
+static struct jobd_client *client;
+
 static void
 usage(void)
 {
@@ -89,6 +94,110 @@ print_all_properties(void)
 	return (0);
 }
 
+static void
+open_database(void)
+{
+    logger_add_stderr_appender();
+
+    if (db_init() < 0)
+        errx(1, "logger_init");
+
+    if (db_open(NULL, 0))
+        errx(1, "db_open");
+}
+
+/*
+ * Ask jobd for the properties of every job. Returns 1 if jobd could not be
+ * asked, and nothing was printed.
+ */
+static int
+print_all_properties_from_jobd(sqlite3 *memdb)
+{
+	sqlite3_stmt *stmt = NULL;
+	const char *sql = "SELECT json_extract(?1, '$.total'), json_extract(value, '$.label') "
+	                  "FROM json_each(?1, '$.jobs')";
+	char *page = NULL, *props = NULL, *query = NULL, *err_msg = NULL;
+	size_t offset = 0, count, total = 0;
+	char offset_str[24];
+	const struct jobd_param list_params[] = {
+		{ "job_id", "" }, { "states", "" }, { "sort", "" }, { "offset", offset_str }, { "limit", "0" },
+	};
+	int rv = -1;
+
+	if (sqlite3_prepare_v2(memdb, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return printlog(LOG_ERR, "unable to prepare a query");
+	do {
+		snprintf(offset_str, sizeof(offset_str), "%zu", offset);
+		if (jobd_call(client, &page, "list", list_params, 5) != IPC_RESPONSE_OK) {
+			rv = (offset == 0 ? 1 : -1);
+			goto out;
+		}
+		if (sqlite3_bind_text(stmt, 1, page, -1, SQLITE_STATIC) != SQLITE_OK)
+			goto out;
+		for (count = 0; sqlite3_step(stmt) == SQLITE_ROW; count++) {
+			const char *label = (const char *) sqlite3_column_text(stmt, 1);
+			const struct jobd_param params[] = { { "job_id", label } };
+
+			total = (size_t) sqlite3_column_int64(stmt, 0);
+			if (jobd_call(client, &props, "properties", params, 1) != IPC_RESPONSE_OK) {
+				printlog(LOG_ERR, "unable to get the properties of %s", label);
+				goto out;
+			}
+			query = sqlite3_mprintf("SELECT %Q AS Job, key AS Property, value AS Value FROM json_each(%Q)",
+			        label, props);
+			if (!query || sqlite3_exec(memdb, query, renderer, NULL, &err_msg) != SQLITE_OK) {
+				printlog(LOG_ERR, "Database error: %s", err_msg ? err_msg : "out of memory");
+				goto out;
+			}
+			sqlite3_free(query);
+			query = NULL;
+			free(props);
+			props = NULL;
+		}
+		sqlite3_reset(stmt);
+		free(page);
+		page = NULL;
+		offset += count;
+	} while (count > 0 && offset < total);
+	rv = 0;
+
+out:
+	sqlite3_free(err_msg);
+	sqlite3_free(query);
+	free(props);
+	free(page);
+	sqlite3_finalize(stmt);
+	return (rv);
+}
+
+/* Returns 1 if jobd could not be asked */
+static int
+get_property_from_jobd(sqlite3 *memdb, const char *label, const char *property)
+{
+	sqlite3_stmt *stmt = NULL;
+	const struct jobd_param params[] = { { "job_id", label } };
+	char *props = NULL;
+	int rv;
+
+	rv = jobd_call(client, &props, "properties", params, 1);
+	if (rv < 0)
+		return (1);
+	if (rv == IPC_RESPONSE_NOT_FOUND)
+		errx(1, "job not found: %s", label);
+	if (rv != IPC_RESPONSE_OK)
+		errx(1, "error getting property");
+	if (sqlite3_prepare_v2(memdb, "SELECT value FROM json_each(?) WHERE key = ?", -1, &stmt, NULL) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 1, props, -1, SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, property, -1, SQLITE_STATIC) != SQLITE_OK)
+		errx(1, "unable to prepare a query");
+	if (sqlite3_step(stmt) != SQLITE_ROW)
+		errx(1, "property does not exist");
+	puts((const char *) sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+	free(props);
+	return (0);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -115,21 +224,28 @@ main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (argc == 0 || argc > 1) {
+    if (argc != (a_flag ? 0 : 1)) {
         usage();
     }
 
     if (logger_init() < 0)
         errx(1, "logger_init");
-    logger_add_stderr_appender();
-
-    if (db_init() < 0)
-        errx(1, "logger_init");
-
-    if (db_open(NULL, 0))
-        errx(1, "db_open");
 
+    /* Read from jobd if it is running, and from the database otherwise */
+    sqlite3 *memdb = NULL;
+    if (jobd_open(&client, NULL) < 0 || sqlite3_open(":memory:", &memdb) != SQLITE_OK) {
+        sqlite3_close(memdb);
+        memdb = NULL;
+    }
     if (a_flag) {
+        if (memdb) {
+            int rv = print_all_properties_from_jobd(memdb);
+            if (rv < 0)
+                errx(1, "unable to list the properties");
+            if (rv == 0)
+                exit(EXIT_SUCCESS);
+        }
+        open_database();
         if (print_all_properties() < 0)
             exit(EXIT_FAILURE);
         else
@@ -158,6 +274,10 @@ main(int argc, char *argv[])
         errx(1, "invalid property name");
     }
 
+    if (!val && memdb && get_property_from_jobd(memdb, label, property) == 0)
+        exit(EXIT_SUCCESS);
+    open_database();
+
     /* Lookup the job ID */
     char *result = NULL;
     int64_t jid;
@@ -168,8 +288,7 @@ main(int argc, char *argv[])
 
     /* Get or set the value of the property */
     if (val) {
-        // FIXME - should probably use IPC to have jobd make the actual change
-        // or notify jobd after we make the change.
+        /* jobd notices the commit, and rebuilds any cached method scripts of the job */
         if (job_set_property(jid, property, val) < 0)
             errx(1, "error setting property");
     } else {
@@ -18,18 +18,23 @@
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "config.h"
 #include "database.h"
+#include "ipc.h"
 #include "job.h"
+#include "libjobd.h"
 #include "logger.h"
+#include "status_page.h"
 
 static char *progname;
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s\n", progname);
+	fprintf(stderr, "usage: %s [-r | -u]\n"
+	                "       %s -p [label]\n", progname, progname);
 	exit(EXIT_FAILURE);
 }
 
@@ -39,15 +44,17 @@ void print_header(const char *str, const char *specifier) {
 	printf(buf, str);
 }
 
+static const char *job_specifiers[] = {"%-4s", "%-18s", "%-11s", "%-8s", "%-10s", "%-8s"};
+static const char *run_specifiers[] = {"%-4s", "%-18s", "%-6s", "%-8s", "%-6s", "%-8s", "%-8s"};
+static const char *page_specifiers[] = {"%-18s", "%-11s", "%-8s", "%-8s", "%-10s"};
+static const char *usage_specifiers[] = {"%-4s", "%-18s", "%-8s", "%-8s", "%-8s", "%-8s", "%-8s", "%-8s"};
+
 static int
-renderer(void *unused, int cols, char **values, char **names)
+renderer(void *arg, int cols, char **values, char **names)
 {
 	int i;
 	static int print_headers = 1;
-	const char *specifiers[] = {"%-4s", "%-18s", "%-9s", "%-8s", "%-10s", "%-8s"};
-
-	//printf("%s",(char *)unused);
-	(void)unused;
+	const char **specifiers = arg;
 
 	if (print_headers) {
 		for (i = 0; i < cols; i++) {
@@ -76,7 +83,169 @@ print_all_jobs(void)
 	char *sql = "SELECT Id, Label, State, Type, Terminated, Duration FROM job_table_view";
 	char *err_msg = NULL;
 
-	rv = sqlite3_exec(dbh, sql, renderer, "some stuff", &err_msg);
+	rv = sqlite3_exec(dbh, sql, renderer, job_specifiers, &err_msg);
+	if (rv != SQLITE_OK) {
+		printlog(LOG_ERR, "Database error %d: %s", rv, err_msg);
+		free(err_msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* The columns of job_table_view, from the result of the list method */
+static const char list_sql[] =
+	"SELECT json_extract(value, '$.id') AS ID, json_extract(value, '$.label') AS Label, "
+	"       json_extract(value, '$.state') AS State, json_extract(value, '$.type') AS \"Type\", "
+	"       json_extract(value, '$.terminated') AS Terminated, "
+	"       json_extract(value, '$.duration') || 's' AS Duration "
+	"FROM json_each(%Q, '$.jobs')";
+
+struct list_stream {
+	FILE *fp;
+	int retcode;
+};
+
+static int
+append_chunk(void *ctx, const char *data, size_t len)
+{
+	return (fwrite(data, 1, len, ((struct list_stream *) ctx)->fp) == len ? 0 : -1);
+}
+
+static void
+list_done(void *ctx, int retcode, const char *result __attribute__((unused)))
+{
+	((struct list_stream *) ctx)->retcode = retcode;
+}
+
+/*
+ * Ask jobd for the jobs, streamed over a connection so that the list can be
+ * longer than one IPC message. Returns 1 if jobd could not be asked, and
+ * nothing was printed.
+ */
+static int
+print_all_jobs_from_jobd(void)
+{
+	struct jobd_client *client;
+	struct list_stream ls = { NULL, JOBD_DISCONNECTED };
+	sqlite3 *memdb = NULL;
+	char *list = NULL, *sql = NULL, *err_msg = NULL;
+	size_t len;
+	int rv = -1;
+
+	if (jobd_open(&client, NULL) < 0)
+		return (1);
+	ls.fp = open_memstream(&list, &len);
+	if (!ls.fp) {
+		jobd_close(client);
+		return (1);
+	}
+	if (jobd_request_stream(client, "", "list", append_chunk, list_done, &ls) == 0) {
+		while (jobd_pending(client) > 0 && jobd_wait(client, -1) == 0)
+			;
+	}
+	jobd_close(client);
+	if (fclose(ls.fp) != 0 || ls.retcode != IPC_RESPONSE_OK) {
+		free(list);
+		return (1);
+	}
+
+	rv = -1;
+	sql = sqlite3_mprintf(list_sql, list);
+	if (sqlite3_open(":memory:", &memdb) != SQLITE_OK) {
+		printlog(LOG_ERR, "unable to open an in-memory database");
+		goto out;
+	}
+	if (!sql || sqlite3_exec(memdb, sql, renderer, job_specifiers, &err_msg) != SQLITE_OK) {
+		printlog(LOG_ERR, "Database error: %s", err_msg ? err_msg : "out of memory");
+		goto out;
+	}
+	rv = 0;
+
+out:
+	sqlite3_free(err_msg);
+	sqlite3_free(sql);
+	free(list);
+	sqlite3_close(memdb);
+	return (rv);
+}
+
+static void
+render_slot(const struct status_page_slot *slot)
+{
+	static char *names[] = {"Label", "State", "PID", "Restarts", "Last exit"};
+	char pid[16], restarts[16], last_exit[32];
+	char *values[] = {(char *) slot->label, (char *) slot->state, pid, restarts, last_exit};
+
+	snprintf(pid, sizeof(pid), "%d", slot->pid);
+	snprintf(restarts, sizeof(restarts), "%u", slot->restarts);
+	if (slot->last_exit == STATUS_PAGE_EXITED)
+		snprintf(last_exit, sizeof(last_exit), "exit(%d)", slot->last_status);
+	else if (slot->last_exit == STATUS_PAGE_SIGNALED)
+		snprintf(last_exit, sizeof(last_exit), "kill(%d)", slot->last_status);
+	else
+		strcpy(last_exit, "-");
+	(void) renderer(page_specifiers, 5, values, names);
+}
+
+/*
+ * Read the status page of jobd, without asking it or opening the database.
+ * Returns 1 if a label was given but is not on the page.
+ */
+static int
+print_status_page(const char *label)
+{
+	const struct status_page *page;
+	struct status_page_slot slot;
+	uint32_t i;
+	int rv = 0;
+
+	if (status_page_open(&page) < 0)
+		return (-1);
+	if (label) {
+		rv = status_page_lookup(page, label, &slot);
+		if (rv == 0)
+			render_slot(&slot);
+	} else {
+		for (i = 0; i < page->slot_count && rv >= 0; i++) {
+			rv = status_page_read(page, i, &slot);
+			if (rv == 0)
+				render_slot(&slot);
+		}
+		if (rv > 0)
+			rv = 0;
+	}
+	status_page_close(page);
+	return (rv);
+}
+
+/* How often each job ran, failed and flapped; durations are shown in milliseconds */
+int
+print_run_stats(void)
+{
+	int rv;
+	char *sql = "SELECT ID, Label, Runs, Failures, Flaps, P50, P95 FROM job_run_stats_view";
+	char *err_msg = NULL;
+
+	rv = sqlite3_exec(dbh, sql, renderer, run_specifiers, &err_msg);
+	if (rv != SQLITE_OK) {
+		printlog(LOG_ERR, "Database error %d: %s", rv, err_msg);
+		free(err_msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* The resources used by the last run of each job, heaviest first */
+int
+print_usage(void)
+{
+	int rv;
+	char *sql = "SELECT * FROM job_usage_view";
+	char *err_msg = NULL;
+
+	rv = sqlite3_exec(dbh, sql, renderer, usage_specifiers, &err_msg);
 	if (rv != SQLITE_OK) {
 		printlog(LOG_ERR, "Database error %d: %s", rv, err_msg);
 		free(err_msg);
@@ -89,16 +258,28 @@ print_all_jobs(void)
 int
 main(int argc, char *argv[])
 {
-	int c;
+	int c, rv;
+	int show_runs = 0;
+	int show_usage = 0;
+	int show_page = 0;
 
     progname = basename(argv[0]);
-    while ((c = getopt(argc, argv, "fhv")) != -1) {
+    while ((c = getopt(argc, argv, "fhpruv")) != -1) {
         switch (c) {
             case 'f':
                 break;
             case 'h':
                 usage();
                 break;
+            case 'p':
+                show_page = 1;
+                break;
+            case 'r':
+                show_runs = 1;
+                break;
+            case 'u':
+                show_usage = 1;
+                break;
             case 'v':
                 break;
             default:
@@ -110,12 +291,27 @@ main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (argc != 0) {
+    if (argc > (show_page ? 1 : 0)) {
         usage();
     }
 
 	if (logger_init() < 0)
 		errx(1, "logger_init");
+
+	if (show_page) {
+		logger_add_stderr_appender();
+		rv = print_status_page(argc > 0 ? argv[0] : NULL);
+		exit(rv == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	/* Only fall back to reading the database when jobd is not running */
+	if (!show_runs && !show_usage) {
+		rv = print_all_jobs_from_jobd();
+		if (rv < 0)
+			errx(1, "unable to list the jobs");
+		if (rv == 0)
+			exit(EXIT_SUCCESS);
+	}
 	logger_add_stderr_appender();
 	
 	if (db_init() < 0)
@@ -124,7 +320,13 @@ main(int argc, char *argv[])
 	if (db_open(NULL, 0))
 		errx(1, "db_open");
 
-	if (print_all_jobs() < 0)
+	if (show_runs)
+		rv = print_run_stats();
+	else if (show_usage)
+		rv = print_usage();
+	else
+		rv = print_all_jobs();
+	if (rv < 0)
 		exit(EXIT_FAILURE);
 		
 	exit(EXIT_SUCCESS);
@@ -18,8 +18,10 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sqlite3.h>
 
 #include "logger.h"
 #include "memory.h"
@@ -76,27 +78,6 @@ struct jsonrpc_request *jsonrpc_request_new(const char *id, const char *method,
     return (req);
 }
 
-void jsonrpc_request_free(struct jsonrpc_request *req)
-{
-    if (req) {
-        free(req->id);
-        free(req->method);
-        for (uint32_t i = 0; i < req->nparams; i++) {
-            free(req->param_name[i]);
-            free(req->param_value[i]);
-        }
-        free(req);
-    }
-}
-
-void jsonrpc_request_destroy(struct jsonrpc_request **req)
-{
-    if (req) {
-        jsonrpc_request_free(*req);
-        *req = NULL;
-    }
-}
-
 
 // FIXME: only supports keyword parameters, not a list.
 // FIXME: does not support nested data structures in params
@@ -196,6 +177,28 @@ next_row:
     return 0;
 }
 
+int
+jsonrpc_request_parse_id(char **id, const char *buf, int bytes)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *value;
+
+    *id = NULL;
+    const char *sql = "SELECT CASE WHEN json_valid(?1) THEN json_extract(?1, '$.id') END";
+    if (sqlite3_prepare_v2(memdbh, sql, -1, &stmt, 0) != SQLITE_OK)
+        return printlog(LOG_ERR, "prepare failed");
+    if (sqlite3_bind_text(stmt, 1, buf, bytes, SQLITE_STATIC) != SQLITE_OK)
+        return printlog(LOG_ERR, "bind_text failed");
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+        return db_error;
+    if ((value = (const char *) sqlite3_column_text(stmt, 0))) {
+        *id = strdup(value);
+        if (!*id)
+            return printlog(LOG_ERR, "strdup(2): %s", strerror(errno));
+    }
+    return 0;
+}
+
 const char *jsonrpc_request_param(const struct jsonrpc_request *req, const char *name)
 {
     assert(req);
@@ -275,28 +278,6 @@ struct jsonrpc_response *jsonrpc_response_new(const char *id)
     return res;
 }
 
-void jsonrpc_response_free(struct jsonrpc_response *res)
-{
-    if (res) {
-        if (res->result) {
-            free(res->result);
-        } else {
-            free(res->error.message);
-            free(res->error.data);
-        }
-        free(res->id);
-        free(res);
-    }
-}
-
-void jsonrpc_response_destroy(struct jsonrpc_response **res)
-{
-    if (res && *res) {
-        jsonrpc_response_free(*res);
-        *res = NULL;
-    }
-}
-
 int jsonrpc_response_set_result(struct jsonrpc_response *res, const char *result)
 {
     if (res->error.code != 0)
@@ -319,6 +300,16 @@ int jsonrpc_response_set_error(struct jsonrpc_response *res, int retcode, const
     return 0;
 }
 
+int jsonrpc_response_set_error_data(struct jsonrpc_response *res, const char *data)
+{
+    if (res->error.data)
+        return -1;
+    res->error.data = strdup(data);
+    if (!res->error.data)
+        return -1;
+    return 0;
+}
+
 // Caller must free result
 int jsonrpc_response_serialize(char **result, const struct jsonrpc_response *res)
 {
@@ -336,8 +327,8 @@ int jsonrpc_response_serialize(char **result, const struct jsonrpc_response *res
     if (res->error.code == 0) {
         strncat(sql, "'result', ?)", sizeof(sql) - 1);
     } else {
-        //NOTE: data field not implemented yet
-        strncat(sql, "'error', json_object('code', ?, 'message', ?))", sizeof(sql) - 1);
+        strncat(sql, res->error.data ? "'error', json_object('code', ?, 'message', ?, 'data', ?))"
+                : "'error', json_object('code', ?, 'message', ?))", sizeof(sql) - 1);
     }
     sql[sizeof(sql) - 1] = '\0';
 
@@ -354,6 +345,9 @@ int jsonrpc_response_serialize(char **result, const struct jsonrpc_response *res
             return db_error;
         if (sqlite3_bind_text(stmt, bindidx++, res->error.message, -1, SQLITE_STATIC) != SQLITE_OK)
             return db_error;
+        if (res->error.data &&
+                sqlite3_bind_text(stmt, bindidx++, res->error.data, -1, SQLITE_STATIC) != SQLITE_OK)
+            return db_error;
     }
 
     switch (sqlite3_step(stmt)) {
@@ -371,6 +365,62 @@ int jsonrpc_response_serialize(char **result, const struct jsonrpc_response *res
     return 0;
 }
 
+size_t
+jsonrpc_escape(char *buf, size_t size, const char *str)
+{
+    const unsigned char *p;
+    char esc[8];
+    size_t len = 0, end = 0, n;
+
+    for (p = (const unsigned char *) str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char) *p;
+            n = 2;
+        } else if (*p < 0x20) {
+            n = (size_t) snprintf(esc, sizeof(esc), "\\u%04x", *p);
+        } else {
+            esc[0] = (char) *p;
+            n = 1;
+        }
+        /* Stop at the first escape that does not fit, rather than splitting it */
+        if (end == len && len + n < size) {
+            memcpy(buf + len, esc, n);
+            end += n;
+        }
+        len += n;
+    }
+    if (size > 0)
+        buf[end] = '\0';
+    return (len);
+}
+
+// Caller must free result
+int
+jsonrpc_chunk_serialize(char **result, const char *id, uint32_t seq, const char *data)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql = "SELECT json_object('jsonrpc', '2.0', 'id', ?, 'chunk', json_object('seq', ?, 'data', ?))";
+
+    assert(initialized);
+    *result = NULL;
+    if (sqlite3_prepare_v2(memdbh, sql, -1, &stmt, 0) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_bind_int64(stmt, 2, seq) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_bind_text(stmt, 3, data, -1, SQLITE_STATIC) != SQLITE_OK)
+        return db_error;
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+        return db_error;
+    *result = strdup((char *) sqlite3_column_text(stmt, 0));
+    if (!*result)
+        return printlog(LOG_ERR, "strdup");
+
+    return 0;
+}
+
 int
 jsonrpc_response_parse(struct jsonrpc_response **dest, const char *buf, int bytes)
 {
@@ -421,9 +471,24 @@ next_row:
                     res->error.message = strdup(value);
                     if (!res->error.message)
                         return printlog(LOG_ERR, "strdup: %s", strerror(errno));
+                } else if (!strcmp(key, "data")) {
+                    res->error.data = strdup(value);
+                    if (!res->error.data)
+                        return printlog(LOG_ERR, "strdup: %s", strerror(errno));
                 } else {
                     return printlog(LOG_ERR, "unexpected error key");
                 }
+            } else if (!strcmp(path, "$.chunk")) {
+                res->chunk = true;
+                if (!strcmp(key, "seq")) {
+                    res->seq = (uint32_t) sqlite3_column_int64(stmt, 1);
+                } else if (!strcmp(key, "data")) {
+                    res->result = strdup(value);
+                    if (!res->result)
+                        return printlog(LOG_ERR, "strdup: %s", strerror(errno));
+                } else {
+                    return printlog(LOG_ERR, "unexpected chunk key");
+                }
             } else {
                 return printlog(LOG_ERR, "unhandled path: %s", path);
             }
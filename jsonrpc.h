@@ -17,8 +17,10 @@
 #ifndef _JSONRPC_H
 #define _JSONRPC_H
 
-#include <sqlite3.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #define IPC_REQUEST_PARAM_MAX 8
 struct jsonrpc_request {
@@ -30,33 +32,90 @@ struct jsonrpc_request {
 };
 
 struct jsonrpc_response {
-    char *result;
+    char *result;       /* For a chunk, its data */
     struct {
         int code;
         char *message;
         char *data;
     } error;
     char *id;
+    bool chunk;         /* One piece of a streamed result; see ipc.h */
+    uint32_t seq;       /* Of the chunk, counting from 0 */
 };
 
 int jsonrpc_init(void);
 void jsonrpc_shutdown(void);
 struct jsonrpc_request * jsonrpc_request_new(const char *id, const char *method, uint32_t nparams, ...);
 int jsonrpc_request_parse(struct jsonrpc_request **dest, const char *buf, int bytes);
+/* The id of a request that could not be parsed, if it has one; caller must free */
+int jsonrpc_request_parse_id(char **id, const char *buf, int bytes);
 int jsonrpc_request_serialize(char **result, const struct jsonrpc_request *req);
 const char *jsonrpc_request_param(const struct jsonrpc_request *req, const char *name);
-void jsonrpc_request_free(struct jsonrpc_request *req);
-void jsonrpc_request_destroy(struct jsonrpc_request **req);
+
+/* Inline, so that libjobd can free what ipc_frame.c decodes without linking jsonrpc.c */
+static inline void
+jsonrpc_request_free(struct jsonrpc_request *req)
+{
+    if (req) {
+        free(req->id);
+        free(req->method);
+        for (uint32_t i = 0; i < req->nparams; i++) {
+            free(req->param_name[i]);
+            free(req->param_value[i]);
+        }
+        free(req);
+    }
+}
+
+static inline void
+jsonrpc_request_destroy(struct jsonrpc_request **req)
+{
+    if (req) {
+        jsonrpc_request_free(*req);
+        *req = NULL;
+    }
+}
 #define CLEANUP_JSONRPC_REQUEST __attribute__((__cleanup__(jsonrpc_request_destroy)))
 
 
 struct jsonrpc_response * jsonrpc_response_new(const char *id);
 int jsonrpc_response_parse(struct jsonrpc_response **dest, const char *buf, int bytes);
-void jsonrpc_response_free(struct jsonrpc_response *res);
-void jsonrpc_response_destroy(struct jsonrpc_response **res);
+
+static inline void
+jsonrpc_response_free(struct jsonrpc_response *res)
+{
+    if (res) {
+        free(res->result);
+        free(res->error.message);
+        free(res->error.data);
+        free(res->id);
+        free(res);
+    }
+}
+
+static inline void
+jsonrpc_response_destroy(struct jsonrpc_response **res)
+{
+    if (res && *res) {
+        jsonrpc_response_free(*res);
+        *res = NULL;
+    }
+}
 int jsonrpc_response_set_result(struct jsonrpc_response *res, const char *result);
 int jsonrpc_response_set_error(struct jsonrpc_response *res, int retcode, const char *message);
+/* The data member of the error, as a string like the result */
+int jsonrpc_response_set_error_data(struct jsonrpc_response *res, const char *data);
 int jsonrpc_response_serialize(char **result, const struct jsonrpc_response *res);
+int jsonrpc_chunk_serialize(char **result, const char *id, uint32_t seq, const char *data);
+
+/*
+ * Escape str for use inside a JSON string, without the quotes. Like
+ * snprintf(3), at most size bytes are written including the NUL, and the
+ * length of the whole escaped string is returned. Each byte becomes at most
+ * JSONRPC_ESCAPE_MAX bytes.
+ */
+#define JSONRPC_ESCAPE_MAX 6
+size_t jsonrpc_escape(char *buf, size_t size, const char *str);
 
 #define CLEANUP_JSONRPC_RESPONSE __attribute__((__cleanup__(jsonrpc_response_destroy)))
 
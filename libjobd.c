@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ipc.h"
+#include "ipc_frame.h"
+#include "libjobd.h"
+#include "logger.h"
+#include "queue.h"
+
+/* The library is built with hidden visibility, so only these are exported */
+#define LIBJOBD_API __attribute__((visibility("default")))
+
+/*
+ * Requests are sent as frames (see ipc_frame.h), so that responses can be
+ * decoded without a JSON parser.
+ */
+
+struct pending_request {
+    unsigned int id;
+    jobd_response_cb cb;
+    jobd_chunk_cb on_chunk;     /* Only for streamed requests */
+    void *ctx;
+    uint32_t next_seq;          /* Of the chunk that should come next */
+    bool failed;                /* A chunk went missing, or on_chunk failed */
+    TAILQ_ENTRY(pending_request) entries;
+};
+
+/* What jobd_call() is waiting for */
+struct call {
+    bool answered;
+    int retcode;
+    char *result;
+};
+
+/* A frame that could not be sent yet, because the socket buffer was full */
+struct queued_frame {
+    size_t len;
+    STAILQ_ENTRY(queued_frame) entries;
+    char buf[];
+};
+
+struct jobd_client {
+    int fd;             /* -1 once the connection is lost */
+    unsigned int next_id;
+    size_t pending_count;
+    jobd_event_cb on_event;
+    void *event_ctx;
+    TAILQ_HEAD(, pending_request) pending;
+    STAILQ_HEAD(, queued_frame) queued;
+};
+
+LIBJOBD_API int
+jobd_open(struct jobd_client **client, const char *path)
+{
+    char *default_path = NULL;
+    struct sockaddr_un saun;
+    struct jobd_client *c;
+
+    *client = NULL;
+    if (!path) {
+        if (asprintf(&default_path, "%s/%s/jobd-session.sock", compile_time_option.runstatedir,
+                compile_time_option.project_name) < 0)
+            return printlog(LOG_ERR, "asprintf(3): %s", strerror(errno));
+        path = default_path;
+    }
+    memset(&saun, 0, sizeof(saun));
+    saun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(saun.sun_path)) {
+        free(default_path);
+        return printlog(LOG_ERR, "socket path is too long");
+    }
+    strncpy(saun.sun_path, path, sizeof(saun.sun_path) - 1);
+    free(default_path);
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    TAILQ_INIT(&c->pending);
+    STAILQ_INIT(&c->queued);
+    c->next_id = 1;
+
+    c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        free(c);
+        return printlog(LOG_ERR, "socket(2): %s", strerror(errno));
+    }
+    if (connect(c->fd, (struct sockaddr *) &saun, sizeof(saun)) < 0) {
+        printlog(LOG_ERR, "connect(2) to %s: %s", saun.sun_path, strerror(errno));
+        goto err_out;
+    }
+    /* Only the connecting blocks */
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        printlog(LOG_ERR, "fcntl(2): %s", strerror(errno));
+        goto err_out;
+    }
+
+    *client = c;
+    return 0;
+
+err_out:
+    (void) close(c->fd);
+    free(c);
+    return -1;
+}
+
+/* Forget the connection, and fail everything that was waiting on it */
+static void
+disconnect(struct jobd_client *client)
+{
+    struct pending_request *pr;
+    struct queued_frame *qf;
+
+    if (client->fd >= 0) {
+        (void) close(client->fd);
+        client->fd = -1;
+    }
+    while ((qf = STAILQ_FIRST(&client->queued))) {
+        STAILQ_REMOVE_HEAD(&client->queued, entries);
+        free(qf);
+    }
+    while ((pr = TAILQ_FIRST(&client->pending))) {
+        TAILQ_REMOVE(&client->pending, pr, entries);
+        client->pending_count--;
+        if (pr->cb)
+            pr->cb(pr->ctx, JOBD_DISCONNECTED, NULL);
+        free(pr);
+    }
+}
+
+LIBJOBD_API void
+jobd_close(struct jobd_client *client)
+{
+    struct pending_request *pr;
+
+    if (!client)
+        return;
+    /* Nobody is left to hear about the requests that were dropped */
+    TAILQ_FOREACH(pr, &client->pending, entries)
+        pr->cb = NULL;
+    disconnect(client);
+    free(client);
+}
+
+LIBJOBD_API int
+jobd_fd(const struct jobd_client *client)
+{
+    return (client->fd);
+}
+
+LIBJOBD_API int
+jobd_events(const struct jobd_client *client)
+{
+    return (JOBD_READ | (STAILQ_EMPTY(&client->queued) ? 0 : JOBD_WRITE));
+}
+
+LIBJOBD_API size_t
+jobd_pending(const struct jobd_client *client)
+{
+    return (client->pending_count);
+}
+
+LIBJOBD_API void
+jobd_set_event_callback(struct jobd_client *client, jobd_event_cb cb, void *ctx)
+{
+    client->on_event = cb;
+    client->event_ctx = ctx;
+}
+
+/* Send as much of the queue as the socket will take */
+static int
+flush_queue(struct jobd_client *client)
+{
+    struct queued_frame *qf;
+
+    while ((qf = STAILQ_FIRST(&client->queued))) {
+        if (send(client->fd, qf->buf, qf->len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return printlog(LOG_ERR, "send(2): %s", strerror(errno));
+        }
+        STAILQ_REMOVE_HEAD(&client->queued, entries);
+        free(qf);
+    }
+    return 0;
+}
+
+static int
+send_frame(struct jobd_client *client, const char *buf, size_t len)
+{
+    struct queued_frame *qf;
+
+    if (STAILQ_EMPTY(&client->queued)) {
+        if (send(client->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+            return 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return printlog(LOG_ERR, "send(2): %s", strerror(errno));
+    }
+    qf = malloc(sizeof(*qf) + len);
+    if (!qf)
+        return printlog(LOG_ERR, "malloc(3): %s", strerror(errno));
+    qf->len = len;
+    memcpy(qf->buf, buf, len);
+    STAILQ_INSERT_TAIL(&client->queued, qf, entries);
+    return 0;
+}
+
+/* Send a request, and return what waits for its response, or NULL */
+static struct pending_request *
+send_request(struct jobd_client *client, const char *method, const struct jobd_param *params,
+        size_t nparams, jobd_chunk_cb on_chunk, jobd_response_cb cb, void *ctx)
+{
+    struct jsonrpc_request CLEANUP_JSONRPC_REQUEST *req = NULL;
+    struct pending_request *pr;
+    char frame[IPC_MAX_MSGLEN];
+    char idstr[16];
+    size_t len;
+
+    if (client->fd < 0) {
+        printlog(LOG_ERR, "the connection to jobd was lost");
+        return NULL;
+    }
+    if (nparams > IPC_REQUEST_PARAM_MAX) {
+        printlog(LOG_ERR, "too many parameters");
+        return NULL;
+    }
+
+    snprintf(idstr, sizeof(idstr), "%u", client->next_id);
+    req = calloc(1, sizeof(*req));
+    if (!req || !(req->id = strdup(idstr)) || !(req->method = strdup(method))) {
+        printlog(LOG_ERR, "unable to allocate request");
+        return NULL;
+    }
+    for (; req->nparams < nparams; req->nparams++) {
+        req->param_name[req->nparams] = strdup(params[req->nparams].name);
+        req->param_value[req->nparams] = strdup(params[req->nparams].value ? params[req->nparams].value : "");
+        if (!req->param_name[req->nparams] || !req->param_value[req->nparams]) {
+            req->nparams++;
+            printlog(LOG_ERR, "unable to allocate request");
+            return NULL;
+        }
+    }
+    if (ipc_frame_encode_request(frame, sizeof(frame), &len, req) < 0)
+        return NULL;
+
+    pr = calloc(1, sizeof(*pr));
+    if (!pr) {
+        printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        return NULL;
+    }
+    if (send_frame(client, frame, len) < 0) {
+        free(pr);
+        return NULL;
+    }
+    pr->id = client->next_id++;
+    pr->cb = cb;
+    pr->on_chunk = on_chunk;
+    pr->ctx = ctx;
+    TAILQ_INSERT_TAIL(&client->pending, pr, entries);
+    client->pending_count++;
+    return pr;
+}
+
+LIBJOBD_API int
+jobd_request_params(struct jobd_client *client, const char *method,
+        const struct jobd_param *params, size_t nparams, jobd_response_cb cb, void *ctx)
+{
+    return (send_request(client, method, params, nparams, NULL, cb, ctx) ? 0 : -1);
+}
+
+LIBJOBD_API int
+jobd_request(struct jobd_client *client, const char *job_id, const char *method,
+        jobd_response_cb cb, void *ctx)
+{
+    const struct jobd_param params[] = { { "job_id", job_id } };
+
+    return (jobd_request_params(client, method, params, 1, cb, ctx));
+}
+
+LIBJOBD_API int
+jobd_request_stream(struct jobd_client *client, const char *job_id, const char *method,
+        jobd_chunk_cb on_chunk, jobd_response_cb cb, void *ctx)
+{
+    const struct jobd_param params[] = { { "job_id", job_id }, { "stream", "1" } };
+
+    return (send_request(client, method, params, 2, on_chunk, cb, ctx) ? 0 : -1);
+}
+
+LIBJOBD_API int
+jobd_subscribe(struct jobd_client *client, const char *patterns, const char *states,
+        const char *events, jobd_response_cb cb, void *ctx)
+{
+    const struct jobd_param params[] = {
+        { "job_id", patterns },
+        { "states", states },
+        { "events", events },
+    };
+
+    return (jobd_request_params(client, "subscribe", params, 3, cb, ctx));
+}
+
+/* Pass on the next piece of a streamed result, unless an earlier one went wrong */
+static void
+handle_chunk(struct pending_request *pr, const struct jsonrpc_response *res)
+{
+    if (pr->failed)
+        return;
+    if (!pr->on_chunk || res->seq != pr->next_seq) {
+        printlog(LOG_ERR, "unexpected chunk %u of request %u", res->seq, pr->id);
+        pr->failed = true;
+        return;
+    }
+    pr->next_seq++;
+    if (res->result && pr->on_chunk(pr->ctx, res->result, strlen(res->result)) < 0)
+        pr->failed = true;
+}
+
+static void
+handle_message(struct jobd_client *client, const char *buf, size_t len)
+{
+    struct jsonrpc_response CLEANUP_JSONRPC_RESPONSE *res = NULL;
+    struct pending_request *pr;
+    unsigned int id;
+
+    if (ipc_frame_decode_response(&res, buf, len) < 0)
+        return;
+    if (!res->id) {
+        if (client->on_event)
+            client->on_event(client->event_ctx, res->result ? res->result : "{}");
+        return;
+    }
+
+    id = (unsigned int) strtoul(res->id, NULL, 10);
+    TAILQ_FOREACH(pr, &client->pending, entries) {
+        if (pr->id == id)
+            break;
+    }
+    if (!pr) {
+        printlog(LOG_ERR, "response to unknown request %u", id);
+        return;
+    }
+    if (res->chunk) {
+        handle_chunk(pr, res);
+        return;
+    }
+    TAILQ_REMOVE(&client->pending, pr, entries);
+    client->pending_count--;
+    if (pr->cb)
+        pr->cb(pr->ctx, pr->failed ? JOBD_STREAM_FAILED : res->error.code, res->result);
+    free(pr);
+}
+
+LIBJOBD_API int
+jobd_dispatch(struct jobd_client *client)
+{
+    char buf[IPC_MAX_MSGLEN + 1];
+    ssize_t bytes;
+
+    if (client->fd < 0)
+        return printlog(LOG_ERR, "the connection to jobd was lost");
+    if (flush_queue(client) < 0)
+        goto lost;
+    /* A callback may have lost the connection by making a request */
+    while (client->fd >= 0) {
+        bytes = recv(client->fd, buf, IPC_MAX_MSGLEN, MSG_DONTWAIT | MSG_TRUNC);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            printlog(LOG_ERR, "recv(2): %s", strerror(errno));
+            goto lost;
+        }
+        if (bytes == 0) {
+            printlog(LOG_ERR, "jobd closed the connection");
+            goto lost;
+        }
+        /* The response it carried can no longer be matched to its request */
+        if ((size_t) bytes > IPC_MAX_MSGLEN) {
+            printlog(LOG_ERR, "message of %zd bytes is too long", bytes);
+            goto lost;
+        }
+        buf[bytes] = '\0';
+        handle_message(client, buf, (size_t) bytes);
+    }
+    return (client->fd >= 0 ? 0 : -1);
+
+lost:
+    disconnect(client);
+    return -1;
+}
+
+LIBJOBD_API int
+jobd_wait(struct jobd_client *client, int timeout_ms)
+{
+    struct pollfd pfd;
+
+    if (client->fd < 0)
+        return printlog(LOG_ERR, "the connection to jobd was lost");
+    pfd.fd = client->fd;
+    pfd.events = POLLIN | (STAILQ_EMPTY(&client->queued) ? 0 : POLLOUT);
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+        return printlog(LOG_ERR, "poll(2): %s", strerror(errno));
+    return (jobd_dispatch(client));
+}
+
+static void
+call_response(void *ctx, int retcode, const char *result)
+{
+    struct call *call = ctx;
+
+    call->answered = true;
+    call->retcode = retcode;
+    if (result && !(call->result = strdup(result)))
+        call->retcode = printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+}
+
+LIBJOBD_API int
+jobd_call(struct jobd_client *client, char **result, const char *method,
+        const struct jobd_param *params, size_t nparams)
+{
+    struct call call = { false, 0, NULL };
+    struct pending_request *pr;
+
+    if (result)
+        *result = NULL;
+    pr = send_request(client, method, params, nparams, NULL, call_response, &call);
+    if (!pr)
+        return -1;
+    while (!call.answered) {
+        /* Once the connection is lost, the request has been answered with JOBD_DISCONNECTED */
+        if (jobd_wait(client, -1) < 0 && !call.answered) {
+            /* The request outlives the call, so its response must not come back here */
+            pr->cb = NULL;
+            return -1;
+        }
+    }
+    if (result)
+        *result = call.result;
+    else
+        free(call.result);
+    return (call.retcode);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIBJOBD_H
+#define _LIBJOBD_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A client library for jobd, for programs that talk to it often enough
+ * that running jobadm for each request would be too slow.
+ *
+ * A client is one persistent connection to jobd. Requests are sent without
+ * waiting for the responses to earlier ones, and each response is passed to
+ * the callback of its request, in the order that jobd answers them. Events
+ * of subscriptions are passed to the event callback as they arrive.
+ *
+ * Nothing blocks, except for jobd_open(), jobd_wait() and jobd_call(). To
+ * fit the client into another event loop, wait until jobd_fd() is ready for
+ * the events given by jobd_events(), then call jobd_dispatch(). Callbacks
+ * are only made from within jobd_dispatch(), jobd_wait() and jobd_call().
+ *
+ * A client must only be used by one thread at a time. Functions that can
+ * fail return -1, and jobd_last_error() then describes the failure.
+ *
+ * Link with the flags from "pkg-config --libs libjobd".
+ */
+
+#define LIBJOBD_VERSION_MAJOR 1
+#define LIBJOBD_VERSION_MINOR 1
+
+/* The retcode of the requests that were still pending when the connection was lost */
+#define JOBD_DISCONNECTED (-1)
+/* The retcode of a streamed request whose result was not passed on in full */
+#define JOBD_STREAM_FAILED (-2)
+
+/* For jobd_events() */
+#define JOBD_READ   0x1
+#define JOBD_WRITE  0x2
+
+struct jobd_client;
+
+struct jobd_param {
+    const char *name;
+    const char *value;
+};
+
+/*
+ * The retcode is 0 on success, or the error that jobd returned (see
+ * "enum ipc_response" in the jobd sources). The result is only valid
+ * during the call, and may be NULL. An error can have a result too, such
+ * as the state that a job was left in when waiting for it failed.
+ */
+typedef void (*jobd_response_cb)(void *ctx, int retcode, const char *result);
+
+/* The event is a JSON object, only valid during the call */
+typedef void (*jobd_event_cb)(void *ctx, const char *event);
+
+/* One piece of a streamed result, only valid during the call. Return -1 to drop the rest. */
+typedef int (*jobd_chunk_cb)(void *ctx, const char *data, size_t len);
+
+/* Connect to the jobd at path, or to the usual one if path is NULL */
+int jobd_open(struct jobd_client **client, const char *path);
+/* Pending requests are dropped without calling their callbacks */
+void jobd_close(struct jobd_client *client);
+
+int jobd_fd(const struct jobd_client *client);
+/* JOBD_READ, and JOBD_WRITE while there are requests that could not be sent yet */
+int jobd_events(const struct jobd_client *client);
+
+/*
+ * Handle whatever is ready on the connection, without blocking. Returns -1
+ * once the connection is lost, after failing every pending request with
+ * JOBD_DISCONNECTED.
+ */
+int jobd_dispatch(struct jobd_client *client);
+/* Wait for up to timeout_ms, or forever if it is negative, then dispatch */
+int jobd_wait(struct jobd_client *client, int timeout_ms);
+/* The number of requests that have not been answered yet */
+size_t jobd_pending(const struct jobd_client *client);
+
+/* Apply a method to a job, such as "start" or "status"; cb may be NULL */
+int jobd_request(struct jobd_client *client, const char *job_id, const char *method,
+        jobd_response_cb cb, void *ctx);
+/* Any method, with up to 8 parameters */
+int jobd_request_params(struct jobd_client *client, const char *method,
+        const struct jobd_param *params, size_t nparams, jobd_response_cb cb, void *ctx);
+/*
+ * Apply a method whose result may be too long for one message, such as
+ * "logs" or "list", and pass the result to on_chunk piece by piece as it
+ * arrives. cb then gets the retcode, or JOBD_STREAM_FAILED if a piece went
+ * missing or on_chunk failed. Both are given ctx.
+ */
+int jobd_request_stream(struct jobd_client *client, const char *job_id, const char *method,
+        jobd_chunk_cb on_chunk, jobd_response_cb cb, void *ctx);
+
+/*
+ * Make a request, and wait for its response while dispatching whatever
+ * else arrives. Returns the retcode, or -1 on failure. If result is not
+ * NULL, it is set to a copy of the result, which the caller must free.
+ */
+int jobd_call(struct jobd_client *client, char **result, const char *method,
+        const struct jobd_param *params, size_t nparams);
+
+/*
+ * Subscribe to the events of the jobs matching the patterns; see the
+ * subscribe method of jobd. A client has at most one subscription, and
+ * each call replaces it. Filters are comma-separated lists, and may be NULL.
+ */
+void jobd_set_event_callback(struct jobd_client *client, jobd_event_cb cb, void *ctx);
+int jobd_subscribe(struct jobd_client *client, const char *patterns, const char *states,
+        const char *events, jobd_response_cb cb, void *ctx);
+
+/* The reason for the last failure in the calling process */
+const char *jobd_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBJOBD_H */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The logger of libjobd, in place of logger.c. A library has no business
+ * writing to the log files or the terminal of the program that uses it, so
+ * printlog() only keeps the last error, for jobd_last_error().
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libjobd.h"
+#include "logger.h"
+
+static _Thread_local char last_error[256];
+
+int
+logger_append(int level, const char *format, ...)
+{
+    va_list args;
+    size_t len;
+
+    if (level > LOG_ERR)
+        return -1;
+    va_start(args, format);
+    (void) vsnprintf(last_error, sizeof(last_error), format, args);
+    va_end(args);
+    len = strlen(last_error);
+    if (len > 0 && last_error[len - 1] == '\n')
+        last_error[len - 1] = '\0';
+    return -1;
+}
+
+/* Exported like the functions in libjobd.c */
+__attribute__((visibility("default"))) const char *
+jobd_last_error(void)
+{
+    return (last_error);
+}
@@ -26,12 +26,14 @@
 #include <sys/stat.h>
 
 #include "config.h"
+#include "cgroup.h"
 #include "database.h"
 #include "logger.h"
 #include "memory.h"
 #include "toml.h"
 #include "array.h"
 #include "job.h"
+#include "job_output.h"
 #include "parser.h"
 
 struct job_parser {
@@ -182,6 +184,80 @@ parse_dict_of_strings(struct string_array *result, toml_table_t *tab, const char
     return 0;
 }
 
+/* Like parse_dict_of_strings(), but integer values are also accepted */
+static int
+parse_dict_of_scalars(struct string_array *result, toml_table_t *tab, const char *top_key)
+{
+    toml_table_t* subtab;
+    const char *key;
+    char *val;
+    const char *raw;
+    int64_t ival;
+    int i;
+
+    subtab = toml_table_in(tab, top_key);
+    if (!subtab)
+        return 0;
+
+    for (i = 0; (key = toml_key_in(subtab, i)) != 0; i++) {
+        raw = toml_raw_in(subtab, key);
+        if (!raw)
+            return printlog(LOG_ERR, "error parsing %s.%s", top_key, key);
+        if (toml_rtoi(raw, &ival) == 0) {
+            if (asprintf(&val, "%lld", (long long) ival) < 0)
+                return printlog(LOG_ERR, "asprintf(3): %s", strerror(errno));
+        } else if (toml_rtos(raw, &val)) {
+            return printlog(LOG_ERR, "error parsing %s.%s", top_key, key);
+        }
+
+        if (string_array_push_back(result, strdup(key)) < 0) {
+            free(val);
+            return -1;
+        }
+        if (string_array_push_back(result, val) < 0) {
+            free(val);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+parse_resource_limits(struct job *job, toml_table_t *tab)
+{
+    char **data;
+    uint32_t i;
+    int resource;
+    rlim_t value;
+    struct job_output_options log_options;
+
+    if (parse_dict_of_scalars(job->rlimits, tab, "rlimits") < 0)
+        return -1;
+    data = string_array_data(job->rlimits);
+    for (i = 0; i < string_array_len(job->rlimits); i += 2) {
+        if (job_parse_rlimit(&resource, &value, data[i], data[i + 1]) < 0)
+            return -1;
+    }
+
+    if (parse_dict_of_scalars(job->cgroup_limits, tab, "cgroup") < 0)
+        return -1;
+    data = string_array_data(job->cgroup_limits);
+    for (i = 0; i < string_array_len(job->cgroup_limits); i += 2) {
+        if (!cgroup_limit_is_supported(data[i]))
+            return printlog(LOG_ERR, "unsupported cgroup limit: %s", data[i]);
+    }
+
+    if (parse_dict_of_scalars(job->log_options, tab, "log") < 0)
+        return -1;
+    data = string_array_data(job->log_options);
+    for (i = 0; i < string_array_len(job->log_options); i += 2) {
+        if (job_output_parse_option(&log_options, data[i], data[i + 1]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
 static int
 parse_environment_variables(struct job *job, toml_table_t *tab)
 {
@@ -243,13 +319,16 @@ parse_job(struct job_parser *jpr)
 		goto_err("title");
 	if (parse_dict_of_strings(j->methods, tab, "methods"))
 	    goto_err("methods");
+	if (parse_resource_limits(j, tab))
+		goto_err("resource limits");
 	if (parse_string(&j->root_directory, tab, "root_directory", "/"))
 		goto_err("root_directory");
-	if (parse_string(&j->standard_error_path, tab, "stderr", "/dev/null"))
+	/* An empty path means that the output is captured by jobd */
+	if (parse_string(&j->standard_error_path, tab, "stderr", ""))
 		goto_err("standard_error_path");
 	if (parse_string(&j->standard_in_path, tab, "stdin", "/dev/null"))
 		goto_err("standard_in_path");
-	if (parse_string(&j->standard_out_path, tab, "stdout", "/dev/null"))
+	if (parse_string(&j->standard_out_path, tab, "stdout", ""))
 		goto_err("standard_out_path");
 
 	if (parse_string(&buf, tab, "type", ""))
@@ -267,6 +346,21 @@ parse_job(struct job_parser *jpr)
 	if (j->job_type == JOB_TYPE_UNKNOWN)
 		goto_err("type-to-value");
 
+	if (parse_string(&buf, tab, "runner", "fork"))
+		goto_err("runner");
+	if (!strcmp(buf, "fork")) {
+		j->shared_runner = false;
+	} else if (!strcmp(buf, "shared")) {
+		j->shared_runner = true;
+	} else {
+		free(buf);
+		goto_err("runner-to-value");
+	}
+	free(buf);
+	buf = NULL;
+	if (j->shared_runner && j->job_type != JOB_TYPE_TASK)
+		goto_err("runner: only tasks can use the shared runner");
+
 	if (parse_string(&j->umask_str, tab, "umask", "0077"))
 		goto_err("umask");
 	sscanf(j->umask_str, "%hi", (unsigned short *) &j->umask);
@@ -451,6 +545,29 @@ job_db_insert_methods(struct job_parser *jpr)
 	return (0);
 }
 
+static int
+job_db_insert_resource_limits(const struct job *job, const char *kind, const struct string_array *limits)
+{
+    sqlite3_stmt CLEANUP_STMT *stmt = NULL;
+    const char *sql =
+            "INSERT INTO job_resource_limits "
+            "(job_id, kind, name, value) "
+            "VALUES (?, ?, ?, ?)";
+    char **data = string_array_data(limits);
+    uint32_t i;
+
+    for (i = 0; i < string_array_len(limits); i += 2) {
+        if (db_query(&stmt, sql, "isss", job->row_id, kind, data[i], data[i + 1]) < 0)
+            return db_error;
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            return db_error;
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+    }
+
+    return 0;
+}
+
 static int
 _toml_raw_to_sqlite_value(char **result, int *datatype, const char *raw)
 {
@@ -585,7 +702,8 @@ job_db_insert(struct job_parser *jpr)
     const char *sql = "INSERT INTO jobs (job_id, description, gid, init_groups, "
                       "keep_alive, root_directory, standard_error_path, "
                       "standard_in_path, standard_out_path, umask, user_name, "
-                      "working_directory, wait, job_type_id) VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)";
+                      "working_directory, wait, job_type_id, runner) "
+                      "VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)";
 
     rv = sqlite3_prepare_v2(dbh, sql, -1, &stmt, 0) == SQLITE_OK &&
          sqlite3_bind_text(stmt, 1, job->id, -1, SQLITE_STATIC) == SQLITE_OK &&
@@ -601,7 +719,8 @@ job_db_insert(struct job_parser *jpr)
          sqlite3_bind_text(stmt, 11, job->user_name, -1, SQLITE_STATIC) == SQLITE_OK &&
          sqlite3_bind_text(stmt, 12, job->working_directory, -1, SQLITE_STATIC) == SQLITE_OK &&
          sqlite3_bind_int(stmt, 13, job->wait_flag) == SQLITE_OK &&
-         sqlite3_bind_int(stmt, 14, job->job_type) == SQLITE_OK;
+         sqlite3_bind_int(stmt, 14, job->job_type) == SQLITE_OK &&
+         sqlite3_bind_text(stmt, 15, job->shared_runner ? "shared" : "fork", -1, SQLITE_STATIC) == SQLITE_OK;
 
     if (!rv || sqlite3_step(stmt) != SQLITE_DONE)
         return printlog(LOG_ERR, "error importing %s", job->id);
@@ -617,6 +736,11 @@ job_db_insert(struct job_parser *jpr)
     if (job_db_insert_properties(jpr) < 0)
         return printlog(LOG_ERR, "error importing %s properties", job->id);
 
+    if (job_db_insert_resource_limits(job, "rlimit", job->rlimits) < 0 ||
+        job_db_insert_resource_limits(job, "cgroup", job->cgroup_limits) < 0 ||
+        job_db_insert_resource_limits(job, "log", job->log_options) < 0)
+        return printlog(LOG_ERR, "error importing %s resource limits", job->id);
+
     if (job_db_insert_state(jpr) < 0)
         return printlog(LOG_ERR, "error setting initial state of %s", job->id);
 
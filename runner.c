@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include "queue.h"
+#else
+#include <sys/queue.h>
+#endif
+
+#include "cgroup.h"
+#include "database.h"
+#include "job.h"
+#include "logger.h"
+#include "memory.h"
+#include "runner.h"
+#include "script_cache.h"
+
+struct runner_task {
+    int64_t job_id;
+    STAILQ_ENTRY(runner_task) entries;
+};
+
+struct runner_worker {
+    char *key;              /* Identifies the credentials of the worker */
+    pid_t pid;              /* Zero if the worker is not running */
+    int command_fd;         /* Our end of the socketpair connected to fd 0 of the worker */
+    int64_t current;        /* The task being run, or INVALID_ROW_ID if idle */
+    pid_t task_pid;         /* The subshell running the current task, once it has reported in */
+    int stop_signal;        /* The signal sent to the current task, or zero */
+    char *outbuf;           /* Commands that the socket has not accepted yet */
+    size_t outlen;
+    void *watch;            /* Returned by the watch callback while outbuf is not empty */
+    STAILQ_HEAD(, runner_task) queue;
+    LIST_ENTRY(runner_worker) entries;
+};
+
+static struct {
+    bool initialized;
+    bool shutting_down;
+    int status_pipe[2];
+    char status_buf[PIPE_BUF];
+    size_t status_len;
+    struct runner_callbacks cb;
+} runner = {
+        .status_pipe = { -1, -1 },
+};
+
+static LIST_HEAD(, runner_worker) runner_workers = LIST_HEAD_INITIALIZER(runner_workers);
+
+static struct runner_worker *
+worker_lookup(const char *key)
+{
+    struct runner_worker *w;
+
+    LIST_FOREACH(w, &runner_workers, entries) {
+        if (!strcmp(w->key, key))
+            return w;
+    }
+    return NULL;
+}
+
+static struct runner_worker *
+worker_lookup_by_pid(pid_t pid)
+{
+    struct runner_worker *w;
+
+    LIST_FOREACH(w, &runner_workers, entries) {
+        if (w->pid == pid)
+            return w;
+    }
+    return NULL;
+}
+
+static struct runner_worker *
+worker_lookup_by_job(int64_t job_id)
+{
+    struct runner_worker *w;
+    struct runner_task *task;
+
+    LIST_FOREACH(w, &runner_workers, entries) {
+        if (w->current == job_id)
+            return w;
+        STAILQ_FOREACH(task, &w->queue, entries) {
+            if (task->job_id == job_id)
+                return w;
+        }
+    }
+    return NULL;
+}
+
+static struct runner_worker *
+worker_lookup_by_fd(int fd)
+{
+    struct runner_worker *w;
+
+    LIST_FOREACH(w, &runner_workers, entries) {
+        if (w->command_fd == fd)
+            return w;
+    }
+    return NULL;
+}
+
+static int
+worker_spawn(struct runner_worker *w, int64_t job_id)
+{
+    int sv[2];
+    int flags;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return printlog(LOG_ERR, "socketpair(2): %s", strerror(errno));
+    if (job_spawn_shared_worker(&w->pid, job_id, sv[1], runner.status_pipe[1]) < 0) {
+        (void) close(sv[0]);
+        (void) close(sv[1]);
+        w->pid = 0;
+        return -1;
+    }
+    (void) close(sv[1]);
+    w->command_fd = sv[0];
+
+    /* Only our end is non-blocking; the worker reads its commands from the other */
+    flags = fcntl(w->command_fd, F_GETFL);
+    if (flags < 0 || fcntl(w->command_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return printlog(LOG_ERR, "fcntl(2): %s", strerror(errno));
+
+    printlog(LOG_DEBUG, "started shared runner pid %d for %s", w->pid, w->key);
+    return 0;
+}
+
+/* Idle workers exit when they read EOF */
+static void
+worker_close(struct runner_worker *w)
+{
+    if (w->watch) {
+        runner.cb.unwatch(w->watch);
+        w->watch = NULL;
+    }
+    free(w->outbuf);
+    w->outbuf = NULL;
+    w->outlen = 0;
+    if (w->command_fd >= 0)
+        (void) close(w->command_fd);
+    w->command_fd = -1;
+}
+
+static void
+worker_detach(struct runner_worker *w)
+{
+    worker_close(w);
+    w->pid = 0;
+}
+
+/* Send as much as the socket will take, and wait for it to drain if that is not everything */
+static int
+worker_flush(struct runner_worker *w)
+{
+    size_t pos = 0;
+    ssize_t n;
+
+    while (pos < w->outlen) {
+        n = send(w->command_fd, w->outbuf + pos, w->outlen - pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return printlog(LOG_ERR, "send(2) to shared runner pid %d: %s", w->pid, strerror(errno));
+        }
+        pos += (size_t) n;
+    }
+    w->outlen -= pos;
+    memmove(w->outbuf, w->outbuf + pos, w->outlen);
+
+    if (w->outlen > 0 && !w->watch) {
+        w->watch = runner.cb.watch(w->command_fd);
+        if (!w->watch)
+            return printlog(LOG_ERR, "unable to wait for shared runner pid %d", w->pid);
+    } else if (w->outlen == 0 && w->watch) {
+        runner.cb.unwatch(w->watch);
+        w->watch = NULL;
+    }
+    return 0;
+}
+
+static int
+worker_write(struct runner_worker *w, const char *data, size_t len)
+{
+    char *buf;
+
+    buf = realloc(w->outbuf, w->outlen + len);
+    if (!buf)
+        return printlog(LOG_ERR, "realloc(3): %s", strerror(errno));
+    memcpy(buf + w->outlen, data, len);
+    w->outbuf = buf;
+    w->outlen += len;
+    return worker_flush(w);
+}
+
+/* The worker is beyond saving; runner_reap() finishes whatever it was running */
+static void
+worker_kill(struct runner_worker *w)
+{
+    if (w->pid > 0)
+        (void) kill(-w->pid, SIGKILL);
+}
+
+/* Use the cached copy of the script, so that running a task does not query the database */
+static int
+get_script(char **script, int64_t job_id)
+{
+    struct stat sb;
+    ssize_t n;
+    int fd;
+
+    *script = NULL;
+    if (script_cache_lookup(&fd, job_id, "start") < 0)
+        return job_get_method(script, job_id, "start");
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &sb) < 0)
+        return printlog(LOG_ERR, "fstat(2): %s", strerror(errno));
+    *script = malloc((size_t) sb.st_size + 1);
+    if (!*script)
+        return printlog(LOG_ERR, "malloc(3): %s", strerror(errno));
+    n = pread(fd, *script, (size_t) sb.st_size, 0);
+    if (n != sb.st_size) {
+        free(*script);
+        *script = NULL;
+        return printlog(LOG_ERR, "unable to read the script of job `%s'", job_id_to_str(job_id));
+    }
+    (*script)[n] = '\0';
+    return 0;
+}
+
+/*
+ * Wrap the script so it cannot affect the worker, or the tasks that follow it.
+ * The subshell reports its pid and waits for "go", so that it can be moved
+ * into the cgroup of the job before the script runs.
+ */
+static int
+build_command(char **result, int64_t job_id)
+{
+    char CLEANUP_STR *script = NULL;
+    char *buf, *p;
+    const char *s;
+    size_t len;
+    int n;
+
+    *result = NULL;
+    if (get_script(&script, job_id) < 0)
+        return -1;
+    if (!script)
+        script = strdup("");
+    if (!script)
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+
+    /* Every ' becomes '\'' */
+    len = strlen(script);
+    for (s = script; *s; s++) {
+        if (*s == '\'')
+            len += 3;
+    }
+    len += 256;
+    buf = malloc(len);
+    if (!buf)
+        return printlog(LOG_ERR, "malloc(3): %s", strerror(errno));
+
+    n = snprintf(buf, len, "(read jobd_pid _ 2>/dev/null </proc/self/stat || jobd_pid=$(exec sh -c 'echo $PPID'); "
+            "echo \"%" PRId64 " pid $jobd_pid\" >&%d; read jobd_go || exit; unset jobd_pid jobd_go; "
+            "exec <&%d %d<&- %d>&-; eval '",
+            job_id, RUNNER_STATUS_FILENO,
+            RUNNER_STDIN_FILENO, RUNNER_STDIN_FILENO, RUNNER_STATUS_FILENO);
+    p = buf + n;
+    for (s = script; *s; s++) {
+        if (*s == '\'') {
+            memcpy(p, "'\\''", 4);
+            p += 4;
+        } else {
+            *p++ = *s;
+        }
+    }
+    snprintf(p, len - (size_t) (p - buf), "'); echo \"%" PRId64 " $?\" >&%d\n",
+            job_id, RUNNER_STATUS_FILENO);
+
+    *result = buf;
+    return 0;
+}
+
+static int
+worker_send(struct runner_worker *w, int64_t job_id)
+{
+    char CLEANUP_STR *cmd = NULL;
+
+    if (build_command(&cmd, job_id) < 0)
+        return -1;
+    return worker_write(w, cmd, strlen(cmd));
+}
+
+/* Start the next task, if the worker is idle */
+static void
+worker_kick(struct runner_worker *w)
+{
+    struct runner_task *task;
+    int64_t job_id;
+
+    while (w->current == INVALID_ROW_ID && !STAILQ_EMPTY(&w->queue)) {
+        task = STAILQ_FIRST(&w->queue);
+        STAILQ_REMOVE_HEAD(&w->queue, entries);
+        job_id = task->job_id;
+        free(task);
+
+        if ((w->pid == 0 && worker_spawn(w, job_id) < 0) || worker_send(w, job_id) < 0) {
+            printlog(LOG_ERR, "job `%s' could not be handed to the shared runner", job_id_to_str(job_id));
+            worker_kill(w);
+            worker_detach(w);
+            runner.cb.on_done(job_id, W_EXITCODE(127, 0));
+            continue;
+        }
+        printlog(LOG_DEBUG, "job `%s': running in shared runner pid %d", job_id_to_str(job_id), w->pid);
+        w->current = job_id;
+        w->task_pid = 0;
+        w->stop_signal = 0;
+    }
+}
+
+/* The subshell of the current task has reported its pid, and is waiting to be let go */
+static void
+task_started(struct runner_worker *w, pid_t pid)
+{
+    int fd;
+
+    w->task_pid = pid;
+    if (w->stop_signal) {
+        if (kill(pid, w->stop_signal) < 0 && errno != ESRCH)
+            printlog(LOG_ERR, "kill(2): %s", strerror(errno));
+        return;
+    }
+    if (cgroup_enabled()) {
+        fd = cgroup_job_prepare(w->current, job_id_to_str(w->current));
+        if (fd < 0 || cgroup_job_attach_pid(fd, pid) < 0)
+            printlog(LOG_WARNING, "job `%s' will not be placed in a cgroup", job_id_to_str(w->current));
+    }
+    if (worker_write(w, "go\n", 3) < 0)
+        worker_kill(w);
+}
+
+/* The worker only sees the exit status of the subshell, where death by signal n looks like 128 + n */
+static void
+task_done(struct runner_worker *w, int exit_status)
+{
+    int64_t job_id = w->current;
+    int status;
+
+    if (w->stop_signal && exit_status == 128 + w->stop_signal)
+        status = W_EXITCODE(0, w->stop_signal);
+    else
+        status = W_EXITCODE(exit_status & 0xff, 0);
+    w->current = INVALID_ROW_ID;
+    w->task_pid = 0;
+    w->stop_signal = 0;
+    runner.cb.on_done(job_id, status);
+}
+
+int
+runner_init(const struct runner_callbacks *callbacks)
+{
+    int flags;
+
+    if (pipe(runner.status_pipe) < 0)
+        return printlog(LOG_ERR, "pipe(2): %s", strerror(errno));
+    if (fcntl(runner.status_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(runner.status_pipe[1], F_SETFD, FD_CLOEXEC) < 0)
+        return printlog(LOG_ERR, "fcntl(2): %s", strerror(errno));
+
+    /* Only our end is non-blocking; the workers share the other end */
+    flags = fcntl(runner.status_pipe[0], F_GETFL);
+    if (flags < 0 || fcntl(runner.status_pipe[0], F_SETFL, flags | O_NONBLOCK) < 0)
+        return printlog(LOG_ERR, "fcntl(2): %s", strerror(errno));
+
+    runner.cb = *callbacks;
+    runner.initialized = true;
+    return 0;
+}
+
+void
+runner_shutdown(void)
+{
+    struct runner_worker *w;
+    struct runner_task *task;
+
+    runner.shutting_down = true;
+    LIST_FOREACH(w, &runner_workers, entries) {
+        /* Tasks that never started are simply forgotten */
+        while (!STAILQ_EMPTY(&w->queue)) {
+            task = STAILQ_FIRST(&w->queue);
+            STAILQ_REMOVE_HEAD(&w->queue, entries);
+            printlog(LOG_DEBUG, "job `%s' was never started", job_id_to_str(task->job_id));
+            runner.cb.on_done(task->job_id, W_EXITCODE(0, SIGTERM));
+            free(task);
+        }
+        worker_close(w);
+    }
+}
+
+int
+runner_get_status_fd(void)
+{
+    return runner.status_pipe[0];
+}
+
+int
+runner_dispatch_events(void)
+{
+    struct runner_worker *w;
+    char *line, *eol;
+    int64_t job_id;
+    int exit_status, task_pid;
+    ssize_t n;
+
+    for (;;) {
+        n = read(runner.status_pipe[0], runner.status_buf + runner.status_len,
+                sizeof(runner.status_buf) - runner.status_len - 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return printlog(LOG_ERR, "read(2): %s", strerror(errno));
+        }
+        if (n == 0)
+            break;
+        runner.status_len += (size_t) n;
+        runner.status_buf[runner.status_len] = '\0';
+
+        line = runner.status_buf;
+        while ((eol = strchr(line, '\n')) != NULL) {
+            *eol = '\0';
+            if (sscanf(line, "%" SCNd64 " pid %d", &job_id, &task_pid) == 2) {
+                if (!(w = worker_lookup_by_job(job_id)) || w->current != job_id || w->task_pid)
+                    printlog(LOG_ERR, "unexpected status from shared runner: %s", line);
+                else
+                    task_started(w, (pid_t) task_pid);
+            } else if (sscanf(line, "%" SCNd64 " %d", &job_id, &exit_status) != 2) {
+                printlog(LOG_ERR, "invalid status from shared runner: %s", line);
+            } else if (!(w = worker_lookup_by_job(job_id)) || w->current != job_id) {
+                printlog(LOG_ERR, "unexpected status from shared runner: %s", line);
+            } else {
+                task_done(w, exit_status);
+                if (!runner.shutting_down)
+                    worker_kick(w);
+            }
+            line = eol + 1;
+        }
+        runner.status_len -= (size_t) (line - runner.status_buf);
+        memmove(runner.status_buf, line, runner.status_len);
+        if (runner.status_len == sizeof(runner.status_buf) - 1) {
+            printlog(LOG_ERR, "discarding an overlong status line from the shared runner");
+            runner.status_len = 0;
+        }
+    }
+    return 0;
+}
+
+int
+runner_submit(pid_t *worker_pid, int64_t job_id)
+{
+    const char *key;
+    struct runner_worker *w;
+    struct runner_task *task;
+
+    *worker_pid = 0;
+    if (!runner.initialized || runner.shutting_down)
+        return 1;
+    if (job_get_worker_key(&key, job_id) < 0)
+        return -1;
+    if (!key)
+        return 1;
+
+    w = worker_lookup(key);
+    if (!w) {
+        w = calloc(1, sizeof(*w));
+        if (!w)
+            return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        w->key = strdup(key);
+        if (!w->key) {
+            free(w);
+            return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+        }
+        w->command_fd = -1;
+        w->current = INVALID_ROW_ID;
+        STAILQ_INIT(&w->queue);
+        LIST_INSERT_HEAD(&runner_workers, w, entries);
+    }
+
+    task = calloc(1, sizeof(*task));
+    if (!task)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    task->job_id = job_id;
+
+    /* The job counts as running while it waits for its turn */
+    if (job_register_pid(job_id, 0) < 0 || job_set_state(job_id, JOB_STATE_RUNNING) < 0) {
+        free(task);
+        return printlog(LOG_ERR, "unable to update the state of job `%s'", job_id_to_str(job_id));
+    }
+    STAILQ_INSERT_TAIL(&w->queue, task, entries);
+    worker_kick(w);
+
+    /* If the task failed to start, it has already finished */
+    if (worker_lookup_by_job(job_id) == w)
+        *worker_pid = w->pid;
+    return 0;
+}
+
+int
+runner_stop(int64_t job_id)
+{
+    struct runner_worker *w;
+    struct runner_task *task;
+
+    w = worker_lookup_by_job(job_id);
+    if (!w)
+        return 1;
+
+    if (w->current == job_id) {
+        /* Only the subshell is signalled; if it has not reported in yet, task_started() does it */
+        w->stop_signal = SIGTERM;
+        if (w->task_pid > 0) {
+            printlog(LOG_DEBUG, "sending SIGTERM to job %s (pid %d) in shared runner pid %d",
+                    job_id_to_str(job_id), w->task_pid, w->pid);
+            if (kill(w->task_pid, SIGTERM) < 0 && errno != ESRCH)
+                return printlog(LOG_ERR, "kill(2): %s", strerror(errno));
+        }
+        return job_set_state(job_id, JOB_STATE_STOPPING);
+    }
+
+    STAILQ_FOREACH(task, &w->queue, entries) {
+        if (task->job_id == job_id)
+            break;
+    }
+    STAILQ_REMOVE(&w->queue, task, runner_task, entries);
+    free(task);
+    printlog(LOG_DEBUG, "job `%s' was removed from the shared runner queue", job_id_to_str(job_id));
+    runner.cb.on_done(job_id, W_EXITCODE(0, SIGTERM));
+    return 0;
+}
+
+bool
+runner_has_task(int64_t job_id)
+{
+    return worker_lookup_by_job(job_id) != NULL;
+}
+
+int
+runner_flush(int fd)
+{
+    struct runner_worker *w;
+
+    w = worker_lookup_by_fd(fd);
+    if (!w)
+        return 0;
+    if (worker_flush(w) < 0) {
+        worker_kill(w);
+        return -1;
+    }
+    return 0;
+}
+
+int
+runner_reap(pid_t pid, int status)
+{
+    struct runner_worker *w;
+    int64_t job_id;
+
+    w = worker_lookup_by_pid(pid);
+    if (!w)
+        return 1;
+
+    printlog(LOG_DEBUG, "shared runner pid %d has exited", pid);
+    job_id = w->current;
+    worker_detach(w);
+
+    /* The task might have finished just before the worker died */
+    (void) runner_dispatch_events();
+    if (job_id != INVALID_ROW_ID && w->current == job_id) {
+        w->current = INVALID_ROW_ID;
+        w->task_pid = 0;
+        w->stop_signal = 0;
+        runner.cb.on_done(job_id, status);
+    }
+
+    /* Any remaining tasks get a new worker */
+    if (!runner.shutting_down)
+        worker_kick(w);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _RUNNER_H
+#define _RUNNER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The shared runner, for tasks with runner = "shared" in their manifest.
+ *
+ * Instead of forking a new shell for every task, jobd keeps one long-lived
+ * shell (a "worker") for each distinct set of credentials, and feeds it
+ * one task at a time. Each task runs in a subshell of the worker:
+ *
+ *      fd 0    commands from jobd
+ *      fd 3    the stdin of each task; moved to fd 0 in the subshell
+ *      fd 4    status lines of the form "<job id> <exit status>"
+ *
+ * All workers write to a single status pipe, which is read by jobd.
+ * Before the script runs, the subshell writes "<job id> pid <pid>" and waits
+ * for jobd to answer "go", so that it can be moved into the cgroup of the job
+ * and signalled on its own when the job is stopped.
+ *
+ * Only tasks without captured output or cgroup limits are shared; see
+ * job_get_worker_key().
+ */
+
+#define RUNNER_STDIN_FILENO 3
+#define RUNNER_STATUS_FILENO 4
+
+/*
+ * on_done() is called with a wait(2) status when a task finishes.
+ *
+ * Commands are sent without blocking. When a worker has not taken all of
+ * them, watch() is called with its fd, and runner_flush() should be called
+ * whenever that fd is writable; unwatch() is given whatever watch() returned.
+ */
+struct runner_callbacks {
+    void (*on_done)(int64_t job_id, int status);
+    void *(*watch)(int fd);
+    void (*unwatch)(void *handle);
+};
+
+int runner_init(const struct runner_callbacks *callbacks);
+void runner_shutdown(void);
+int runner_get_status_fd(void);
+int runner_dispatch_events(void);
+int runner_flush(int fd);
+
+/* These return 1 if the job or process does not belong to the shared runner */
+int runner_submit(pid_t *worker_pid, int64_t job_id);
+int runner_stop(int64_t job_id);
+int runner_reap(pid_t pid, int status);
+/* True until on_done() has been called for the job */
+bool runner_has_task(int64_t job_id);
+
+#endif /* _RUNNER_H */
@@ -22,13 +22,14 @@ CREATE TABLE jobs (
     init_groups BOOLEAN NOT NULL DEFAULT 1 CHECK (init_groups IN (0,1)),
     keep_alive BOOLEAN NOT NULL DEFAULT 0 CHECK (keep_alive IN (0,1)),
     root_directory VARCHAR NOT NULL DEFAULT '/',
-    standard_error_path VARCHAR NOT NULL DEFAULT '/dev/null',
+    standard_error_path VARCHAR NOT NULL DEFAULT '', -- empty means captured by jobd
     standard_in_path NOT NULL DEFAULT '/dev/null',
-    standard_out_path NOT NULL DEFAULT '/dev/null',
+    standard_out_path NOT NULL DEFAULT '',
     start_order INT,
     umask VARCHAR DEFAULT '022',
     user_name VARCHAR,
     working_directory VARCHAR NOT NULL DEFAULT '/',
+    runner TEXT NOT NULL DEFAULT 'fork' CHECK (runner IN ('fork', 'shared')),
     FOREIGN KEY (job_type_id) REFERENCES job_types (id) ON DELETE RESTRICT
 );
 
@@ -64,6 +65,20 @@ CREATE TABLE jobs_environment (
     FOREIGN KEY (job_id) REFERENCES jobs (id) ON DELETE CASCADE 
 );
 
+-- Resource limits for each job.
+--   kind 'rlimit' is passed to setrlimit(2), e.g. nofile = 1024
+--   kind 'cgroup' is written to the cgroup of the job, e.g. memory.max = 512M
+--   kind 'log' applies to the captured output of the job, e.g. max_size = 1048576
+CREATE TABLE job_resource_limits (
+    id INTEGER PRIMARY KEY,
+    job_id INTEGER NOT NULL,
+    kind TEXT NOT NULL CHECK (kind IN ('rlimit', 'cgroup', 'log')),
+    name TEXT NOT NULL,
+    value TEXT NOT NULL,
+    UNIQUE (job_id, kind, name),
+    FOREIGN KEY (job_id) REFERENCES jobs (id) ON DELETE CASCADE
+);
+
 
 ---
 --- JOB PROPERTIES
@@ -127,11 +142,13 @@ VALUES
     (5, 'stopping'),
     (6, 'stopped'),
     (7, 'complete'),
-    (8, 'error');
+    (8, 'error'),
+    (9, 'exec_failed');
 
 CREATE TABLE processes
 (
-    pid           INTEGER PRIMARY KEY, -- matches kernel PID
+    id            INTEGER PRIMARY KEY,
+    pid           INTEGER UNIQUE, -- matches kernel PID; NULL for the shared runner
     job_id        INTEGER UNIQUE NOT NULL,
     exited        INTEGER CHECK (exited IN (0, 1)),
     exit_status   INTEGER,
@@ -139,9 +156,62 @@ CREATE TABLE processes
     signal_number INTEGER,
     start_time    INTEGER        NOT NULL DEFAULT 0,
     end_time      INTEGER        NOT NULL DEFAULT 0,
+    oom_kills     INTEGER        NOT NULL DEFAULT 0,
+    spawn_latency INTEGER,       -- microseconds from fork(2) to execve(2)
+    exec_error    TEXT,          -- why the child never reached execve(2)
     FOREIGN KEY (job_id) REFERENCES jobs (id) ON DELETE RESTRICT
 );
 
+-- Why a run was started. Keep this in sync with enum job_start_reason.
+CREATE TABLE start_reasons
+(
+    id   INTEGER PRIMARY KEY,
+    name TEXT UNIQUE NOT NULL
+);
+
+INSERT INTO start_reasons (id, name)
+VALUES
+    (1, 'schedule'),
+    (2, 'request'),
+    (3, 'enable');
+
+-- The history of every run of every job, unlike processes which only has the last one.
+-- Monotonic times are in milliseconds since boot, and wall times in seconds since the epoch.
+CREATE TABLE job_runs
+(
+    id              INTEGER PRIMARY KEY,
+    job_id          INTEGER NOT NULL,
+    start_reason_id INTEGER NOT NULL,
+    start_time      INTEGER NOT NULL,
+    start_monotonic INTEGER NOT NULL,
+    end_time        INTEGER,          -- NULL while the job is running
+    end_monotonic   INTEGER,
+    duration        INTEGER,          -- milliseconds
+    exit_status     INTEGER,
+    signal_number   INTEGER,
+    -- Resource usage from wait4(2); CPU times come from the cgroup of the job if it has one
+    user_time       INTEGER,          -- microseconds
+    system_time     INTEGER,          -- microseconds
+    max_rss         INTEGER,          -- kilobytes
+    in_blocks       INTEGER,
+    out_blocks      INTEGER,
+    voluntary_switches   INTEGER,
+    involuntary_switches INTEGER,
+    FOREIGN KEY (job_id) REFERENCES jobs (id) ON DELETE CASCADE,
+    FOREIGN KEY (start_reason_id) REFERENCES start_reasons (id) ON DELETE RESTRICT
+);
+
+CREATE INDEX job_runs_job_id_start_time ON job_runs (job_id, start_time);
+
+-- Keep the last 100 runs of each job
+CREATE TRIGGER job_runs_retention AFTER INSERT ON job_runs
+BEGIN
+    DELETE FROM job_runs
+     WHERE job_id = NEW.job_id
+       AND id < (SELECT id FROM job_runs WHERE job_id = NEW.job_id
+                 ORDER BY start_time DESC, id DESC LIMIT 1 OFFSET 99);
+END;
+
 CREATE TABLE jobs_current_states
 (
     id           INTEGER PRIMARY KEY,
@@ -172,6 +242,7 @@ SELECT jobs.id AS ID,
        (SELECT name FROM job_states WHERE id = job_state_id) AS State,
        (SELECT name FROM job_types WHERE id = job_type_id) AS "Type",
        CASE
+           WHEN processes.oom_kills > 0 THEN 'oom_kill'
            WHEN processes.exited = 1 THEN 'exit(' || processes.exit_status || ')'
            WHEN processes.signaled = 1 THEN 'kill(' || processes.signal_number || ')'
            ELSE '-'
@@ -184,3 +255,38 @@ FROM jobs
 LEFT JOIN jobs_current_states ON jobs.id = jobs_current_states.job_id
 LEFT JOIN processes ON processes.job_id = jobs.id
 ORDER BY Label;
+
+-- Durations are nearest-rank percentiles, in milliseconds, computed by nearest_rank(), which
+-- db_open() defines; each job has at most 100 runs to sort. A flap is a run that started in the
+-- last 10 minutes, and failed after less than 10 seconds; being killed by SIGTERM or SIGKILL does
+-- not count, since that is how jobs are stopped.
+CREATE VIEW job_run_stats_view
+AS
+SELECT jobs.id AS ID,
+       jobs.job_id AS Label,
+       (SELECT count(*) FROM job_runs r WHERE r.job_id = jobs.id) AS Runs,
+       (SELECT count(*) FROM job_runs r WHERE r.job_id = jobs.id
+           AND (r.exit_status != 0 OR r.signal_number IS NOT NULL)) AS Failures,
+       (SELECT count(*) FROM job_runs r WHERE r.job_id = jobs.id
+           AND r.start_time > strftime('%s','now') - 600 AND r.duration < 10000
+           AND (r.exit_status != 0 OR r.signal_number NOT IN (9, 15))) AS Flaps,
+       (SELECT nearest_rank(r.duration, 50) FROM job_runs r WHERE r.job_id = jobs.id) AS P50,
+       (SELECT nearest_rank(r.duration, 95) FROM job_runs r WHERE r.job_id = jobs.id) AS P95
+FROM jobs
+ORDER BY Label;
+
+-- The resources used by the last finished run of each job, heaviest first
+CREATE VIEW job_usage_view
+AS
+SELECT jobs.id AS ID,
+       jobs.job_id AS Label,
+       job_runs.user_time / 1000 AS "User(ms)",
+       job_runs.system_time / 1000 AS "Sys(ms)",
+       job_runs.max_rss AS "RSS(KB)",
+       job_runs.in_blocks AS BlkIn,
+       job_runs.out_blocks AS BlkOut,
+       job_runs.voluntary_switches + job_runs.involuntary_switches AS CtxSw
+FROM jobs
+JOIN job_runs ON job_runs.id = (SELECT max(id) FROM job_runs r
+                                 WHERE r.job_id = jobs.id AND r.end_time IS NOT NULL)
+ORDER BY job_runs.user_time + job_runs.system_time DESC, Label;
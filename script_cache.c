@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include "queue.h"
+#endif /* __linux__ */
+
+#include "database.h"
+#include "job.h"
+#include "logger.h"
+#include "memory.h"
+#include "script_cache.h"
+
+struct settings_cache_entry {
+    int64_t job_id;
+    struct spawn_settings *settings;
+    LIST_ENTRY(settings_cache_entry) entries;
+};
+
+static LIST_HEAD(, settings_cache_entry) settings_cache = LIST_HEAD_INITIALIZER(settings_cache);
+
+/* The value of "PRAGMA data_version" when the cache was last validated */
+static int64_t data_version = -1;
+
+static void
+settings_entry_free(struct settings_cache_entry *ent)
+{
+    LIST_REMOVE(ent, entries);
+    job_free_spawn_settings(ent->settings);
+    free(ent);
+}
+
+const struct spawn_settings *
+script_cache_get_settings(int64_t job_id)
+{
+    struct settings_cache_entry *ent;
+
+    LIST_FOREACH(ent, &settings_cache, entries) {
+        if (ent->job_id == job_id)
+            return ent->settings;
+    }
+
+    ent = calloc(1, sizeof(*ent));
+    if (!ent) {
+        printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+        return NULL;
+    }
+    ent->job_id = job_id;
+    if (job_load_spawn_settings(&ent->settings, job_id) < 0) {
+        free(ent);
+        return NULL;
+    }
+    LIST_INSERT_HEAD(&settings_cache, ent, entries);
+    return ent->settings;
+}
+
+int
+script_cache_revalidate(void)
+{
+    int64_t version;
+
+    if (db_get_id(&version, "PRAGMA data_version", "") < 0)
+        return printlog(LOG_ERR, "unable to query the data version");
+    if (version != data_version) {
+        if (data_version != -1)
+            printlog(LOG_DEBUG, "database was changed by another process");
+        script_cache_clear();
+        data_version = version;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+struct script_cache_entry {
+    int64_t job_id;
+    char *method_name;
+    int fd;             /* -1 if the job does not have this method */
+    LIST_ENTRY(script_cache_entry) entries;
+};
+
+static LIST_HEAD(, script_cache_entry) script_cache = LIST_HEAD_INITIALIZER(script_cache);
+
+static void
+entry_free(struct script_cache_entry *ent)
+{
+    LIST_REMOVE(ent, entries);
+    if (ent->fd >= 0)
+        (void) close(ent->fd);
+    free(ent->method_name);
+    free(ent);
+}
+
+static int
+build_script(int *fd, int64_t job_id, const char *method_name)
+{
+    static const char prologue[] = "exec 3<&-\n";
+    char CLEANUP_STR *script = NULL;
+    char name[64];
+    size_t len;
+    ssize_t written;
+    int memfd;
+
+    *fd = -1;
+    if (job_get_method(&script, job_id, method_name) < 0)
+        return -1;
+    if (!script)
+        return 0;
+
+    snprintf(name, sizeof(name), "%s.%s", job_id_to_str(job_id), method_name);
+    memfd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return printlog(LOG_ERR, "memfd_create(2): %s", strerror(errno));
+
+    len = strlen(script);
+    if (write(memfd, prologue, sizeof(prologue) - 1) != sizeof(prologue) - 1)
+        goto err_out;
+    for (size_t pos = 0; pos < len; pos += (size_t) written) {
+        written = write(memfd, script + pos, len - pos);
+        if (written < 0)
+            goto err_out;
+    }
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+        goto err_out;
+
+    *fd = memfd;
+    return 0;
+
+err_out:
+    printlog(LOG_ERR, "unable to build the `%s' method of job `%s': %s",
+            method_name, job_id_to_str(job_id), strerror(errno));
+    (void) close(memfd);
+    return -1;
+}
+
+int
+script_cache_lookup(int *fd, int64_t job_id, const char *method_name)
+{
+    struct script_cache_entry *ent;
+
+    *fd = -1;
+    LIST_FOREACH(ent, &script_cache, entries) {
+        if (ent->job_id == job_id && !strcmp(ent->method_name, method_name)) {
+            *fd = ent->fd;
+            return 0;
+        }
+    }
+
+    ent = calloc(1, sizeof(*ent));
+    if (!ent)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    ent->job_id = job_id;
+    ent->method_name = strdup(method_name);
+    if (!ent->method_name) {
+        free(ent);
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    }
+    if (build_script(&ent->fd, job_id, method_name) < 0) {
+        free(ent->method_name);
+        free(ent);
+        return -1;
+    }
+    LIST_INSERT_HEAD(&script_cache, ent, entries);
+    printlog(LOG_DEBUG, "cached the `%s' method of job `%s'", method_name, job_id_to_str(job_id));
+
+    *fd = ent->fd;
+    return 0;
+}
+
+static void
+invalidate_scripts(int64_t job_id)
+{
+    struct script_cache_entry *ent, *tmp;
+
+    LIST_FOREACH_SAFE(ent, &script_cache, entries, tmp) {
+        if (ent->job_id == job_id)
+            entry_free(ent);
+    }
+}
+
+static void
+clear_scripts(void)
+{
+    while (!LIST_EMPTY(&script_cache))
+        entry_free(LIST_FIRST(&script_cache));
+}
+
+#else
+
+int script_cache_lookup(int *fd, int64_t job_id __attribute__((unused)),
+        const char *method_name __attribute__((unused)))
+{
+    *fd = -1;
+    return (-1);
+}
+static void invalidate_scripts(int64_t job_id __attribute__((unused))) {}
+static void clear_scripts(void) {}
+
+#endif /* __linux__ */
+
+void
+script_cache_invalidate(int64_t job_id)
+{
+    struct settings_cache_entry *ent, *tmp;
+
+    invalidate_scripts(job_id);
+    LIST_FOREACH_SAFE(ent, &settings_cache, entries, tmp) {
+        if (ent->job_id == job_id)
+            settings_entry_free(ent);
+    }
+}
+
+void
+script_cache_clear(void)
+{
+    clear_scripts();
+    while (!LIST_EMPTY(&settings_cache))
+        settings_entry_free(LIST_FIRST(&settings_cache));
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SCRIPT_CACHE_H
+#define _SCRIPT_CACHE_H
+
+#include <stdint.h>
+
+/*
+ * A cache of method scripts.
+ *
+ * Each script is built once, including the property preamble, into a
+ * sealed memfd. The child of a method is given the memfd as file descriptor
+ * SCRIPT_CACHE_FILENO, and runs "/bin/sh /proc/self/fd/3"; the first line
+ * of every cached script closes the descriptor again.
+ *
+ * The cache also keeps the settings of each job that every spawn needs,
+ * such as its credentials and resource limits, so that spawning a job does
+ * not query the database.
+ *
+ * Entries are dropped when the properties of a job are changed by jobd
+ * itself. Changes that another process has written to the database are
+ * noticed by script_cache_revalidate(), which is called once per
+ * scheduling pass or request rather than for every spawn.
+ *
+ * On systems without memfd_create(2), script_cache_lookup() always fails
+ * and the caller should pass the script on the command line instead.
+ */
+
+#define SCRIPT_CACHE_FILENO 3
+
+struct spawn_settings;
+
+/* Sets *fd to -1 if the job has no such method */
+int script_cache_lookup(int *fd, int64_t job_id, const char *method_name);
+/* Returns NULL on failure */
+const struct spawn_settings *script_cache_get_settings(int64_t job_id);
+/* Drop everything if another process has committed changes to the database */
+int script_cache_revalidate(void);
+void script_cache_invalidate(int64_t job_id);
+void script_cache_clear(void);
+
+#endif /* _SCRIPT_CACHE_H */
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "logger.h"
+#include "status_page.h"
+
+/* A reader gives up on a slot that stays locked for this many tries */
+#define STATUS_PAGE_RETRY_MAX (1 << 20)
+
+#define STATUS_PAGE_SIZE (sizeof(struct status_page) + STATUS_PAGE_SLOTS * sizeof(struct status_page_slot))
+
+static struct status_page *page;
+static char *page_path;
+static uint32_t slots_used;    /* Including removed ones */
+
+static uint32_t
+hash_label(const char *label)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+    /* FNV-1a */
+    for (; *label; label++)
+        h = (h ^ (unsigned char) *label) * UINT64_C(0x100000001b3);
+    return ((uint32_t) h);
+}
+
+static char *
+make_path(void)
+{
+    char *path;
+
+    if (asprintf(&path, "%s/%s/jobd.status", compile_time_option.runstatedir,
+            compile_time_option.project_name) < 0) {
+        printlog(LOG_ERR, "asprintf(3): %s", strerror(errno));
+        return (NULL);
+    }
+    return (path);
+}
+
+/* The writer side of the sequence locks */
+
+static void
+write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+int
+status_page_init(void)
+{
+    char *tmp_path = NULL;
+    void *p;
+    int fd;
+
+    if (!(page_path = make_path()))
+        return -1;
+    if (asprintf(&tmp_path, "%s.new", page_path) < 0)
+        return printlog(LOG_ERR, "asprintf(3): %s", strerror(errno));
+
+    /* Build the new page aside, so that readers never see it half-initialized */
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printlog(LOG_ERR, "open(2) of %s: %s", tmp_path, strerror(errno));
+        goto err_out;
+    }
+    if (ftruncate(fd, STATUS_PAGE_SIZE) < 0) {
+        printlog(LOG_ERR, "ftruncate(2): %s", strerror(errno));
+        goto err_out;
+    }
+    p = mmap(NULL, STATUS_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        printlog(LOG_ERR, "mmap(2): %s", strerror(errno));
+        goto err_out;
+    }
+    (void) close(fd);
+    fd = -1;
+
+    page = p;
+    page->magic = STATUS_PAGE_MAGIC;
+    page->version = STATUS_PAGE_VERSION;
+    page->slot_count = STATUS_PAGE_SLOTS;
+    page->slot_size = sizeof(struct status_page_slot);
+    page->pid = (int32_t) getpid();
+    if (rename(tmp_path, page_path) < 0) {
+        printlog(LOG_ERR, "rename(2) of %s: %s", tmp_path, strerror(errno));
+        goto err_out;
+    }
+    free(tmp_path);
+    return 0;
+
+err_out:
+    if (fd >= 0)
+        (void) close(fd);
+    (void) unlink(tmp_path);
+    free(tmp_path);
+    status_page_shutdown();
+    return -1;
+}
+
+void
+status_page_shutdown(void)
+{
+    if (page) {
+        (void) munmap(page, STATUS_PAGE_SIZE);
+        (void) unlink(page_path);
+        page = NULL;
+    }
+    free(page_path);
+    page_path = NULL;
+    slots_used = 0;
+}
+
+/* Returns the slot of the label, or -1 */
+static int
+find_slot(const char *label)
+{
+    uint32_t mask = STATUS_PAGE_SLOTS - 1;
+    uint32_t i, n;
+
+    for (i = hash_label(label) & mask, n = 0; n < STATUS_PAGE_SLOTS; i = (i + 1) & mask, n++) {
+        if (page->slots[i].kind == STATUS_PAGE_EMPTY)
+            break;
+        if (page->slots[i].kind == STATUS_PAGE_USED && !strcmp(page->slots[i].label, label))
+            return ((int) i);
+    }
+    return (-1);
+}
+
+static void
+insert_slot(const struct status_page_slot *status)
+{
+    uint32_t mask = STATUS_PAGE_SLOTS - 1;
+    struct status_page_slot *slot;
+    uint32_t i;
+
+    for (i = hash_label(status->label) & mask; page->slots[i].kind == STATUS_PAGE_USED; i = (i + 1) & mask)
+        ;
+    slot = &page->slots[i];
+    if (slot->kind == STATUS_PAGE_EMPTY)
+        slots_used++;
+    write_begin(&slot->seq);
+    memcpy((char *) slot + sizeof(slot->seq), (const char *) status + sizeof(status->seq),
+            sizeof(*slot) - sizeof(slot->seq));
+    slot->kind = STATUS_PAGE_USED;
+    write_end(&slot->seq);
+}
+
+/* Drop the removed slots once they make up too much of the page */
+static int
+compact(void)
+{
+    struct status_page_slot *live;
+    uint32_t i, count = 0;
+
+    live = calloc(STATUS_PAGE_SLOTS, sizeof(*live));
+    if (!live)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    for (i = 0; i < STATUS_PAGE_SLOTS; i++) {
+        if (page->slots[i].kind == STATUS_PAGE_USED)
+            live[count++] = page->slots[i];
+    }
+
+    write_begin(&page->seq);
+    for (i = 0; i < STATUS_PAGE_SLOTS; i++) {
+        write_begin(&page->slots[i].seq);
+        page->slots[i].kind = STATUS_PAGE_EMPTY;
+        write_end(&page->slots[i].seq);
+    }
+    slots_used = 0;
+    for (i = 0; i < count; i++)
+        insert_slot(&live[i]);
+    write_end(&page->seq);
+
+    free(live);
+    printlog(LOG_DEBUG, "compacted the status page to %u job(s)", count);
+    return 0;
+}
+
+void
+status_page_remove(const char *label)
+{
+    struct status_page_slot *slot;
+    int i;
+
+    if (!page || (i = find_slot(label)) < 0)
+        return;
+    slot = &page->slots[i];
+    write_begin(&slot->seq);
+    slot->kind = STATUS_PAGE_REMOVED;
+    write_end(&slot->seq);
+}
+
+void
+status_page_update(const struct status_page_slot *status)
+{
+    struct status_page_slot *slot;
+    uint32_t i;
+    int found;
+
+    if (!page)
+        return;
+    if (strlen(status->label) >= STATUS_PAGE_LABEL_MAX)
+        return;
+
+    found = find_slot(status->label);
+    if (found >= 0) {
+        slot = &page->slots[found];
+        write_begin(&slot->seq);
+        memcpy((char *) slot + sizeof(slot->seq), (const char *) status + sizeof(status->seq),
+                sizeof(*slot) - sizeof(slot->seq));
+        slot->kind = STATUS_PAGE_USED;
+        write_end(&slot->seq);
+        return;
+    }
+
+    /* A new job, or a new label for one; the old label has to go */
+    for (i = 0; i < STATUS_PAGE_SLOTS; i++) {
+        slot = &page->slots[i];
+        if (slot->kind == STATUS_PAGE_USED && slot->job_id == status->job_id) {
+            write_begin(&slot->seq);
+            slot->kind = STATUS_PAGE_REMOVED;
+            write_end(&slot->seq);
+        }
+    }
+    /* Keep the load factor, including removed slots, below 3/4 */
+    if ((slots_used + 1) * 4 >= STATUS_PAGE_SLOTS * 3 && compact() < 0)
+        return;
+    if ((slots_used + 1) * 4 >= STATUS_PAGE_SLOTS * 3) {
+        printlog(LOG_WARNING, "the status page is full; leaving out %s", status->label);
+        return;
+    }
+    insert_slot(status);
+}
+
+int
+status_page_open(const struct status_page **result)
+{
+    struct status_page *p;
+    char *path;
+    struct stat sb;
+    int fd;
+
+    *result = NULL;
+    if (!(path = make_path()))
+        return -1;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printlog(LOG_ERR, "open(2) of %s: %s", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    free(path);
+    if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < sizeof(*p)) {
+        (void) close(fd);
+        return printlog(LOG_ERR, "the status page is too short");
+    }
+    p = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (p == MAP_FAILED)
+        return printlog(LOG_ERR, "mmap(2): %s", strerror(errno));
+
+    if (p->magic != STATUS_PAGE_MAGIC || p->version != STATUS_PAGE_VERSION ||
+            p->slot_size != sizeof(struct status_page_slot) ||
+            p->slot_count == 0 || (p->slot_count & (p->slot_count - 1)) ||
+            (size_t) sb.st_size < sizeof(*p) + (size_t) p->slot_count * p->slot_size) {
+        (void) munmap(p, (size_t) sb.st_size);
+        return printlog(LOG_ERR, "the status page has an unknown layout");
+    }
+    *result = p;
+    return 0;
+}
+
+void
+status_page_close(const struct status_page *p)
+{
+    if (p)
+        (void) munmap((void *) p, sizeof(*p) + (size_t) p->slot_count * p->slot_size);
+}
+
+/* The reader side of the sequence locks */
+static int
+read_slot(const struct status_page_slot *slot, struct status_page_slot *copy)
+{
+    uint32_t seq;
+
+    for (int tries = 0; tries < STATUS_PAGE_RETRY_MAX; tries++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(copy, slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            copy->label[STATUS_PAGE_LABEL_MAX - 1] = '\0';
+            return 0;
+        }
+    }
+    return printlog(LOG_ERR, "a slot of the status page stayed locked");
+}
+
+int
+status_page_read(const struct status_page *p, uint32_t index, struct status_page_slot *result)
+{
+    if (index >= p->slot_count)
+        return 1;
+    if (read_slot(&p->slots[index], result) < 0)
+        return -1;
+    return (result->kind == STATUS_PAGE_USED ? 0 : 1);
+}
+
+int
+status_page_lookup(const struct status_page *p, const char *label, struct status_page_slot *result)
+{
+    uint32_t mask = p->slot_count - 1;
+    uint32_t seq, i, n;
+    int rv;
+
+    for (int tries = 0; tries < STATUS_PAGE_RETRY_MAX; tries++) {
+        seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        rv = 1;
+        for (i = hash_label(label) & mask, n = 0; n < p->slot_count; i = (i + 1) & mask, n++) {
+            if (read_slot(&p->slots[i], result) < 0)
+                return -1;
+            if (result->kind == STATUS_PAGE_EMPTY)
+                break;
+            if (result->kind == STATUS_PAGE_USED && !strcmp(result->label, label)) {
+                rv = 0;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) == seq)
+            return (rv);
+    }
+    return printlog(LOG_ERR, "the status page stayed locked");
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _STATUS_PAGE_H
+#define _STATUS_PAGE_H
+
+#include <stdint.h>
+
+/*
+ * A read-only status page, for monitoring tools that poll the status of
+ * jobs too often to ask jobd each time.
+ *
+ * jobd keeps <runstatedir>/jobd/jobd.status mapped, and updates the slot of
+ * a job in place whenever its entry in the job table changes. Readers map
+ * the file with PROT_READ, and need no system calls to look up a job.
+ *
+ * The file is a header followed by a fixed number of slots, laid out as
+ * below. A job is found by hashing its label with 64-bit FNV-1a, and probing
+ * linearly from the low bits of the hash until the label or an empty slot
+ * is found.
+ *
+ * Each slot is guarded by a sequence lock: seq is odd while jobd is writing
+ * to the slot, so a reader copies the slot, and tries again if seq was odd
+ * or changed meanwhile. The seq of the header is bumped the same way when
+ * the slots are rearranged, which a lookup must also check.
+ *
+ * The file is replaced when jobd starts, so long-running readers should
+ * check that the pid in the header is still alive, and map it again if not.
+ */
+
+#define STATUS_PAGE_MAGIC   0x4a4f4244U     /* "JOBD" */
+#define STATUS_PAGE_VERSION 1
+
+/* Must be a power of two */
+#define STATUS_PAGE_SLOTS 4096
+
+/* Jobs with longer labels are left out */
+#define STATUS_PAGE_LABEL_MAX 64
+
+/* How a job last terminated */
+enum {
+    STATUS_PAGE_NEVER_RAN,
+    STATUS_PAGE_SIGNALED,
+    STATUS_PAGE_EXITED,
+};
+
+/* The kinds of slot */
+enum {
+    STATUS_PAGE_EMPTY,
+    STATUS_PAGE_USED,
+    STATUS_PAGE_REMOVED,    /* Probing continues past it */
+};
+
+struct status_page_slot {
+    uint32_t seq;
+    uint32_t kind;
+    int64_t job_id;
+    char label[STATUS_PAGE_LABEL_MAX];
+    char state[16];         /* As shown by jobstat */
+    int32_t pid;            /* 0 if the job has no process */
+    uint32_t restarts;      /* Starts after the first, since jobd started */
+    uint32_t last_exit;     /* STATUS_PAGE_NEVER_RAN, _SIGNALED or _EXITED */
+    int32_t last_status;    /* The exit status or signal number */
+    int64_t last_exit_time; /* Seconds since the epoch */
+};
+
+struct status_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    int32_t pid;            /* Of jobd */
+    struct status_page_slot slots[];
+};
+
+/* For jobd */
+int status_page_init(void);
+void status_page_shutdown(void);
+/* Publish the status of a job; seq and kind are ignored */
+void status_page_update(const struct status_page_slot *status);
+void status_page_remove(const char *label);
+
+/* For readers */
+int status_page_open(const struct status_page **page);
+void status_page_close(const struct status_page *page);
+/* Copy the slot of a job into result. Returns 1 if there is no such job. */
+int status_page_lookup(const struct status_page *page, const char *label,
+        struct status_page_slot *result);
+/* Copy a slot, for iterating over all of them. Returns 1 if the slot is not in use. */
+int status_page_read(const struct status_page *page, uint32_t index,
+        struct status_page_slot *result);
+
+#endif /* _STATUS_PAGE_H */
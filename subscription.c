@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "ipc.h"
+#include "ipc_frame.h"
+#include "job_table.h"
+#include "logger.h"
+#include "memory.h"
+#include "queue.h"
+#include "subscription.h"
+
+#define SUBSCRIBE_STATE 0x1
+#define SUBSCRIBE_STARTED 0x2
+#define SUBSCRIBE_EXIT  0x4
+
+static const struct {
+    const char *name;
+    int flag;
+} event_names[] = {
+    { "state", SUBSCRIBE_STATE },
+    { "started", SUBSCRIBE_STARTED },
+    { "exit", SUBSCRIBE_EXIT },
+};
+
+struct subscription {
+    int fd;
+    void (*backlog_changed)(void *);
+    void *ctx;
+    bool binary;
+    char *patterns;
+    uint32_t states;        /* A bit for each job_state; 0 for all of them */
+    int events;
+    char *queue[SUBSCRIPTION_QUEUE_MAX];
+    size_t head;
+    size_t len;
+    uint64_t dropped;
+    bool writing;           /* Waiting for the connection to become writable */
+    bool failed;
+    LIST_ENTRY(subscription) entries;
+};
+
+static LIST_HEAD(, subscription) subscriptions = LIST_HEAD_INITIALIZER(subscriptions);
+
+static int
+parse_events(int *result, const char *events)
+{
+    char CLEANUP_STR *copy = NULL;
+    char *name, *next;
+    size_t i;
+
+    *result = 0;
+    if (!events || events[0] == '\0') {
+        *result = SUBSCRIBE_STATE | SUBSCRIBE_STARTED | SUBSCRIBE_EXIT;
+        return 0;
+    }
+    if (!(copy = strdup(events)))
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    for (next = copy; (name = strsep(&next, ",")) != NULL;) {
+        for (i = 0; i < sizeof(event_names) / sizeof(event_names[0]); i++) {
+            if (!strcmp(name, event_names[i].name))
+                break;
+        }
+        if (i == sizeof(event_names) / sizeof(event_names[0]))
+            return printlog(LOG_ERR, "unknown event: %s", name);
+        *result |= event_names[i].flag;
+    }
+    return 0;
+}
+
+int
+subscription_new(struct subscription **sub, int fd, void (*backlog_changed)(void *), void *ctx,
+        bool binary, const char *patterns, const char *states, const char *events)
+{
+    struct subscription *s;
+
+    *sub = NULL;
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    s->fd = fd;
+    s->backlog_changed = backlog_changed;
+    s->ctx = ctx;
+    s->binary = binary;
+    if (job_parse_states(&s->states, states) < 0 || parse_events(&s->events, events) < 0) {
+        free(s);
+        return -1;
+    }
+    if (!(s->patterns = strdup(patterns ? patterns : ""))) {
+        free(s);
+        return printlog(LOG_ERR, "strdup(3): %s", strerror(errno));
+    }
+    LIST_INSERT_HEAD(&subscriptions, s, entries);
+    printlog(LOG_DEBUG, "connection %d subscribed to `%s'", fd, s->patterns);
+
+    *sub = s;
+    return 0;
+}
+
+void
+subscription_free(struct subscription *sub)
+{
+    if (!sub)
+        return;
+    LIST_REMOVE(sub, entries);
+    while (sub->len > 0) {
+        free(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % SUBSCRIPTION_QUEUE_MAX;
+        sub->len--;
+    }
+    free(sub->patterns);
+    free(sub);
+}
+
+/* Returns 1 if the connection is full */
+static int
+send_message(struct subscription *sub, const char *msg)
+{
+    char frame[IPC_MAX_MSGLEN];
+    size_t len = strlen(msg);
+
+    if (sub->binary) {
+        if (ipc_frame_encode_event(frame, sizeof(frame), &len, msg) < 0)
+            return 0;   /* Skip it, rather than getting stuck */
+        msg = frame;
+    }
+    if (send(sub->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        sub->failed = true;
+        return printlog(LOG_ERR, "send(2) to subscriber %d: %s", sub->fd, strerror(errno));
+    }
+    return 0;
+}
+
+int
+subscription_flush(struct subscription *sub)
+{
+    char notice[128];
+    int rv = 0;
+
+    if (sub->failed)
+        return -1;
+    if (sub->dropped > 0) {
+        snprintf(notice, sizeof(notice),
+                "{\"jsonrpc\":\"2.0\",\"method\":\"event\",\"params\":{\"event\":\"dropped\",\"count\":%llu}}",
+                (unsigned long long) sub->dropped);
+        rv = send_message(sub, notice);
+        if (rv == 0)
+            sub->dropped = 0;
+    }
+    while (rv == 0 && sub->len > 0) {
+        rv = send_message(sub, sub->queue[sub->head]);
+        if (rv == 0) {
+            free(sub->queue[sub->head]);
+            sub->head = (sub->head + 1) % SUBSCRIPTION_QUEUE_MAX;
+            sub->len--;
+        }
+    }
+    if (rv < 0)
+        return -1;
+
+    /* Only ask to hear about writability while there is a backlog */
+    if ((rv == 1) != sub->writing) {
+        sub->writing = (rv == 1);
+        sub->backlog_changed(sub->ctx);
+    }
+    return 0;
+}
+
+bool
+subscription_backlogged(const struct subscription *sub)
+{
+    return (sub->writing);
+}
+
+static void
+enqueue(struct subscription *sub, const char *msg)
+{
+    char *copy;
+
+    if (sub->failed || !(copy = strdup(msg)))
+        return;
+    if (sub->len == SUBSCRIPTION_QUEUE_MAX) {
+        free(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % SUBSCRIPTION_QUEUE_MAX;
+        sub->len--;
+        if (sub->dropped++ == 0)
+            printlog(LOG_WARNING, "subscriber %d is not keeping up; dropping events", sub->fd);
+    }
+    sub->queue[(sub->head + sub->len) % SUBSCRIPTION_QUEUE_MAX] = copy;
+    sub->len++;
+    if (!sub->writing)
+        (void) subscription_flush(sub);
+}
+
+static const char *
+label_of(job_id_t id)
+{
+    struct job_table_entry *jte = job_table_lookup_by_id(id);
+
+    return (jte ? jte->jte_label : job_id_to_str(id));
+}
+
+/* The params are everything after the label, without the closing braces */
+static void
+publish(job_id_t id, int event, enum job_state state, const char *name, const char *params)
+{
+    struct subscription *sub;
+    const char *label = NULL;
+    char escaped[JOB_ID_MAX * JSONRPC_ESCAPE_MAX + 1];
+    char msg[sizeof(escaped) + 256];
+
+    LIST_FOREACH(sub, &subscriptions, entries) {
+        if (!(sub->events & event))
+            continue;
+        if (sub->states && !(sub->states & (1U << state)))
+            continue;
+        if (!label) {
+            label = label_of(id);
+            (void) jsonrpc_escape(escaped, sizeof(escaped), label);
+            snprintf(msg, sizeof(msg),
+                    "{\"jsonrpc\":\"2.0\",\"method\":\"event\",\"params\":"
+                    "{\"event\":\"%s\",\"job_id\":\"%s\"%s}}", name, escaped, params);
+        }
+        if (job_label_matches(label, sub->patterns))
+            enqueue(sub, msg);
+    }
+}
+
+void
+subscription_publish_state(job_id_t id, enum job_state state)
+{
+    char params[64];
+
+    if (LIST_EMPTY(&subscriptions))
+        return;
+    snprintf(params, sizeof(params), ",\"state\":\"%s\"", job_state_to_str(state));
+    publish(id, SUBSCRIBE_STATE, state, "state", params);
+    if (state == JOB_STATE_RUNNING)
+        publish(id, SUBSCRIBE_STARTED, state, "started", "");
+}
+
+void
+subscription_publish_exit(job_id_t id, int status)
+{
+    char params[64];
+    enum job_state state;
+
+    if (LIST_EMPTY(&subscriptions))
+        return;
+    if (WIFSIGNALED(status))
+        snprintf(params, sizeof(params), ",\"signal\":%d", WTERMSIG(status));
+    else
+        snprintf(params, sizeof(params), ",\"status\":%d", WEXITSTATUS(status));
+    if (job_get_cached_state(&state, id) < 0)
+        return;
+    publish(id, SUBSCRIBE_EXIT, state, "exit", params);
+}
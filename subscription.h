@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SUBSCRIPTION_H
+#define _SUBSCRIPTION_H
+
+#include <stdbool.h>
+
+#include "job.h"
+
+/*
+ * Clients on a persistent IPC connection can subscribe to the events of
+ * jobs, instead of polling for them. Each event is pushed to the client as
+ * a JSON-RPC notification:
+ *
+ *      {"jsonrpc":"2.0","method":"event","params":{"event":"state",...}}
+ *
+ * The events are:
+ *
+ *      state   the job changed state; "state" is the new state
+ *      started the main process of the job has executed its program; jobd
+ *              does not know when a job is ready to do its work
+ *      exit    the main process of the job exited; "status" or "signal"
+ *
+ * A subscription can be narrowed by label patterns, the new state, and the
+ * kind of event. Events are queued for each client and written whenever
+ * the connection is writable. If a client falls SUBSCRIPTION_QUEUE_MAX
+ * events behind, the oldest are dropped, and a "dropped" event with a
+ * count is sent once the client catches up.
+ */
+
+#define SUBSCRIPTION_QUEUE_MAX 256
+
+struct subscription;
+
+/*
+ * Empty or NULL filters match everything. Filters are comma-separated lists.
+ * If binary is set, the events are wrapped in frames; see ipc_frame.h.
+ *
+ * The owner of the connection decides what to wait for on it, so it is told
+ * through backlog_changed(ctx) whenever subscription_backlogged() changes.
+ */
+int subscription_new(struct subscription **sub, int fd, void (*backlog_changed)(void *), void *ctx,
+        bool binary, const char *patterns, const char *states, const char *events);
+void subscription_free(struct subscription *sub);
+/* Called when the connection is writable. Fails if the client has gone away. */
+int subscription_flush(struct subscription *sub);
+/* True while events are waiting for the connection to become writable */
+bool subscription_backlogged(const struct subscription *sub);
+
+void subscription_publish_state(job_id_t id, enum job_state state);
+void subscription_publish_exit(job_id_t id, int status);
+
+#endif /* _SUBSCRIPTION_H */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send one raw message to a socket of jobd, and print the response. The
+ * tools all use libjobd, which only sends frames over the session socket,
+ * so this is what exercises JSON-RPC over both sockets.
+ *
+ * usage: ipc_send datagram|session socket message
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Long enough for jobd to answer */
+#define RESPONSE_TIMEOUT_SEC 10
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un saun;
+    char buf[65536];
+    ssize_t bytes;
+    int sd, type;
+
+    if (argc != 4)
+        errx(1, "usage: ipc_send datagram|session socket message");
+    if (!strcmp(argv[1], "datagram"))
+        type = SOCK_DGRAM;
+    else if (!strcmp(argv[1], "session"))
+        type = SOCK_SEQPACKET;
+    else
+        errx(1, "unknown socket type: %s", argv[1]);
+
+    /* Fails the test by killing it, if jobd never answers */
+    alarm(RESPONSE_TIMEOUT_SEC);
+
+    sd = socket(AF_UNIX, type, 0);
+    if (sd < 0)
+        err(1, "socket");
+    memset(&saun, 0, sizeof(saun));
+    saun.sun_family = AF_UNIX;
+    /* Autobind to an abstract address, so that jobd has somewhere to send the datagram back to */
+    if (type == SOCK_DGRAM && bind(sd, (struct sockaddr *) &saun, sizeof(sa_family_t)) < 0)
+        err(1, "bind");
+    if (strlen(argv[2]) >= sizeof(saun.sun_path))
+        errx(1, "socket path is too long");
+    strncpy(saun.sun_path, argv[2], sizeof(saun.sun_path) - 1);
+    if (connect(sd, (struct sockaddr *) &saun, sizeof(saun)) < 0)
+        err(1, "connect to %s", argv[2]);
+
+    if (send(sd, argv[3], strlen(argv[3]), 0) < 0)
+        err(1, "send");
+    bytes = recv(sd, buf, sizeof(buf) - 1, 0);
+    if (bytes < 0)
+        err(1, "recv");
+    if (bytes == 0)
+        errx(1, "jobd closed the connection");
+    buf[bytes] = '\0';
+    printf("%s\n", buf);
+
+    (void) close(sd);
+    exit(EXIT_SUCCESS);
+}
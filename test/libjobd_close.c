@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Close a client of libjobd while a request is waiting for its response,
+ * which must neither hang nor call the callback of the request.
+ *
+ * usage: libjobd_close socket job
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libjobd.h"
+
+/* Long enough for jobd to answer, if it was going to be waited for */
+#define CLOSE_TIMEOUT_SEC 10
+
+static int called;
+
+static void
+response(void *ctx __attribute__((unused)), int retcode __attribute__((unused)),
+        const char *result __attribute__((unused)))
+{
+    called = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct jobd_client *client;
+
+    if (argc != 3)
+        errx(1, "usage: libjobd_close socket job");
+
+    /* Fails the test by killing it, if jobd_close() never returns */
+    alarm(CLOSE_TIMEOUT_SEC);
+
+    if (jobd_open(&client, argv[1]) < 0)
+        errx(1, "jobd_open: %s", jobd_last_error());
+    if (jobd_request(client, argv[2], "status", response, NULL) < 0)
+        errx(1, "jobd_request: %s", jobd_last_error());
+    if (jobd_pending(client) != 1)
+        errx(1, "the request is not pending");
+    jobd_close(client);
+    if (called)
+        errx(1, "the callback of a dropped request was called");
+
+    printf("closed a client with a pending request\n");
+    exit(EXIT_SUCCESS);
+}
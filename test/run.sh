@@ -27,6 +27,9 @@ trap cleanup EXIT
 ulimit -H -c unlimited >/dev/null
 ulimit -S -c unlimited >/dev/null
 
+# The event loop backend to test; jobd uses epoll if this is empty
+backend="$1"
+
 objdir="./test/obj"
 ./test/build.sh
 
@@ -41,21 +44,96 @@ set +x
 touch $logfile
 tail -f $logfile &
 tail_pid=$!
-$objdir/sbin/jobd -fvv > $logfile 2>&1 &
+$objdir/sbin/jobd -fvv ${backend:+-e $backend} > $logfile 2>&1 &
 #valgrind --tool=memcheck --leak-check=yes --show-reachable=yes --num-callers=20 --track-fds=yes $objdir/sbin/jobd -fvv > $logfile 2>&1 &
 jobd_pid=$!
 
+# Test the event loop backend
+[ "$backend" != io_uring ] || assert_contains 'using the io_uring event loop'
 
 # Test if a job finishes
 assert_contains 'job sleep1 .* exited'
 
+# Test resource limits
+assert_contains 'job rlimits .* exited with status=0'
+
+# Test a job that cannot be started
+assert_contains "job .exec_failed.: method .start. failed before execve(2): working_directory"
+
+# Test the shared runner
+assert_contains 'job shared_runner (shared runner) exited with status=0'
+
+# Test output capture
+assert_contains 'job output .* exited with status=0'
+$objdir/bin/jobadm output logs | grep -q 'hello from stderr' || err 'output was not captured'
+[ "$($objdir/bin/jobadm output logs | grep -c 'hello from std')" = 2 ] || err 'the output tail has duplicates'
+
+# Test log rotation
+assert_contains 'rotated the log of job .log_rotate.'
+
 # Test IPC
+$objdir/bin/jobadm -w enable_me > $objdir/events.txt &
+assert_contains 'subscribed to .enable_me.'
 $objdir/bin/jobadm jobd reopen_database
+$objdir/bin/jobprop enable_me.enabled | grep -qx 0 || err 'job was enabled already'
 $objdir/bin/jobadm enable_me enable
 assert_contains 'job enable_me has been enabled'
 assert_contains 'job enable_me .* exited'
+$objdir/bin/jobprop enable_me.enabled | grep -qx 1 || err 'enabled property was not updated'
 $objdir/bin/jobadm enable_me disable
 assert_contains 'job enable_me has been disabled'
+$objdir/bin/jobprop enable_me.enabled | grep -qx 0 || err 'disabled property was not updated'
+grep -q '"event":"started","job_id":"enable_me"' $objdir/events.txt || err 'no event was pushed'
+
+# Test closing a client of libjobd before jobd has answered it
+./test/libjobd_close "$RUNSTATEDIR/$PROJECT_NAME/jobd-session.sock" sleep1 \
+    || err 'libjobd_close failed'
+
+# Test pipelined requests, answered out of order
+assert_contains 'job slow_stop started'
+printf 'slow_stop disable wait\nsleep1 status\nno_such_job status\n' \
+    | $objdir/bin/jobadm -s > $objdir/session.txt 2>&1 && err 'a failed request was not reported'
+grep -Eq '"state": "(stopped|disabled)"' $objdir/session.txt || err 'did not wait for slow_stop'
+grep -q '"label": "sleep1"' $objdir/session.txt || err 'no status for sleep1'
+grep -q 'no_such_job status: request failed' $objdir/session.txt || err 'no error for no_such_job'
+status_line=$(grep -n 'method=status job_id=sleep1' $logfile | head -1 | cut -d: -f1)
+exited_line=$(grep -n 'job slow_stop .* exited' $logfile | head -1 | cut -d: -f1)
+[ "$status_line" -lt "$exited_line" ] || err 'requests were not pipelined'
+# libjobd always uses the binary encoding
+grep -q 'no_such_job status: request failed with retcode 2' $objdir/session.txt \
+    || err 'no binary error response for no_such_job'
+assert_contains '<<< frame of [0-9]* bytes'
+
+# Test JSON-RPC over both sockets, which none of the tools use
+json_request='{"jsonrpc":"2.0","method":"status","id":"7","params":{"job_id":"sleep1"}}'
+./test/ipc_send session "$RUNSTATEDIR/$PROJECT_NAME/jobd-session.sock" "$json_request" \
+    | grep -q '^{"jsonrpc":"2.0","id":"7","result":".*sleep1' || err 'no JSON response on the session socket'
+./test/ipc_send datagram "$RUNSTATEDIR/$PROJECT_NAME/jobd.sock" "$json_request" \
+    | grep -q '^{"jsonrpc":"2.0","id":"7","result":".*sleep1' || err 'no JSON response on the datagram socket'
+./test/ipc_send session "$RUNSTATEDIR/$PROJECT_NAME/jobd-session.sock" \
+    '{"jsonrpc":"2.0","method":"status","id":"8","params":{"job_id":"no_such_job"}}' \
+    | grep -q '"id":"8","error":{"code":2' || err 'no JSON error response'
+
+# Test status queries
+$objdir/bin/jobprop property_vars.hello | grep -qx world || err 'property was not read'
+assert_contains 'loaded the status of [0-9]* job'
+$objdir/bin/jobadm --stream '' list | grep -q '"label": "property_vars"' || err 'list was not streamed'
+$objdir/bin/jobstat -p property_vars | grep -q 'property_vars' || err 'job is not on the status page'
+
+# Test bulk operations
+$objdir/bin/jobadm -m 'enable_*,nothing' enable | grep -q '"job_id": "enable_me", "retcode": 0' \
+    || err 'bulk enable failed'
+assert_contains 'bulk enable matched 1 job'
+
+# Start a job, and wait for its program to be executed
+$objdir/bin/jobadm --wait sleep1 start | grep -q '"state": "running"' \
+    || err 'did not wait for the job to start'
+
+# Wait for a job that cannot start, and learn which state it was left in
+$objdir/bin/jobadm --wait --timeout 0 exec_failed start 2> $objdir/wait.txt \
+    && err 'a wait that cannot succeed was reported as done'
+grep -Eq '^\{"state": "[a-z_]+"\}$' $objdir/wait.txt || err 'no state in the failed wait'
+grep -q '"state": "running"' $objdir/wait.txt && err 'a job that cannot start was running'
 
 # Disable a running job
 $objdir/bin/jobadm disable_me disable
@@ -77,6 +155,9 @@ echo 'done'
 # Run the jobstat command
 $objdir/bin/jobstat >> $logfile 2>&1
 assert_contains 'Label'
+$objdir/bin/jobstat -r > $objdir/runs.txt 2>&1 || err 'jobstat -r failed'
+grep -q 'P95' $objdir/runs.txt || err 'no run durations'
+grep -Eq '^[0-9]+ +sleep1 +[1-9][0-9]* +[0-9]+ +[0-9]+ +[0-9]+ +[0-9]+' $objdir/runs.txt || err 'no percentiles for sleep1'
 
 printf "\n\nSUCCESS: All tests passed.\n"
 exit 0
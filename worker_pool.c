@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+#endif /* __linux__ */
+
+#include "logger.h"
+#include "worker_pool.h"
+
+static int
+run_inline(void (*work)(void *), void (*done)(void *), void *ctx)
+{
+    work(ctx);
+    if (done)
+        done(ctx);
+    return 0;
+}
+
+#ifdef __linux__
+
+struct work_item {
+    void (*work)(void *);
+    void (*done)(void *);
+    void *ctx;
+    STAILQ_ENTRY(work_item) entries;
+};
+
+STAILQ_HEAD(work_queue, work_item);
+
+/* Everything below is protected by the lock, except for the eventfd and the threads */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    struct work_queue pending;      /* Waiting for a thread */
+    struct work_queue completed;    /* Waiting for done() to be called */
+    bool stopping;
+    int eventfd;
+    size_t nthreads;
+    pthread_t threads[WORKER_POOL_THREADS];
+} pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wakeup = PTHREAD_COND_INITIALIZER,
+        .pending = STAILQ_HEAD_INITIALIZER(pool.pending),
+        .completed = STAILQ_HEAD_INITIALIZER(pool.completed),
+        .eventfd = -1,
+};
+
+static void *
+worker_main(void *arg __attribute__((unused)))
+{
+    struct work_item *item;
+    uint64_t one = 1;
+
+    (void) pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (STAILQ_EMPTY(&pool.pending) && !pool.stopping)
+            (void) pthread_cond_wait(&pool.wakeup, &pool.lock);
+        /* Finish the queue before stopping, so that no work is lost */
+        if (STAILQ_EMPTY(&pool.pending))
+            break;
+        item = STAILQ_FIRST(&pool.pending);
+        STAILQ_REMOVE_HEAD(&pool.pending, entries);
+        (void) pthread_mutex_unlock(&pool.lock);
+
+        item->work(item->ctx);
+
+        (void) pthread_mutex_lock(&pool.lock);
+        STAILQ_INSERT_TAIL(&pool.completed, item, entries);
+        /* The counter only has to be non-zero; the queue says how much is done */
+        (void) write(pool.eventfd, &one, sizeof(one));
+    }
+    (void) pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+int
+worker_pool_init(void)
+{
+    sigset_t mask, oldmask;
+    size_t i;
+    int rv;
+
+    pool.eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pool.eventfd < 0)
+        return printlog(LOG_ERR, "eventfd(2): %s", strerror(errno));
+
+    /* Signals are handled by the event loop, so the threads must not receive any */
+    sigfillset(&mask);
+    (void) pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+    for (i = 0; i < WORKER_POOL_THREADS; i++) {
+        rv = pthread_create(&pool.threads[i], NULL, worker_main, NULL);
+        if (rv != 0) {
+            printlog(LOG_ERR, "pthread_create(3): %s", strerror(rv));
+            break;
+        }
+        pool.nthreads++;
+    }
+    (void) pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    if (pool.nthreads == 0) {
+        (void) close(pool.eventfd);
+        pool.eventfd = -1;
+        return -1;
+    }
+    printlog(LOG_DEBUG, "started %zu worker threads", pool.nthreads);
+    return 0;
+}
+
+void
+worker_pool_shutdown(void)
+{
+    size_t i;
+
+    if (pool.nthreads == 0)
+        return;
+
+    (void) pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    (void) pthread_cond_broadcast(&pool.wakeup);
+    (void) pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.nthreads; i++)
+        (void) pthread_join(pool.threads[i], NULL);
+    pool.nthreads = 0;
+
+    (void) worker_pool_dispatch_events();
+    (void) close(pool.eventfd);
+    pool.eventfd = -1;
+    pool.stopping = false;
+}
+
+int
+worker_pool_get_fd(void)
+{
+    return pool.eventfd;
+}
+
+int
+worker_pool_dispatch_events(void)
+{
+    struct work_queue completed = STAILQ_HEAD_INITIALIZER(completed);
+    struct work_item *item;
+    uint64_t count;
+
+    if (read(pool.eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return printlog(LOG_ERR, "read(2) of eventfd: %s", strerror(errno));
+
+    (void) pthread_mutex_lock(&pool.lock);
+    STAILQ_CONCAT(&completed, &pool.completed);
+    (void) pthread_mutex_unlock(&pool.lock);
+
+    while (!STAILQ_EMPTY(&completed)) {
+        item = STAILQ_FIRST(&completed);
+        STAILQ_REMOVE_HEAD(&completed, entries);
+        if (item->done)
+            item->done(item->ctx);
+        free(item);
+    }
+    return 0;
+}
+
+int
+worker_pool_submit(void (*work)(void *), void (*done)(void *), void *ctx)
+{
+    struct work_item *item;
+
+    if (pool.nthreads == 0)
+        return run_inline(work, done, ctx);
+
+    item = calloc(1, sizeof(*item));
+    if (!item)
+        return printlog(LOG_ERR, "calloc(3): %s", strerror(errno));
+    item->work = work;
+    item->done = done;
+    item->ctx = ctx;
+
+    (void) pthread_mutex_lock(&pool.lock);
+    STAILQ_INSERT_TAIL(&pool.pending, item, entries);
+    (void) pthread_cond_signal(&pool.wakeup);
+    (void) pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+#else
+
+int worker_pool_init(void) { return 0; }
+void worker_pool_shutdown(void) { }
+int worker_pool_get_fd(void) { return (-1); }
+int worker_pool_dispatch_events(void) { return 0; }
+int worker_pool_submit(void (*work)(void *), void (*done)(void *), void *ctx)
+{
+    return run_inline(work, done, ctx);
+}
+
+#endif /* __linux__ */
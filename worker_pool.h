@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2019 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+/*
+ * A small pool of threads for blocking work, such as NSS lookups, or walking
+ * and deleting rotated logs, that would otherwise stall the event loop.
+ *
+ * Everything else in jobd stays on the event loop thread. In particular,
+ * work() may only use a database connection that it owns, such as the one
+ * the WAL checkpointer opens, and never dbh. It must not call printlog(),
+ * or look at any state of jobd other than ctx.
+ * The caller copies whatever the work needs into ctx, and applies the
+ * results in done(), which runs on the event loop thread once the work has
+ * finished. An eventfd wakes up the loop when there are completions.
+ *
+ * If the pool is not running (it is only started by jobd, and only on
+ * Linux), worker_pool_submit() runs both functions before returning.
+ */
+
+#define WORKER_POOL_THREADS 4
+
+int worker_pool_init(void);
+/* Waits for all submitted work to finish */
+void worker_pool_shutdown(void);
+int worker_pool_get_fd(void);
+int worker_pool_dispatch_events(void);
+
+/* done() may be NULL; it is responsible for freeing ctx */
+int worker_pool_submit(void (*work)(void *), void (*done)(void *), void *ctx);
+
+#endif /* _WORKER_POOL_H */